@@ -123,7 +123,7 @@ int main(int argc, char *argv[])
 	methods[i].serialize(rt, mry);
 	end_s = clock();
 
-	nb_buffer_flush(mry);
+	nb_buffer_rewind(mry);
 
 	start_d = end_d = 0;
 	rt2 = NULL;
@@ -105,10 +105,7 @@ static nb_err_t recv_rta(struct nb *nb, struct rte_attr *attr)
 			break;
 		case BIRD_ORG_RTA_BGP_AS_PATH:
 			attr->type = RTE_ATTR_TYPE_BGP_AS_PATH;
-			nb_recv_array(nb, &attr->bgp_as_path);
-			for (i = 0; i < array_size(attr->bgp_as_path); i++)
-				nb_recv_i32(nb, &attr->bgp_as_path[i]);
-			nb_recv_array_end(nb);
+			nb_recv_u32_array(nb, (uint32_t **)&attr->bgp_as_path);
 			break;
 		case BIRD_ORG_RTA_BGP_COMMUNITY:
 			attr->type = RTE_ATTR_TYPE_BGP_COMMUNITY;
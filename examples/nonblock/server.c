@@ -1,6 +1,270 @@
 /*
  * Non-blocking sockets example
  * Server component
+ *
+ * The server publishes a feed of updates to all connected subscribers from
+ * a single thread. Every subscriber has a pair of socket buffers (see
+ * nb_buffer_new_socket), so a slow subscriber never blocks the others: its
+ * unsent data wait in the output buffer's backlog until poll() reports the
+ * socket writable, and the subscriber is dropped when the backlog grows too
+ * big.
+ *
+ * Subscribers may send commands (CBOR unsigned integers, see enum command).
+ * A command which has been received only partially is decoded again from
+ * the mark once the rest of it arrives.
+ *
+ * Usage: server PORT
  */
 
+#include "buffer.h"
+#include "cbor.h"
+#include "diag.h"
+#include "memory.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SUBSCRIBERS	4096
+#define MAX_PENDING	(256 * 1024)	/* drop subscribers lagging behind more */
+#define PUBLISH_PERIOD	100		/* ms */
+#define WINDOW_SIZE	512		/* most subscribers are idle most of the time */
+
+enum command
+{
+	CMD_PAUSE,	/* stop sending updates */
+	CMD_RESUME,	/* resume sending updates */
+};
+
+struct subscriber
+{
+	int sock;
+	struct nb_buffer *in;
+	struct nb_buffer *out;
+	struct cbor_stream cs_in;
+	struct cbor_stream cs_out;
+	bool paused;
+};
+
+static struct subscriber *subscribers[MAX_SUBSCRIBERS];
+static size_t num_subscribers;
+static struct diag diag;	/* disabled, the streams need one */
+static jmp_buf decode_error;
+
+
+static void cbor_error(struct cbor_stream *cs, nb_err_t err, void *arg)
+{
+	(void) cs;
+	(void) arg;
+	longjmp(decode_error, err);
+}
+
+
+static void add_subscriber(int sock)
+{
+	struct nb_buffer_opts opts = { .size = WINDOW_SIZE };
+	struct subscriber *sub;
+
+	if (num_subscribers == MAX_SUBSCRIBERS) {
+		close(sock);
+		return;
+	}
+
+	sub = nb_malloc(sizeof(*sub));
+	sub->sock = sock;
+	sub->in = nb_buffer_new_socket(sock, &opts);
+	sub->out = nb_buffer_new_socket(sock, &opts);
+	sub->paused = false;
+
+	cbor_stream_init(&sub->cs_in, sub->in);
+	cbor_stream_set_diag(&sub->cs_in, &diag);
+	cbor_stream_set_error_handler(&sub->cs_in, cbor_error, NULL);
+	cbor_stream_init(&sub->cs_out, sub->out);
+	cbor_stream_set_diag(&sub->cs_out, &diag);
+
+	subscribers[num_subscribers++] = sub;
+	fprintf(stderr, "subscriber %i connected\n", sock);
+}
+
+
+static void drop_subscriber(size_t i, const char *reason)
+{
+	struct subscriber *sub = subscribers[i];
+
+	fprintf(stderr, "subscriber %i dropped: %s\n", sub->sock, reason);
+
+	cbor_stream_free(&sub->cs_in);
+	cbor_stream_free(&sub->cs_out);
+	nb_buffer_delete(sub->in);
+	nb_buffer_delete(sub->out);
+	close(sub->sock);
+	xfree(sub);
+
+	subscribers[i] = subscribers[--num_subscribers];
+}
+
+
+/*
+ * Process all commands received from the subscriber. Returns false if the
+ * subscriber should be dropped.
+ */
+static bool receive_commands(struct subscriber *sub)
+{
+	uint32_t cmd;
+
+	for (;;) {
+		nb_buffer_socket_mark(sub->in);
+
+		switch (setjmp(decode_error)) {
+		case NB_ERR_OK:
+			break;
+		case NB_ERR_AGAIN:
+			nb_buffer_socket_reset(sub->in);	/* wait for the rest */
+			return true;
+		default:
+			return false;	/* disconnected or garbage */
+		}
+
+		cbor_decode_uint32(&sub->cs_in, &cmd);
+
+		switch (cmd) {
+		case CMD_PAUSE:
+			sub->paused = true;
+			break;
+		case CMD_RESUME:
+			sub->paused = false;
+			break;
+		default:
+			return false;
+		}
+	}
+}
+
+
+static void publish(uint64_t seq)
+{
+	struct subscriber *sub;
+	char text[32];
+	size_t i;
+
+	snprintf(text, sizeof(text), "update #%" PRIu64, seq);
+
+	for (i = 0; i < num_subscribers; i++) {
+		sub = subscribers[i];
+		if (sub->paused)
+			continue;
+
+		cbor_encode_array_begin(&sub->cs_out, 2);
+		cbor_encode_uint64(&sub->cs_out, seq);
+		cbor_encode_text(&sub->cs_out, text);
+		cbor_encode_array_end(&sub->cs_out);
+
+		/* a subscriber which cannot keep up is dropped */
+		if (nb_buffer_socket_send(sub->out) == NB_ERR_WRITE)
+			drop_subscriber(i--, "connection broken");
+		else if (nb_buffer_socket_pending(sub->out) > MAX_PENDING)
+			drop_subscriber(i--, "too slow");
+	}
+}
+
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static int listen_on(int port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int sock;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1
+		|| setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+		|| bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(sock, SOMAXCONN) == -1) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+
+	return sock;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static struct pollfd pfds[MAX_SUBSCRIBERS + 1];
+	int listen_sock;
+	int sock;
+	uint64_t seq = 0;
+	int64_t next_publish;
+	size_t nfds;
+	size_t i;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s PORT\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	diag_init(&diag, stderr);
+	diag.enabled = false;
+
+	listen_sock = listen_on(atoi(argv[1]));
+	next_publish = now_ms();
+
+	for (;;) {
+		if (now_ms() >= next_publish) {
+			publish(seq++);
+			next_publish += PUBLISH_PERIOD;
+		}
+
+		pfds[0].fd = listen_sock;
+		pfds[0].events = POLLIN;
+
+		for (i = 0; i < num_subscribers; i++) {
+			pfds[i + 1].fd = subscribers[i]->sock;
+			pfds[i + 1].events = POLLIN;
+			if (nb_buffer_socket_pending(subscribers[i]->out) > 0)
+				pfds[i + 1].events |= POLLOUT;
+		}
+		nfds = num_subscribers + 1;
+
+		if (poll(pfds, nfds, MAX(next_publish - now_ms(), 0)) <= 0)
+			continue;
+
+		/* go backwards, dropping a subscriber moves the last one */
+		for (i = nfds - 1; i > 0; i--) {
+			if (pfds[i].revents & POLLOUT)
+				nb_buffer_socket_send(subscribers[i - 1]->out);
+
+			if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				&& !receive_commands(subscribers[i - 1]))
+				drop_subscriber(i - 1, "disconnected");
+		}
+
+		if (pfds[0].revents & POLLIN)
+			while ((sock = accept(listen_sock, NULL, NULL)) != -1)
+				add_subscriber(sock);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -85,9 +85,16 @@ void *array_ensure_index(void *arr, size_t index)
 }
 
 
+/*
+ * Empty the array. Items are zeroed, so that array_ensure_index finds them
+ * the way it would in a new array.
+ */
 void array_reset(void *arr)
 {
-	array_get_header(arr)->num_items = 0;
+	struct array_header *hdr = array_get_header(arr);
+
+	memset(arr, 0, hdr->num_items * hdr->item_size);
+	hdr->num_items = 0;
 }
 
 
@@ -0,0 +1,211 @@
+/*
+ * Compare the typed readers of the decoder (cbor_decode_uint32 and friends)
+ * with the generic cbor_decode_item, which the typed readers are meant to be
+ * preferred to where the types of the items are known.
+ *
+ * A stream of route-like records is encoded into memory and decoded from a
+ * memory view, once using the typed readers, and once using the generic
+ * decoder. Both passes compute a checksum of the values decoded, which have
+ * to match.
+ */
+
+#include "buffer.h"
+#include "cbor.h"
+#include "common.h"
+#include "diag.h"
+#include "memory.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_RECORDS	1000000
+#define NUM_FIELDS	6	/* items per record */
+#define NUM_ROUNDS	5	/* the best round counts */
+
+static char *names[] = { "eth0", "eth1", "bond0.100", "lo" };
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static inline uint64_t mix(uint64_t sum, uint64_t val)
+{
+	return (sum ^ val) * 0x100000001b3ULL;	/* FNV-1a, a word at a time */
+}
+
+
+static void init_stream(struct cbor_stream *cs, struct nb_buffer *buf, struct diag *diag)
+{
+	cbor_stream_init(cs, buf);
+	cbor_stream_set_diag(cs, diag);
+}
+
+
+/*
+ * Encode the records, with integers of all widths.
+ */
+static nb_byte_t *encode_records(struct diag *diag, size_t *len)
+{
+	struct nb_buffer *buf = nb_buffer_new_memory();
+	struct cbor_stream cs;
+	uint32_t u32;
+	size_t i;
+
+	init_stream(&cs, buf, diag);
+
+	for (i = 0; i < NUM_RECORDS; i++) {
+		u32 = (uint32_t)(i * 2654435761U) >> (i % 32);
+		cbor_encode_uint32(&cs, u32);				/* metric */
+		cbor_encode_int32(&cs, (int32_t)u32 - (int32_t)(i % 3) * 1000);	/* offset */
+		cbor_encode_bool(&cs, i % 5 == 0);			/* withdrawn */
+		cbor_encode_text(&cs, names[i % ARRAY_SIZE(names)]);	/* device */
+		cbor_encode_uint8(&cs, (uint8_t)i);			/* prefix length */
+		cbor_encode_int16(&cs, (int16_t)(i % 100) - 50);	/* preference */
+	}
+
+	cbor_stream_free(&cs);
+	return nb_buffer_steal(buf, len);
+}
+
+
+static uint64_t decode_typed(struct cbor_stream *cs)
+{
+	uint64_t sum = 0;
+	uint32_t u32;
+	int32_t i32;
+	bool b;
+	const char *str;
+	size_t len;
+	uint8_t u8;
+	int16_t i16;
+	size_t i;
+
+	for (i = 0; i < NUM_RECORDS; i++) {
+		cbor_decode_uint32(cs, &u32);
+		cbor_decode_int32(cs, &i32);
+		cbor_decode_bool(cs, &b);
+		cbor_decode_text_ref(cs, &str, &len);
+		cbor_decode_uint8(cs, &u8);
+		cbor_decode_int16(cs, &i16);
+
+		sum = mix(sum, u32);
+		sum = mix(sum, (uint64_t)(int64_t)i32);
+		sum = mix(sum, b);
+		sum = mix(sum, len + (nb_byte_t)str[0]);
+		sum = mix(sum, u8);
+		sum = mix(sum, (uint64_t)(int64_t)i16);
+	}
+
+	return sum;
+}
+
+
+/*
+ * The generic path: cbor_decode_item decodes items of any type, copying
+ * texts into memory of their own (to be freed by the caller).
+ */
+static uint64_t decode_generic(struct cbor_stream *cs)
+{
+	struct cbor_item item;
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < (size_t)NUM_RECORDS * NUM_FIELDS; i++) {
+		item.str = NULL;
+		cbor_decode_item(cs, &item);
+
+		switch (item.type) {
+		case CBOR_TYPE_UINT:
+			sum = mix(sum, item.u64);
+			break;
+		case CBOR_TYPE_INT:
+			sum = mix(sum, (uint64_t)item.i64);
+			break;
+		case CBOR_TYPE_SVAL:
+			sum = mix(sum, item.sval == CBOR_SVAL_TRUE);
+			break;
+		case CBOR_TYPE_TEXT:
+			sum = mix(sum, item.len + (nb_byte_t)item.str[0]);
+			xfree(item.str);
+			break;
+		default:
+			assert(false);
+		}
+	}
+
+	return sum;
+}
+
+
+static double bench(nb_byte_t *bytes, size_t len, struct diag *diag,
+	uint64_t (*decode)(struct cbor_stream *cs), uint64_t *sum)
+{
+	struct nb_buffer *buf;
+	struct cbor_stream cs;
+	double best = 0;
+	double start;
+	double time;
+	size_t round;
+
+	for (round = 0; round < NUM_ROUNDS; round++) {
+		buf = nb_buffer_new_memory_view(bytes, len);
+		init_stream(&cs, buf, diag);
+
+		start = now();
+		*sum = decode(&cs);
+		time = now() - start;
+
+		cbor_stream_free(&cs);
+		nb_buffer_delete(buf);
+
+		if (round == 0 || time < best)
+			best = time;
+	}
+
+	return best;
+}
+
+
+int main(void)
+{
+	struct diag diag;
+	nb_byte_t *bytes;
+	size_t len;
+	uint64_t typed_sum;
+	uint64_t generic_sum;
+	double typed_time;
+	double generic_time;
+	size_t nitems = (size_t)NUM_RECORDS * NUM_FIELDS;
+
+	diag_init(&diag, stdout);
+	diag.enabled = false;
+
+	bytes = encode_records(&diag, &len);
+
+	typed_time = bench(bytes, len, &diag, decode_typed, &typed_sum);
+	generic_time = bench(bytes, len, &diag, decode_generic, &generic_sum);
+
+	printf("%zu items, %zu bytes\n", nitems, len);
+	printf("typed...   %.3f s (%.1f M items/s)\n", typed_time, nitems / typed_time / 1e6);
+	printf("generic... %.3f s (%.1f M items/s)\n", generic_time, nitems / generic_time / 1e6);
+	printf("speedup:   %.2fx\n", generic_time / typed_time);
+
+	xfree(bytes);
+	diag_free(&diag);
+
+	if (typed_sum != generic_sum) {
+		fprintf(stderr, "checksum mismatch\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
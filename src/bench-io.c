@@ -0,0 +1,180 @@
+/*
+ * Compare the throughput of the file buffer implementations.
+ *
+ * The input file is read through every buffer type while a checksum of
+ * the data is computed (standing in for the decoder), and then the same
+ * amount of data is written to the output file. The input file is evicted
+ * from the page cache before each run, if possible.
+ */
+
+#include "buffer.h"
+#include "common.h"
+#include "memory.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE	4096
+#define PREFETCH_NBUFS	4
+
+struct backend
+{
+	char *name;
+	struct nb_buffer *(*new_in)(int fd);
+	struct nb_buffer *(*new_out)(int fd);
+};
+
+
+static struct nb_buffer *new_prefetch(int fd)
+{
+	return nb_buffer_new_file_prefetch(fd, PREFETCH_NBUFS);
+}
+
+
+static struct nb_buffer *new_adaptive(int fd)
+{
+	struct nb_buffer_opts opts = {
+		.adaptive = true,
+		.huge_pages = true,
+	};
+
+	return nb_buffer_new_file_opts(fd, &opts);
+}
+
+
+static struct backend backends[] = {
+	{ .name = "file", .new_in = nb_buffer_new_file, .new_out = nb_buffer_new_file },
+	{ .name = "uring", .new_in = nb_buffer_new_file_uring, .new_out = nb_buffer_new_file_uring },
+	/* the prefetching buffer is read-only */
+	{ .name = "prefetch", .new_in = new_prefetch, .new_out = nb_buffer_new_file },
+	{ .name = "adaptive", .new_in = new_adaptive, .new_out = new_adaptive },
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint64_t checksum(uint64_t sum, nb_byte_t *bytes, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sum = (sum ^ bytes[i]) * 0x100000001b3ULL;	/* FNV-1a */
+
+	return sum;
+}
+
+
+static double bench_read(struct backend *backend, int fd, size_t *total, uint64_t *sum,
+	size_t *fills)
+{
+	nb_byte_t chunk[CHUNK_SIZE];
+	struct nb_buffer *buf;
+	double start;
+	ssize_t len;
+
+	lseek(fd, 0, SEEK_SET);
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	*total = 0;
+	*sum = 0xcbf29ce484222325ULL;
+
+	start = now();
+	buf = backend->new_in(fd);
+	while ((len = nb_buffer_read(buf, chunk, sizeof(chunk))) > 0) {
+		*sum = checksum(*sum, chunk, len);
+		*total += len;
+	}
+	*fills = nb_buffer_get_fills(buf);
+	nb_buffer_delete(buf);
+
+	return now() - start;
+}
+
+
+static double bench_write(struct backend *backend, int fd, size_t total, size_t *flushes)
+{
+	nb_byte_t chunk[CHUNK_SIZE];
+	struct nb_buffer *buf;
+	double start;
+	size_t len;
+	uint64_t sum = 0;
+
+	lseek(fd, 0, SEEK_SET);
+	if (ftruncate(fd, 0) == -1)
+		return -1;
+
+	start = now();
+	buf = backend->new_out(fd);
+	while (total > 0) {
+		len = MIN(total, sizeof(chunk));
+		memset(chunk, (nb_byte_t)sum, len);
+		sum = checksum(sum, chunk, len);
+		nb_buffer_write(buf, chunk, len);
+		total -= len;
+	}
+	nb_buffer_flush(buf);
+	*flushes = nb_buffer_get_flushes(buf);
+	nb_buffer_delete(buf);
+	fsync(fd);
+
+	return now() - start;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int fd_in;
+	int fd_out;
+	size_t total;
+	size_t fills;
+	size_t flushes;
+	uint64_t sum;
+	uint64_t first_sum = 0;
+	double read_time;
+	double write_time;
+	size_t i;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s INPUT-FILE OUTPUT-FILE\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ((fd_in = open(argv[1], O_RDONLY, 0)) == -1) {
+		fprintf(stderr, "Cannot open input file '%s': %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if ((fd_out = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1) {
+		fprintf(stderr, "Cannot open output file '%s': %s\n", argv[2], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(backends); i++) {
+		read_time = bench_read(&backends[i], fd_in, &total, &sum, &fills);
+		write_time = bench_write(&backends[i], fd_out, total, &flushes);
+
+		if (i == 0)
+			first_sum = sum;
+		else if (sum != first_sum)
+			fprintf(stderr, "%s: checksum mismatch\n", backends[i].name);
+
+		printf("%s... read: %.3f s (%zu fills) write: %.3f s (%zu flushes) size: %zu\n",
+			backends[i].name, read_time, fills, write_time, flushes, total);
+	}
+
+	close(fd_in);
+	close(fd_out);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/*
+ * buffer-crc:
+ * Checksummed Framing Filter
+ *
+ * Every window is written as a frame: a header with the length of the
+ * payload, the payload, and a trailer with the CRC-32C (see crc32c.h) of
+ * both, as 32-bit big-endian numbers. Frames are verified as they are
+ * filled, a mismatch is reported as NB_ERR_CHECKSUM.
+ *
+ * The checksum is computed while the payload is copied between the windows,
+ * as much at a time as the lower buffer's window takes or holds. With the
+ * checksum at the end, the header goes out before the payload.
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "crc32c.h"
+#include "memory.h"
+#include "util.h"
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CRC_FRAME_SIZE		(64 * 1024)		/* default window size */
+#define CRC_MAX_FRAME_SIZE	(64 * 1024 * 1024)	/* refuse bigger frames */
+#define CRC_HDR_LEN		4
+#define CRC_TRAILER_LEN		4
+
+
+static void crc_delete(struct nb_buffer *buf);
+static void crc_fill(struct nb_buffer *buf);
+static void crc_flush(struct nb_buffer *buf);
+
+const struct nb_buffer_ops crc_ops = {
+	.free = crc_delete,
+	.fill = crc_fill,
+	.flush = crc_flush,
+};
+
+
+/*
+ * Create a buffer which frames the data written into it into the lower
+ * buffer, or verifies the frames read from the lower buffer. The window
+ * size set in opts (which may be NULL) is the size of the frames written.
+ */
+struct nb_buffer *nb_buffer_new_crc(struct nb_buffer *lower, const struct nb_buffer_opts *opts)
+{
+	struct nb_buffer_opts crc_opts = { .size = CRC_FRAME_SIZE };
+	struct nb_buffer_filter *filter;
+
+	if (opts)
+		crc_opts = *opts;
+	crc_opts.size = MIN(crc_opts.size ? crc_opts.size : CRC_FRAME_SIZE, CRC_MAX_FRAME_SIZE);
+	crc_opts.adaptive = false;
+
+	filter = nb_malloc(sizeof(*filter));
+	nb_buffer_filter_init(filter, lower, &crc_opts);
+	filter->buf.ops = &crc_ops;
+
+	return &filter->buf;
+}
+
+
+static void crc_delete(struct nb_buffer *buf)
+{
+	xfree(buf);
+}
+
+
+static void crc_flush(struct nb_buffer *buf)
+{
+	struct nb_buffer_filter *filter = (struct nb_buffer_filter *)buf;
+	uint32_t len_be;
+	uint32_t crc_be;
+	nb_byte_t *space;
+	size_t avail;
+	size_t done;
+	uint32_t crc;
+
+	if (buf->len == 0)
+		return;
+
+	len_be = htobe32(buf->len);
+	crc = crc32c(0, &len_be, sizeof(len_be));
+	nb_buffer_filter_write(filter, (nb_byte_t *)&len_be, CRC_HDR_LEN);
+
+	for (done = 0; done < buf->len; done += avail) {
+		if (!(space = nb_buffer_filter_reserve(filter, &avail)))
+			return;
+		avail = MIN(avail, buf->len - done);
+		crc = crc32c_copy(crc, space, buf->buf + done, avail);
+		nb_buffer_commit(filter->lower, avail);
+	}
+
+	crc_be = htobe32(crc);
+	nb_buffer_filter_write(filter, (nb_byte_t *)&crc_be, CRC_TRAILER_LEN);
+}
+
+
+static void crc_fill(struct nb_buffer *buf)
+{
+	struct nb_buffer_filter *filter = (struct nb_buffer_filter *)buf;
+	uint32_t len_be;
+	uint32_t crc_be;
+	nb_byte_t *data;
+	size_t avail;
+	size_t done;
+	size_t len;
+	uint32_t crc;
+
+	buf->len = 0;
+
+	if (!nb_buffer_filter_read(filter, (nb_byte_t *)&len_be, CRC_HDR_LEN, true))
+		return;
+
+	len = be32toh(len_be);
+	crc = crc32c(0, &len_be, sizeof(len_be));
+
+	if (len > CRC_MAX_FRAME_SIZE) {
+		buf->err = NB_ERR_CHECKSUM;
+		buf->eof = true;
+		return;
+	}
+
+	nb_buffer_resize_window(buf, len);
+
+	for (done = 0; done < len; done += avail) {
+		if (!(data = nb_buffer_filter_peek(filter, &avail)))
+			return;
+		avail = MIN(avail, len - done);
+		crc = crc32c_copy(crc, buf->buf + done, data, avail);
+		nb_buffer_consume(filter->lower, avail);
+	}
+
+	if (!nb_buffer_filter_read(filter, (nb_byte_t *)&crc_be, CRC_TRAILER_LEN, false))
+		return;
+
+	if (crc != be32toh(crc_be)) {
+		buf->err = NB_ERR_CHECKSUM;
+		buf->eof = true;
+		return;
+	}
+
+	buf->len = len;
+}
@@ -2,7 +2,9 @@
  * buffer-file:
  * File Buffer Implementation
  */
- 
+
+#define _GNU_SOURCE	/* O_DIRECT */
+
 #include "buffer-internal.h"
 #include "buffer.h"
 #include "debug.h"
@@ -10,19 +12,39 @@
 #include "unistd.h"
 #include "util.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
 #define NB_DEBUG_THIS	0
 
+#define WRITEV_NUM_IOVS	64
+#define DIRECT_BLOCK	4096	/* alignment of O_DIRECT transfers */
+
 
-static size_t file_tell(struct nb_buffer *buf);
 static void file_delete(struct nb_buffer *buf);
 static void file_fill(struct nb_buffer *buf);
 static void file_flush(struct nb_buffer *buf);
+static void file_reset(struct nb_buffer *buf);
+static nb_err_t file_seek(struct nb_buffer *buf, size_t offset);
+static void writev_delete(struct nb_buffer *buf);
+static void writev_flush(struct nb_buffer *buf);
+static void writev_write_ref(struct nb_buffer *buf, nb_byte_t *bytes, size_t count);
 
 const struct nb_buffer_ops file_ops = {
 	.free = file_delete,
 	.fill = file_fill,
 	.flush = file_flush,
-	.tell = file_tell,
+	.seek = file_seek,
+	.reset = file_reset,
+};
+
+const struct nb_buffer_ops writev_ops = {
+	.free = writev_delete,
+	.fill = file_fill,
+	.flush = writev_flush,
+	.seek = file_seek,
+	.write_ref = writev_write_ref,
 };
 
 struct nb_buffer_file
@@ -30,22 +52,133 @@ struct nb_buffer_file
 	struct nb_buffer buf;
 	char *filename;
 	int fd;
+	bool direct;	/* is fd in O_DIRECT mode? */
 };
 
+/*
+ * Scatter-gather file buffer: the window is interleaved with references to
+ * caller's memory and everything is written using a single writev() call.
+ */
+struct nb_buffer_writev
+{
+	struct nb_buffer_file file;
+	struct iovec iov[WRITEV_NUM_IOVS];	/* pending output */
+	size_t num_iovs;			/* number of valid iovs */
+	size_t mark;				/* window bytes below mark are in iov */
+};
+
+
+/*
+ * Offsets of file buffers start at the file offset of fd (0 for pipes).
+ */
+static size_t file_offset(int fd)
+{
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	return MAX(offset, 0);
+}
+
 
 struct nb_buffer *nb_buffer_new_file(int fd)
 {
+	return nb_buffer_new_file_opts(fd, NULL);
+}
+
+
+static size_t align_block(size_t size)
+{
+	return (size + DIRECT_BLOCK - 1) & ~(size_t)(DIRECT_BLOCK - 1);
+}
+
+
+static bool set_direct(int fd, bool direct)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1)
+		return false;
+
+	flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+	return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+
+/*
+ * Fall back to buffered I/O when O_DIRECT I/O has been refused, e.g. for an
+ * unaligned file offset. Returns true if the I/O should be retried.
+ */
+static bool stop_direct(struct nb_buffer_file *file_buf)
+{
+	if (!file_buf->direct)
+		return false;
+
+	file_buf->direct = false;
+	return set_direct(file_buf->fd, false);
+}
+
+
+/*
+ * Create a file buffer whose window is set up according to opts (see
+ * struct nb_buffer_opts). NULL opts select the defaults.
+ *
+ * With opts->direct set, fd is switched to O_DIRECT mode, which bypasses the
+ * page cache, e.g. for big files written or read only once. The window is
+ * aligned to and sized in whole blocks then. Flushes write whole blocks
+ * only, a partial block at the end of the window is moved to the start of
+ * the next one. It's written when the buffer is deleted, seeks or is reset:
+ * it is padded and the file is truncated after the data then, so the data
+ * have to be written at the end of the file, and further writes are not
+ * direct. The buffer falls back to buffered I/O if the file system or the
+ * file offset do not allow O_DIRECT.
+ */
+struct nb_buffer *nb_buffer_new_file_opts(int fd, const struct nb_buffer_opts *opts)
+{
+	struct nb_buffer_opts direct_opts;
 	struct nb_buffer_file *file_buf;
 
+	if (opts && opts->direct) {
+		direct_opts = *opts;
+		direct_opts.align = MAX(opts->align, DIRECT_BLOCK);
+		direct_opts.size = align_block(opts->size ? opts->size : NB_BUFFER_SIZE);
+		direct_opts.max_size = align_block(opts->max_size);
+		opts = &direct_opts;
+	}
+
 	file_buf = nb_malloc(sizeof(*file_buf));
-	nb_buffer_init(&file_buf->buf);
+	nb_buffer_init_opts(&file_buf->buf, opts);
 	file_buf->buf.ops = &file_ops;
+	file_buf->buf.offset = file_offset(fd);
 	file_buf->fd = fd;
+	file_buf->direct = opts && opts->direct && set_direct(fd, true);
 
 	return &file_buf->buf;
 }
 
 
+/*
+ * There's no state besides the descriptor, see nb_buffer_file_set_fd.
+ */
+static void file_reset(struct nb_buffer *buf)
+{
+	(void) buf;
+}
+
+
+/*
+ * Point a file buffer which has just been reset to another file.
+ */
+void nb_buffer_file_set_fd(struct nb_buffer *buf, int fd)
+{
+	struct nb_buffer_file *file_buf = (struct nb_buffer_file *)buf;
+
+	assert(buf->ops == &file_ops);
+	assert(buf->mode == BUF_MODE_IDLE);
+
+	file_buf->fd = fd;
+	file_buf->direct = file_buf->direct && set_direct(fd, true);
+	buf->offset = file_offset(fd);
+}
+
+
 
 static void file_delete(struct nb_buffer *buf)
 {
@@ -53,25 +186,30 @@ static void file_delete(struct nb_buffer *buf)
 }
 
 
-static size_t file_tell(struct nb_buffer *buf)
+static nb_err_t file_seek(struct nb_buffer *buf, size_t offset)
 {
 	struct nb_buffer_file *file_buf = (struct nb_buffer_file *)buf;
-	return lseek(file_buf->fd, 0, SEEK_CUR);
+
+	if (lseek(file_buf->fd, offset, SEEK_SET) == -1)
+		return errno == ESPIPE ? NB_ERR_UNSUP : NB_ERR_OPER;
+	return NB_ERR_OK;
 }
 
 
 static void file_fill(struct nb_buffer *buf)
 {
 	struct nb_buffer_file *file_buf = (struct nb_buffer_file *)buf;
-	int retval;
+	ssize_t retval;
 
-	retval = read(file_buf->fd, buf->buf, buf->bufsize);
-	buf->len = MAX(retval, 0);
+	do {
+		retval = read(file_buf->fd, buf->buf, buf->bufsize);
+	} while (retval == -1 && (errno == EINTR || (errno == EINVAL && stop_direct(file_buf))));
 
-	/* TODO handle error if retval < 0 */
+	if (retval == -1)
+		buf->err = (errno == EAGAIN || errno == EWOULDBLOCK) ? NB_ERR_AGAIN : NB_ERR_READ;
 
-	buf->eof = (buf->len == 0);
-	TEMP_ASSERT(buf->len >= 0);
+	buf->len = MAX(retval, 0);
+	buf->eof = (retval == 0 || buf->err == NB_ERR_READ);
 }
 
 
@@ -79,7 +217,152 @@ static void file_flush(struct nb_buffer *buf)
 {
 	NB_DEBUG_TRACE;
 	struct nb_buffer_file *file_buf = (struct nb_buffer_file *)buf;
+	size_t len = buf->len;
+	size_t done = 0;
+	ssize_t written;
+	off_t end;
+
+	/*
+	 * O_DIRECT writes whole blocks only: keep the partial block for the
+	 * next window, and pad it only when no more data follow
+	 */
+	if (file_buf->direct && len % DIRECT_BLOCK) {
+		if (buf->flush_cause == BUF_FLUSH_FINAL) {
+			len = align_block(len);
+			memset(buf->buf + buf->len, 0, len - buf->len);
+		}
+		else {
+			len -= len % DIRECT_BLOCK;
+		}
+	}
+
+	/* a signal or a full pipe may cut the write short */
+	while (done < len) {
+		written = write(file_buf->fd, buf->buf + done, len - done);
+		if (written == -1 && (errno == EINTR || (errno == EINVAL && stop_direct(file_buf))))
+			continue;
+		if (written <= 0) {
+			buf->err = NB_ERR_WRITE;	/* see nb_buffer_new_socket for non-blocking I/O */
+			return;
+		}
+		done += written;
+	}
+
+	if (len < buf->len) {
+		buf->kept = buf->len - len;
+		memmove(buf->buf, buf->buf + len, buf->kept);
+	}
+
+	/* cut the padding off, further writes cannot be direct anymore */
+	if (len > buf->len) {
+		end = lseek(file_buf->fd, 0, SEEK_CUR) - (len - buf->len);
+		if (ftruncate(file_buf->fd, end) == -1 || lseek(file_buf->fd, end, SEEK_SET) == -1)
+			buf->err = NB_ERR_WRITE;
+		stop_direct(file_buf);
+	}
+}
+
+
+/*
+ * Create a file buffer which doesn't copy big chunks of data into the window
+ * but references them instead (see nb_buffer_write_ref), and writes all the
+ * pending output with a single writev() call when flushed.
+ *
+ * Referenced memory (such as bytes and text passed to the CBOR encoder) has
+ * to stay valid until the buffer is flushed.
+ */
+struct nb_buffer *nb_buffer_new_file_writev(int fd)
+{
+	struct nb_buffer_writev *writev_buf;
+
+	writev_buf = nb_malloc(sizeof(*writev_buf));
+	nb_buffer_init(&writev_buf->file.buf);
+	writev_buf->file.buf.ops = &writev_ops;
+	writev_buf->file.buf.offset = file_offset(fd);
+	writev_buf->file.fd = fd;
+	writev_buf->file.direct = false;
+	writev_buf->num_iovs = 0;
+	writev_buf->mark = 0;
+
+	return &writev_buf->file.buf;
+}
+
+
+static void writev_delete(struct nb_buffer *buf)
+{
+	xfree((struct nb_buffer_writev *)buf);
+}
+
+
+static void push_iov(struct nb_buffer_writev *writev_buf, nb_byte_t *bytes, size_t count)
+{
+	if (count == 0)
+		return;
+
+	assert(writev_buf->num_iovs < WRITEV_NUM_IOVS);
+	writev_buf->iov[writev_buf->num_iovs].iov_base = bytes;
+	writev_buf->iov[writev_buf->num_iovs].iov_len = count;
+	writev_buf->num_iovs++;
+}
+
+
+/*
+ * Cover window bytes written since last mark with an iov.
+ */
+static void push_window(struct nb_buffer_writev *writev_buf)
+{
+	struct nb_buffer *buf = &writev_buf->file.buf;
+
+	push_iov(writev_buf, buf->buf + writev_buf->mark, buf->len - writev_buf->mark);
+	writev_buf->mark = buf->len;
+}
+
+
+static void writev_write_ref(struct nb_buffer *buf, nb_byte_t *bytes, size_t count)
+{
+	struct nb_buffer_writev *writev_buf = (struct nb_buffer_writev *)buf;
+
+	/* the window and the reference, and keep a slot for the window flushed last */
+	if (writev_buf->num_iovs + 3 > WRITEV_NUM_IOVS)
+		nb_buffer_flush(buf);
+
+	push_window(writev_buf);
+	push_iov(writev_buf, bytes, count);
+}
+
+
+static void writev_flush(struct nb_buffer *buf)
+{
+	struct nb_buffer_writev *writev_buf = (struct nb_buffer_writev *)buf;
+	struct iovec *iov = writev_buf->iov;
+	size_t num_iovs;
 	ssize_t written;
-	written = write(file_buf->fd, buf->buf, buf->len);
-	TEMP_ASSERT(written == buf->len);
+
+	push_window(writev_buf);
+	num_iovs = writev_buf->num_iovs;
+
+	while (num_iovs > 0) {
+		written = writev(writev_buf->file.fd, iov, num_iovs);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0) {
+			buf->err = NB_ERR_WRITE;
+			break;
+		}
+
+		/* skip what's been written, resume a partially written iov */
+		while (num_iovs > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			num_iovs--;
+		}
+
+		if (num_iovs > 0) {
+			iov->iov_base = (nb_byte_t *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	writev_buf->num_iovs = 0;
+	writev_buf->mark = 0;
 }
@@ -0,0 +1,110 @@
+/*
+ * buffer-filter:
+ * Filter Buffer Helpers
+ *
+ * Filters are buffers stacked on top of a lower buffer (see struct
+ * nb_buffer_filter), such as nb_buffer_new_lz and nb_buffer_new_crc. Filters
+ * may be stacked on top of each other as well.
+ *
+ * A filter does not own its lower buffer. Deleting the filter flushes it into
+ * the lower buffer, which has to be deleted (or flushed) by the caller then.
+ * The lower buffer must not be a non-blocking one.
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+
+
+void nb_buffer_filter_init(struct nb_buffer_filter *filter, struct nb_buffer *lower,
+	const struct nb_buffer_opts *opts)
+{
+	nb_buffer_init_opts(&filter->buf, opts);
+	filter->lower = lower;
+}
+
+
+/*
+ * Read count bytes from the lower buffer. If the lower buffer runs out of
+ * data, false is returned and the filter's error is set to the lower
+ * buffer's error, or to NB_ERR_EOF if the data have been cut short. Running
+ * out of data before reading anything is a regular EOF if eof_ok is set.
+ */
+bool nb_buffer_filter_read(struct nb_buffer_filter *filter, nb_byte_t *bytes, size_t count,
+	bool eof_ok)
+{
+	struct nb_buffer *lower = filter->lower;
+	size_t len;
+
+	if ((len = nb_buffer_read(lower, bytes, count)) == count)
+		return true;
+
+	if (lower->err != NB_ERR_OK)
+		filter->buf.err = lower->err;
+	else if (len > 0 || !eof_ok)
+		filter->buf.err = NB_ERR_EOF;
+
+	filter->buf.eof = true;
+	return false;
+}
+
+
+/*
+ * Write count bytes into the lower buffer, passing its errors on.
+ */
+void nb_buffer_filter_write(struct nb_buffer_filter *filter, nb_byte_t *bytes, size_t count)
+{
+	struct nb_buffer *lower = filter->lower;
+
+	nb_buffer_write(lower, bytes, count);
+	if (lower->err != NB_ERR_OK)
+		filter->buf.err = lower->err;
+}
+
+
+/*
+ * Return the free space in the lower buffer's window, which is flushed first
+ * if it is full, and store its size in avail. The bytes written into it are
+ * committed with nb_buffer_commit. If no room can be made, NULL is returned
+ * and the filter's error is set.
+ */
+nb_byte_t *nb_buffer_filter_reserve(struct nb_buffer_filter *filter, size_t *avail)
+{
+	struct nb_buffer *lower = filter->lower;
+	nb_byte_t *space;
+
+	space = nb_buffer_reserve(lower, 1);
+	if (lower->err != NB_ERR_OK)
+		filter->buf.err = lower->err;
+
+	if (!space) {
+		if (filter->buf.err == NB_ERR_OK)
+			filter->buf.err = NB_ERR_WRITE;
+		*avail = 0;
+		return NULL;
+	}
+
+	*avail = lower->bufsize - lower->len;
+	return space;
+}
+
+
+/*
+ * Return the unread data in the lower buffer's window, which is refilled
+ * first if it is empty, and store their number in avail. The bytes used are
+ * consumed with nb_buffer_consume. If the lower buffer runs out of data,
+ * NULL is returned and the filter's error is set as by nb_buffer_filter_read
+ * for data cut short.
+ */
+nb_byte_t *nb_buffer_filter_peek(struct nb_buffer_filter *filter, size_t *avail)
+{
+	struct nb_buffer *lower = filter->lower;
+	nb_byte_t *data;
+
+	data = nb_buffer_peek_span(lower, 1, avail);
+	if (*avail > 0)
+		return data;
+
+	filter->buf.err = (lower->err != NB_ERR_OK) ? lower->err : NB_ERR_EOF;
+	filter->buf.eof = true;
+	return NULL;
+}
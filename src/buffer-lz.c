@@ -0,0 +1,214 @@
+/*
+ * buffer-lz:
+ * LZ Compression Filter
+ *
+ * Every window is compressed into a block of its own (see lz.c), so the
+ * blocks can be decompressed independently of each other. A block starts
+ * with a header of two 32-bit big-endian numbers: the length of the block
+ * (with LZ_STORED set if the data did not compress and are stored as they
+ * are), and the length of the data.
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "lz.h"
+#include "memory.h"
+#include "util.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_BLOCK_SIZE		(64 * 1024)		/* default window size */
+#define LZ_MIN_FIT_SIZE		4096			/* see fit_block_size */
+#define LZ_MAX_BLOCK_SIZE	(64 * 1024 * 1024)	/* refuse bigger blocks */
+#define LZ_HDR_LEN		8
+#define LZ_STORED		0x80000000U
+
+
+static void lz_delete(struct nb_buffer *buf);
+static void lz_fill(struct nb_buffer *buf);
+static void lz_flush(struct nb_buffer *buf);
+
+const struct nb_buffer_ops lz_ops = {
+	.free = lz_delete,
+	.fill = lz_fill,
+	.flush = lz_flush,
+};
+
+struct nb_buffer_lz
+{
+	struct nb_buffer_filter filter;
+	nb_byte_t *packed;	/* the block, unless it's in lower's window */
+	size_t packed_size;	/* size of packed */
+};
+
+
+/*
+ * Return the size of the biggest blocks which, compressed and with the
+ * header, always fit into the lower buffer's window, so that lz_flush can
+ * compress them in place. Windows which would only take small blocks, which
+ * compress poorly, get LZ_BLOCK_SIZE instead.
+ */
+static size_t fit_block_size(struct nb_buffer *lower)
+{
+	size_t size;
+
+	if (lower->bufsize < LZ_HDR_LEN + lz_compress_bound(LZ_MIN_FIT_SIZE))
+		return LZ_BLOCK_SIZE;
+
+	/* lz_compress_bound adds less than 1/255 and a constant */
+	size = (lower->bufsize - LZ_HDR_LEN - lz_compress_bound(0)) / 256 * 255;
+	assert(LZ_HDR_LEN + lz_compress_bound(size) <= lower->bufsize);
+	return MIN(size, LZ_MAX_BLOCK_SIZE);
+}
+
+
+/*
+ * Create a buffer which compresses the data written into it into the lower
+ * buffer, or decompresses the data read from the lower buffer. The window
+ * size set in opts (which may be NULL) is the size of the blocks written.
+ * By default, it's fitted to the lower buffer's window (see fit_block_size).
+ */
+struct nb_buffer *nb_buffer_new_lz(struct nb_buffer *lower, const struct nb_buffer_opts *opts)
+{
+	struct nb_buffer_opts lz_opts = { .size = 0 };
+	struct nb_buffer_lz *lz_buf;
+
+	if (opts)
+		lz_opts = *opts;
+	lz_opts.size = MIN(lz_opts.size ? lz_opts.size : fit_block_size(lower), LZ_MAX_BLOCK_SIZE);
+	lz_opts.adaptive = false;
+
+	lz_buf = nb_malloc(sizeof(*lz_buf));
+	nb_buffer_filter_init(&lz_buf->filter, lower, &lz_opts);
+	lz_buf->filter.buf.ops = &lz_ops;
+	lz_buf->packed = NULL;
+	lz_buf->packed_size = 0;
+
+	return &lz_buf->filter.buf;
+}
+
+
+static void lz_delete(struct nb_buffer *buf)
+{
+	struct nb_buffer_lz *lz_buf = (struct nb_buffer_lz *)buf;
+
+	xfree(lz_buf->packed);
+	xfree(lz_buf);
+}
+
+
+static nb_byte_t *get_packed(struct nb_buffer_lz *lz_buf, size_t size)
+{
+	if (size > lz_buf->packed_size) {
+		xfree(lz_buf->packed);
+		lz_buf->packed = nb_malloc(size);
+		lz_buf->packed_size = size;
+	}
+
+	return lz_buf->packed;
+}
+
+
+/*
+ * The block is compressed right into the lower buffer's window if possible.
+ */
+static void lz_flush(struct nb_buffer *buf)
+{
+	struct nb_buffer_lz *lz_buf = (struct nb_buffer_lz *)buf;
+	struct nb_buffer *lower = lz_buf->filter.lower;
+	size_t bound = LZ_HDR_LEN + lz_compress_bound(buf->len);
+	uint32_t hdr[2];
+	nb_byte_t *block;
+	size_t len;
+	bool in_place;
+
+	if (buf->len == 0)
+		return;
+
+	in_place = ((block = nb_buffer_reserve(lower, bound)) != NULL);
+	if (!in_place)
+		block = get_packed(lz_buf, bound);
+
+	len = lz_compress(buf->buf, buf->len, block + LZ_HDR_LEN);
+	if (len < buf->len) {
+		hdr[0] = htobe32(len);
+	}
+	else {
+		memcpy(block + LZ_HDR_LEN, buf->buf, buf->len);
+		len = buf->len;
+		hdr[0] = htobe32(len | LZ_STORED);
+	}
+
+	hdr[1] = htobe32(buf->len);
+	memcpy(block, hdr, LZ_HDR_LEN);
+
+	if (in_place)
+		nb_buffer_commit(lower, LZ_HDR_LEN + len);
+	else
+		nb_buffer_filter_write(&lz_buf->filter, block, LZ_HDR_LEN + len);
+}
+
+
+/*
+ * The block is decompressed right from the lower buffer's window if it's
+ * all there.
+ */
+static void lz_fill(struct nb_buffer *buf)
+{
+	struct nb_buffer_lz *lz_buf = (struct nb_buffer_lz *)buf;
+	struct nb_buffer *lower = lz_buf->filter.lower;
+	uint32_t hdr[2];
+	size_t packed_len;
+	size_t len;
+	size_t avail;
+	nb_byte_t *block;
+	bool stored;
+	ssize_t ret;
+
+	buf->len = 0;
+
+	if (!nb_buffer_filter_read(&lz_buf->filter, (nb_byte_t *)hdr, LZ_HDR_LEN, true))
+		return;
+
+	packed_len = be32toh(hdr[0]) & ~LZ_STORED;
+	stored = be32toh(hdr[0]) & LZ_STORED;
+	len = be32toh(hdr[1]);
+
+	if (len > LZ_MAX_BLOCK_SIZE || (stored && packed_len != len)
+		|| (!stored && packed_len > lz_compress_bound(len))) {
+		buf->err = NB_ERR_PARSE;
+		buf->eof = true;
+		return;
+	}
+
+	nb_buffer_resize_window(buf, len);
+
+	if (stored) {
+		if (nb_buffer_filter_read(&lz_buf->filter, buf->buf, len, false))
+			buf->len = len;
+		return;
+	}
+
+	block = nb_buffer_peek_span(lower, packed_len, &avail);
+	if (avail >= packed_len) {
+		ret = lz_decompress(block, packed_len, buf->buf, len);
+		nb_buffer_consume(lower, packed_len);
+	}
+	else {
+		block = get_packed(lz_buf, packed_len);
+		if (!nb_buffer_filter_read(&lz_buf->filter, block, packed_len, false))
+			return;
+		ret = lz_decompress(block, packed_len, buf->buf, len);
+	}
+
+	if (ret != (ssize_t)len) {
+		buf->err = NB_ERR_PARSE;
+		buf->eof = true;
+		return;
+	}
+
+	buf->len = len;
+}
@@ -1,6 +1,15 @@
 /*
  * buffer-memory:
  * Memory Buffer Implementation
+ *
+ * The memory is a chain of segments. The write window is always the free
+ * space of the last segment, so encoding goes straight into the backing
+ * memory; once the segment fills up, a new (bigger) one is appended, which
+ * avoids copying what has been written so far. Reading hands out the
+ * segments themselves as windows.
+ *
+ * Views and fixed buffers use caller's memory instead: a view reads it, a
+ * fixed buffer writes into it.
  */
 
 #include "buffer-internal.h"
@@ -12,87 +21,426 @@
 
 #define NB_DEBUG_THIS	1
 
+#define MEM_SEG_INIT_SIZE	(4 * 4096)
+#define MEM_SEG_MAX_SIZE	(16 * 1024 * 1024)
+
 
-static size_t mem_tell(struct nb_buffer *buf);
 static void mem_delete(struct nb_buffer *buf);
 static void mem_fill(struct nb_buffer *buf);
 static void mem_flush(struct nb_buffer *buf);
+static void mem_rewind(struct nb_buffer *buf);
+static nb_err_t mem_seek(struct nb_buffer *buf, size_t offset);
+static void mem_reset(struct nb_buffer *buf);
+static void view_delete(struct nb_buffer *buf);
+static void view_fill(struct nb_buffer *buf);
+static nb_err_t view_seek(struct nb_buffer *buf, size_t offset);
+static void fixed_delete(struct nb_buffer *buf);
+static void fixed_flush(struct nb_buffer *buf);
+static void fixed_reset(struct nb_buffer *buf);
 
 const struct nb_buffer_ops mem_ops = {
 	.free = mem_delete,
 	.fill = mem_fill,
 	.flush = mem_flush,
-	.tell = mem_tell,
+	.rewind = mem_rewind,
+	.seek = mem_seek,
+	.reset = mem_reset,
+};
+
+const struct nb_buffer_ops view_ops = {
+	.free = view_delete,
+	.fill = view_fill,
+	.flush = NULL,
+	.seek = view_seek,
+};
+
+const struct nb_buffer_ops fixed_ops = {
+	.free = fixed_delete,
+	.fill = NULL,
+	.flush = fixed_flush,
+	.reset = fixed_reset,
+};
+
+/*
+ * Segment of the memory buffer's backing store.
+ */
+struct mem_seg
+{
+	struct mem_seg *next;	/* next segment */
+	nb_byte_t *data;	/* segment data */
+	size_t size;		/* size of the data */
+	size_t len;		/* number of bytes written into data */
 };
 
 struct nb_buffer_memory
 {
 	struct nb_buffer buf;
-	nb_byte_t *memory;
-	size_t memory_size;
-	size_t memory_len;
-	size_t memory_pos;
+	struct mem_seg *first;		/* first segment */
+	struct mem_seg *last;		/* last segment (the one being written) */
+	struct mem_seg *read_seg;	/* segment being read */
+	size_t read_pos;		/* offset of the next window within read_seg */
+	bool reading;			/* has reading started? */
+};
+
+struct nb_buffer_view
+{
+	struct nb_buffer buf;
+	nb_byte_t *memory;	/* caller's memory */
+	size_t memory_len;	/* length of caller's memory */
 };
 
+struct nb_buffer_fixed
+{
+	struct nb_buffer buf;
+	nb_byte_t *memory;	/* caller's memory */
+	size_t memory_size;	/* size of caller's memory */
+};
+
+
+static struct mem_seg *mem_seg_new(size_t size)
+{
+	struct mem_seg *seg;
+
+	seg = nb_malloc(sizeof(*seg));
+	seg->data = nb_malloc(size);
+	seg->next = NULL;
+	seg->size = size;
+	seg->len = 0;
+
+	return seg;
+}
+
+
+static void mem_seg_delete(struct mem_seg *seg)
+{
+	xfree(seg->data);
+	xfree(seg);
+}
+
+
+static void mem_free_segs(struct nb_buffer_memory *mem_buf)
+{
+	struct mem_seg *next;
+
+	while (mem_buf->first) {
+		next = mem_buf->first->next;
+		mem_seg_delete(mem_buf->first);
+		mem_buf->first = next;
+	}
+	mem_buf->last = NULL;
+}
+
+
+/*
+ * Make the free space of the last segment the write window.
+ */
+static void mem_set_write_window(struct nb_buffer_memory *mem_buf)
+{
+	struct mem_seg *last = mem_buf->last;
+
+	mem_buf->buf.buf = last->data + last->len;
+	mem_buf->buf.bufsize = last->size - last->len;
+}
+
+
+static void mem_init_segs(struct nb_buffer_memory *mem_buf)
+{
+	mem_buf->first = mem_buf->last = mem_seg_new(MEM_SEG_INIT_SIZE);
+	mem_buf->read_seg = NULL;
+	mem_buf->read_pos = 0;
+	mem_buf->reading = false;
+	mem_set_write_window(mem_buf);
+}
+
 
 struct nb_buffer *nb_buffer_new_memory(void)
 {
 	struct nb_buffer_memory *mem_buf;
 
 	mem_buf = nb_malloc(sizeof(*mem_buf));
-	nb_buffer_init(&mem_buf->buf);
+	nb_buffer_init_window(&mem_buf->buf, NULL, 0);
 	mem_buf->buf.ops = &mem_ops;
-	mem_buf->memory = NULL;
-	mem_buf->memory_len = 0;
-	mem_buf->memory_size = 0;
-	mem_buf->memory_pos = 0;
+	mem_buf->buf.persistent = true;
+	mem_init_segs(mem_buf);
 
 	return &mem_buf->buf;
 }
 
 
-static size_t mem_tell(struct nb_buffer *buf)
-{
-	(void) buf;
-	return 0;
-}
-
-
 static void mem_delete(struct nb_buffer *buf)
 {
 	struct nb_buffer_memory *mem_buf = (struct nb_buffer_memory *)buf;
-	xfree(mem_buf->memory);
+	mem_free_segs(mem_buf);
 	xfree(mem_buf);
 }
 
 
+/*
+ * Hand out the next written part of the segment chain as the window.
+ *
+ * Reading starts at the beginning of the memory, which is why the buffer
+ * cannot be written once reading started (see nb_buffer_rewind).
+ */
 static void mem_fill(struct nb_buffer *buf)
 {
 	struct nb_buffer_memory *mem_buf = (struct nb_buffer_memory *)buf;
-	size_t avail;
-	size_t ncpy;
-	
-	avail = mem_buf->memory_len - mem_buf->memory_pos;
-	ncpy = MIN(avail, buf->bufsize);
+	struct mem_seg *seg;
 
-	memcpy(buf->buf, mem_buf->memory + mem_buf->memory_pos, ncpy);
+	if (!mem_buf->reading)
+		mem_rewind(buf);
+
+	seg = mem_buf->read_seg;
+	while (mem_buf->read_pos == seg->len && seg->next) {
+		seg = mem_buf->read_seg = seg->next;
+		mem_buf->read_pos = 0;
+	}
 
-	buf->len = ncpy;
-	mem_buf->memory_pos += ncpy;
+	buf->buf = seg->data + mem_buf->read_pos;
+	buf->len = seg->len - mem_buf->read_pos;
+	buf->bufsize = 0; /* don't let writes go into a read window */
+	buf->eof = (buf->len == 0);
+	mem_buf->read_pos = seg->len;
 }
 
 
 static void mem_flush(struct nb_buffer *buf)
 {
 	struct nb_buffer_memory *mem_buf = (struct nb_buffer_memory *)buf;
-	size_t new_mry_size;
+	struct mem_seg *last = mem_buf->last;
 
-	if (mem_buf->memory_len + buf->len > mem_buf->memory_size) {
-		new_mry_size = MAX(2 * mem_buf->memory_size, buf->bufsize);
-		mem_buf->memory = nb_realloc(mem_buf->memory, new_mry_size);
-		mem_buf->memory_size = new_mry_size;
+	assert(!mem_buf->reading);
+	assert(buf->buf == last->data + last->len);
+
+	last->len += buf->len;
+	if (last->len == last->size) {
+		last->next = mem_seg_new(MIN(2 * last->size, MEM_SEG_MAX_SIZE));
+		mem_buf->last = last->next;
 	}
 
-	memcpy(mem_buf->memory + mem_buf->memory_len, buf->buf, buf->len);
-	mem_buf->memory_len += buf->len;
+	mem_set_write_window(mem_buf);
+}
+
+
+static void mem_rewind(struct nb_buffer *buf)
+{
+	struct nb_buffer_memory *mem_buf = (struct nb_buffer_memory *)buf;
+
+	mem_buf->read_seg = mem_buf->first;
+	mem_buf->read_pos = 0;
+	mem_buf->reading = true;
+	buf->bufsize = 0;
+}
+
+
+/*
+ * Start reading at the offset, like after nb_buffer_rewind.
+ */
+static nb_err_t mem_seek(struct nb_buffer *buf, size_t offset)
+{
+	struct nb_buffer_memory *mem_buf = (struct nb_buffer_memory *)buf;
+	struct mem_seg *seg = mem_buf->first;
+	size_t seg_offset = 0;
+
+	while (offset - seg_offset > seg->len) {
+		if (!seg->next)
+			return NB_ERR_RANGE;
+		seg_offset += seg->len;
+		seg = seg->next;
+	}
+
+	mem_rewind(buf);
+	mem_buf->read_seg = seg;
+	mem_buf->read_pos = offset - seg_offset;
+	return NB_ERR_OK;
+}
+
+
+/*
+ * Keep the first segment for the new contents, free the others.
+ */
+static void mem_reset(struct nb_buffer *buf)
+{
+	struct nb_buffer_memory *mem_buf = (struct nb_buffer_memory *)buf;
+	struct mem_seg *first = mem_buf->first;
+
+	mem_buf->first = first->next;
+	mem_free_segs(mem_buf);
+
+	first->next = NULL;
+	first->len = 0;
+	mem_buf->first = mem_buf->last = first;
+	mem_buf->read_seg = NULL;
+	mem_buf->read_pos = 0;
+	mem_buf->reading = false;
+	mem_set_write_window(mem_buf);
+}
+
+
+/*
+ * Take the memory written so far and leave the buffer empty. The result
+ * has to be free'd by the caller using xfree.
+ *
+ * If the data span multiple segments, they're coalesced (copied).
+ */
+nb_byte_t *nb_buffer_steal(struct nb_buffer *buf, size_t *len)
+{
+	struct nb_buffer_memory *mem_buf = (struct nb_buffer_memory *)buf;
+	struct mem_seg *seg;
+	nb_byte_t *memory;
+
+	assert(buf->ops == &mem_ops);
+	nb_buffer_flush(buf);
+
+	if (mem_buf->first == mem_buf->last) {
+		*len = mem_buf->first->len;
+		memory = mem_buf->first->data;
+		xfree(mem_buf->first);
+	}
+	else {
+		for (*len = 0, seg = mem_buf->first; seg; seg = seg->next)
+			*len += seg->len;
+
+		memory = nb_malloc(*len);
+		for (*len = 0, seg = mem_buf->first; seg; seg = seg->next) {
+			memcpy(memory + *len, seg->data, seg->len);
+			*len += seg->len;
+		}
+
+		mem_free_segs(mem_buf);
+	}
+
+	mem_init_segs(mem_buf);
+	buf->offset = 0;
+	return memory;
+}
+
+
+/*
+ * Create a read-only buffer over len bytes of caller's memory at ptr.
+ *
+ * The memory itself is the buffer's window, no copies are made. It has to stay
+ * valid (and unmodified) until the buffer is deleted.
+ */
+struct nb_buffer *nb_buffer_new_memory_view(const void *ptr, size_t len)
+{
+	struct nb_buffer_view *view_buf;
+
+	view_buf = nb_malloc(sizeof(*view_buf));
+	nb_buffer_init_window(&view_buf->buf, (nb_byte_t *)ptr, len);
+	view_buf->buf.ops = &view_ops;
+	view_buf->buf.persistent = true;
+	view_buf->buf.len = len;
+	view_buf->memory = (nb_byte_t *)ptr;
+	view_buf->memory_len = len;
+
+	return &view_buf->buf;
+}
+
+
+/*
+ * The window is set up right away, as view_fill only signals EOF.
+ */
+static nb_err_t view_seek(struct nb_buffer *buf, size_t offset)
+{
+	struct nb_buffer_view *view_buf = (struct nb_buffer_view *)buf;
+
+	if (offset > view_buf->memory_len)
+		return NB_ERR_RANGE;
+
+	buf->buf = view_buf->memory + offset;
+	buf->len = view_buf->memory_len - offset;
+	buf->bufsize = buf->len;
+	return NB_ERR_OK;
+}
+
+
+static void view_delete(struct nb_buffer *buf)
+{
+	xfree((struct nb_buffer_view *)buf);
+}
+
+
+/*
+ * The whole memory is available right away, so we only get here once it has
+ * been consumed.
+ */
+static void view_fill(struct nb_buffer *buf)
+{
+	struct nb_buffer_view *view_buf = (struct nb_buffer_view *)buf;
+
+	buf->buf = view_buf->memory + view_buf->memory_len;
+	buf->bufsize = 0;
+	buf->len = 0;
+	buf->eof = true;
+}
+
+
+/*
+ * Create a buffer writing into cap bytes of caller's memory at dst, e.g. a
+ * slot of a packet. The memory itself is the window, so the data are
+ * encoded right into it. There's no flushing out: once the memory is full,
+ * writes stop short and nb_buffer_get_error returns NB_ERR_OVERFLOW. The
+ * message is incomplete then; start over using nb_buffer_reset or
+ * nb_buffer_fixed_reset.
+ *
+ * The number of bytes written is returned by nb_buffer_get_written_total.
+ */
+struct nb_buffer *nb_buffer_new_fixed(void *dst, size_t cap)
+{
+	struct nb_buffer_fixed *fixed_buf;
+
+	fixed_buf = nb_malloc(sizeof(*fixed_buf));
+	nb_buffer_init_window(&fixed_buf->buf, dst, cap);
+	fixed_buf->buf.ops = &fixed_ops;
+	fixed_buf->memory = dst;
+	fixed_buf->memory_size = cap;
+
+	return &fixed_buf->buf;
+}
+
+
+/*
+ * Start over writing into cap bytes at dst, e.g. into the next slot.
+ */
+void nb_buffer_fixed_reset(struct nb_buffer *buf, void *dst, size_t cap)
+{
+	struct nb_buffer_fixed *fixed_buf = (struct nb_buffer_fixed *)buf;
+
+	assert(buf->ops == &fixed_ops);
+
+	fixed_buf->memory = dst;
+	fixed_buf->memory_size = cap;
+	nb_buffer_reset(buf);
+}
+
+
+static void fixed_reset(struct nb_buffer *buf)
+{
+	struct nb_buffer_fixed *fixed_buf = (struct nb_buffer_fixed *)buf;
+
+	buf->buf = fixed_buf->memory;
+	buf->bufsize = fixed_buf->memory_size;
+}
+
+
+/*
+ * The data stay where they are, the window moves on to the rest of the
+ * memory. Once there's no room left, there's nothing to be done about it,
+ * which makes write_internal stop.
+ */
+static void fixed_flush(struct nb_buffer *buf)
+{
+	if (buf->len == 0 && buf->bufsize == 0) {
+		buf->err = NB_ERR_OVERFLOW;
+		return;
+	}
+
+	buf->buf += buf->len;
+	buf->bufsize -= buf->len;
+}
+
+
+static void fixed_delete(struct nb_buffer *buf)
+{
+	xfree((struct nb_buffer_fixed *)buf);
 }
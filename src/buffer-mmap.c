@@ -0,0 +1,124 @@
+/*
+ * buffer-mmap:
+ * Memory-Mapped File Buffer Implementation
+ *
+ * The whole file is mapped into memory and the mapping itself is handed out
+ * as the buffer's window, so no read() calls nor copies into a private window
+ * are necessary. The mapping is persistent, which allows the decoder to point
+ * into it (see nb_buffer_read_ref).
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "debug.h"
+#include "memory.h"
+#include "util.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NB_DEBUG_THIS	0
+
+
+static void mmap_delete(struct nb_buffer *buf);
+static void mmap_fill(struct nb_buffer *buf);
+static nb_err_t mmap_seek(struct nb_buffer *buf, size_t offset);
+
+const struct nb_buffer_ops mmap_ops = {
+	.free = mmap_delete,
+	.fill = mmap_fill,
+	.flush = NULL,
+	.seek = mmap_seek,
+};
+
+struct nb_buffer_mmap
+{
+	struct nb_buffer buf;
+	int fd;			/* the file mapped */
+	nb_byte_t *map;		/* the mapping */
+	size_t map_size;	/* size of the mapping */
+	size_t map_pos;		/* offset of the next window within the mapping */
+};
+
+
+/*
+ * Map the file open as fd. Reading starts at fd's current offset.
+ *
+ * If fd cannot be mapped (it's a pipe, a socket or an empty file), a regular
+ * file buffer is returned instead.
+ */
+struct nb_buffer *nb_buffer_new_mmap(int fd)
+{
+	struct nb_buffer_mmap *mmap_buf;
+	struct stat st;
+	off_t offset;
+	void *map;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return nb_buffer_new_file(fd);
+
+	if ((offset = lseek(fd, 0, SEEK_CUR)) == -1)
+		return nb_buffer_new_file(fd);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return nb_buffer_new_file(fd);
+
+	(void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	mmap_buf = nb_malloc(sizeof(*mmap_buf));
+	nb_buffer_init_window(&mmap_buf->buf, map, 0);
+	mmap_buf->buf.ops = &mmap_ops;
+	mmap_buf->buf.persistent = true;
+	mmap_buf->fd = fd;
+	mmap_buf->map = map;
+	mmap_buf->map_size = st.st_size;
+	mmap_buf->map_pos = MIN((size_t)offset, mmap_buf->map_size);
+	mmap_buf->buf.offset = mmap_buf->map_pos;
+
+	return &mmap_buf->buf;
+}
+
+
+static void mmap_delete(struct nb_buffer *buf)
+{
+	struct nb_buffer_mmap *mmap_buf = (struct nb_buffer_mmap *)buf;
+
+	/* leave the file offset where a regular file buffer would */
+	lseek(mmap_buf->fd, mmap_buf->map_pos, SEEK_SET);
+
+	munmap(mmap_buf->map, mmap_buf->map_size);
+	xfree(mmap_buf);
+}
+
+
+/*
+ * The next window starts at the offset, mapping offsets are file offsets.
+ */
+static nb_err_t mmap_seek(struct nb_buffer *buf, size_t offset)
+{
+	struct nb_buffer_mmap *mmap_buf = (struct nb_buffer_mmap *)buf;
+
+	if (offset > mmap_buf->map_size)
+		return NB_ERR_RANGE;
+
+	mmap_buf->map_pos = offset;
+	return NB_ERR_OK;
+}
+
+
+/*
+ * Hand out the rest of the mapping as a single window.
+ */
+static void mmap_fill(struct nb_buffer *buf)
+{
+	struct nb_buffer_mmap *mmap_buf = (struct nb_buffer_mmap *)buf;
+
+	buf->buf = mmap_buf->map + mmap_buf->map_pos;
+	buf->len = mmap_buf->map_size - mmap_buf->map_pos;
+	buf->bufsize = buf->len;
+	mmap_buf->map_pos = mmap_buf->map_size;
+
+	buf->eof = (buf->len == 0);
+}
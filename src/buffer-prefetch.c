@@ -0,0 +1,253 @@
+/*
+ * buffer-prefetch:
+ * Prefetching File Buffer Implementation
+ *
+ * A helper thread keeps reading the file into a ring of windows while the
+ * caller decodes the current one, so fill only has to switch to the next
+ * window. This provides read-ahead where io_uring is not available.
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "debug.h"
+#include "memory.h"
+#include "util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define NB_DEBUG_THIS	0
+
+#define PREFETCH_SLOT_SIZE	(64 * 1024)
+
+
+static void prefetch_delete(struct nb_buffer *buf);
+static void prefetch_fill(struct nb_buffer *buf);
+
+const struct nb_buffer_ops prefetch_ops = {
+	.free = prefetch_delete,
+	.fill = prefetch_fill,
+	.flush = NULL,
+};
+
+struct prefetch_slot
+{
+	nb_byte_t *data;
+	size_t len;		/* number of bytes read */
+	int err;		/* errno of a failed read, or 0 */
+	bool full;		/* has the slot been filled by the thread? */
+};
+
+struct nb_buffer_prefetch
+{
+	struct nb_buffer buf;
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;	/* signalled by the thread */
+	pthread_cond_t emptied;	/* signalled by the reader */
+	bool stop;		/* the thread should terminate */
+	bool thread_eof;	/* the thread has hit EOF */
+
+	struct prefetch_slot *slots;
+	size_t nslots;
+	size_t cur;		/* slot holding the window */
+	bool cur_valid;		/* does cur hold a window handed out by fill? */
+	size_t tell;		/* file offset after the windows handed out */
+	bool eof;		/* has EOF (or a read error) been handed out? */
+	bool seekable;
+};
+
+
+static void free_prefetch(struct nb_buffer_prefetch *pb);
+
+
+static bool would_block(int err)
+{
+	return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+
+static void *prefetch_thread(void *arg)
+{
+	struct nb_buffer_prefetch *pb = arg;
+	struct pollfd pfd = { .fd = pb->fd, .events = POLLIN };
+	struct prefetch_slot *slot;
+	bool again = false;
+	size_t i = 0;
+	ssize_t ret;
+	bool stop;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;) {
+		slot = &pb->slots[i];
+
+		pthread_mutex_lock(&pb->lock);
+		while (slot->full && !pb->stop)
+			pthread_cond_wait(&pb->emptied, &pb->lock);
+		stop = pb->stop;
+		pthread_mutex_unlock(&pb->lock);
+
+		if (stop)
+			break;
+
+		/* the reader may only be blocked in read() or poll() (e.g. on a pipe) */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (again)
+			poll(&pfd, 1, -1);	/* do not spin on a non-blocking file */
+		do {
+			ret = read(pb->fd, slot->data, PREFETCH_SLOT_SIZE);
+		} while (ret == -1 && errno == EINTR);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* the reader gets a read error as file_fill would, then EOF */
+		pthread_mutex_lock(&pb->lock);
+		slot->len = MAX(ret, 0);
+		slot->err = (ret == -1) ? errno : 0;
+		slot->full = true;
+		again = would_block(slot->err);
+		pb->thread_eof = (ret == 0 || (ret == -1 && !again));
+		pthread_cond_signal(&pb->filled);
+		pthread_mutex_unlock(&pb->lock);
+
+		if (pb->thread_eof)
+			break;
+
+		i = (i + 1) % pb->nslots;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Create a file buffer which is filled by a helper thread reading up to
+ * nbufs windows ahead. Reading starts at fd's current offset.
+ */
+struct nb_buffer *nb_buffer_new_file_prefetch(int fd, size_t nbufs)
+{
+	struct nb_buffer_prefetch *pb;
+	off_t offset;
+	size_t i;
+
+	assert(nbufs >= 2);
+
+	pb = nb_malloc(sizeof(*pb));
+	pb->fd = fd;
+	pb->stop = false;
+	pb->thread_eof = false;
+	pb->nslots = nbufs;
+	pb->cur = 0;
+	pb->cur_valid = false;
+	pb->eof = false;
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	pb->seekable = (offset != -1);
+	pb->tell = MAX(offset, 0);
+
+	pb->slots = nb_malloc(nbufs * sizeof(*pb->slots));
+	for (i = 0; i < nbufs; i++) {
+		pb->slots[i].data = nb_malloc(PREFETCH_SLOT_SIZE);
+		pb->slots[i].len = 0;
+		pb->slots[i].err = 0;
+		pb->slots[i].full = false;
+	}
+
+	nb_buffer_init_window(&pb->buf, pb->slots[0].data, 0);
+	pb->buf.ops = &prefetch_ops;
+	pb->buf.offset = pb->tell;
+
+	pthread_mutex_init(&pb->lock, NULL);
+	pthread_cond_init(&pb->filled, NULL);
+	pthread_cond_init(&pb->emptied, NULL);
+
+	if (pthread_create(&pb->thread, NULL, prefetch_thread, pb) != 0) {
+		free_prefetch(pb);
+		return nb_buffer_new_file(fd);
+	}
+
+	return &pb->buf;
+}
+
+
+static void free_prefetch(struct nb_buffer_prefetch *pb)
+{
+	size_t i;
+
+	pthread_cond_destroy(&pb->emptied);
+	pthread_cond_destroy(&pb->filled);
+	pthread_mutex_destroy(&pb->lock);
+
+	for (i = 0; i < pb->nslots; i++)
+		xfree(pb->slots[i].data);
+	xfree(pb->slots);
+	xfree(pb);
+}
+
+
+static void prefetch_delete(struct nb_buffer *buf)
+{
+	struct nb_buffer_prefetch *pb = (struct nb_buffer_prefetch *)buf;
+
+	pthread_mutex_lock(&pb->lock);
+	pb->stop = true;
+	pthread_cond_signal(&pb->emptied);
+	pthread_mutex_unlock(&pb->lock);
+
+	pthread_cancel(pb->thread);
+	pthread_join(pb->thread, NULL);
+
+	/* leave the file offset where a regular file buffer would */
+	if (pb->seekable)
+		lseek(pb->fd, pb->tell, SEEK_SET);
+
+	free_prefetch(pb);
+}
+
+
+/*
+ * Return the current window to the thread and switch to the next one.
+ */
+static void prefetch_fill(struct nb_buffer *buf)
+{
+	struct nb_buffer_prefetch *pb = (struct nb_buffer_prefetch *)buf;
+	struct prefetch_slot *slot;
+
+	pthread_mutex_lock(&pb->lock);
+
+	if (pb->cur_valid) {
+		slot = &pb->slots[pb->cur];
+		if (pb->eof) {
+			/* the thread has stopped */
+			pthread_mutex_unlock(&pb->lock);
+			buf->len = 0;
+			buf->eof = true;
+			return;
+		}
+
+		slot->full = false;
+		pthread_cond_signal(&pb->emptied);
+		pb->cur = (pb->cur + 1) % pb->nslots;
+	}
+
+	slot = &pb->slots[pb->cur];
+	while (!slot->full)
+		pthread_cond_wait(&pb->filled, &pb->lock);
+
+	pthread_mutex_unlock(&pb->lock);
+
+	pb->cur_valid = true;
+	pb->tell += slot->len;
+
+	if (slot->err)
+		buf->err = would_block(slot->err) ? NB_ERR_AGAIN : NB_ERR_READ;
+
+	buf->buf = slot->data;
+	buf->len = slot->len;
+	buf->bufsize = PREFETCH_SLOT_SIZE;
+	buf->eof = (buf->len == 0 && buf->err != NB_ERR_AGAIN);
+	pb->eof = buf->eof;
+}
@@ -0,0 +1,592 @@
+/*
+ * buffer-socket:
+ * Non-Blocking Socket Buffer Implementation
+ *
+ * The buffer never blocks: when the socket cannot take all the data being
+ * flushed, the unsent tail is kept in a backlog which is sent first next
+ * time, and when no data can be received, the fill is cut short. In both
+ * cases, nb_buffer_get_error returns NB_ERR_AGAIN.
+ *
+ * Received data are kept from the last mark on (see nb_buffer_socket_mark),
+ * so that decoding of a message which has not been received completely can
+ * be restarted once the rest of it arrives.
+ *
+ * By default every flush sends the window. A flush policy (see
+ * nb_buffer_socket_policy) holds small flushes back in the backlog instead,
+ * trading latency for fewer and bigger sends. Big windows may be sent with
+ * MSG_ZEROCOPY. The kernel reads them in the background then, so they are
+ * set aside until it reports them done, and the buffer continues with
+ * another window.
+ *
+ * Use one buffer for each direction.
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "debug.h"
+#include "memory.h"
+#include "util.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define NB_DEBUG_THIS	0
+
+#define ZC_WINDOWS	8	/* windows being sent with MSG_ZEROCOPY at most */
+#define ZC_LINGER_MS	1000	/* wait this long for them when deleting the buffer */
+
+
+static void socket_delete(struct nb_buffer *buf);
+static void socket_fill(struct nb_buffer *buf);
+static void socket_flush(struct nb_buffer *buf);
+
+const struct nb_buffer_ops socket_ops = {
+	.free = socket_delete,
+	.fill = socket_fill,
+	.flush = socket_flush,
+};
+
+/*
+ * A window sent with MSG_ZEROCOPY, or a spare one.
+ */
+struct zc_window
+{
+	nb_byte_t *buf;		/* the window, or NULL */
+	uint32_t seq;		/* number of the zerocopy send */
+	bool busy;		/* is the kernel still reading it? */
+};
+
+struct nb_buffer_socket
+{
+	struct nb_buffer buf;
+	int fd;
+
+	/* receiving */
+	nb_byte_t *in;		/* received data, the window points in here */
+	size_t in_size;		/* size of in */
+	size_t in_len;		/* number of bytes received into in */
+	size_t in_base;		/* stream offset of in[0] */
+	size_t mark;		/* offset of the mark within in */
+	bool marked;		/* is the mark set? */
+
+	/* sending */
+	nb_byte_t *out;		/* backlog of unsent data */
+	size_t out_size;	/* size of out */
+	size_t out_len;		/* number of bytes in out */
+	size_t out_sent;	/* number of bytes of out already sent */
+	struct nb_socket_policy policy;
+	uint64_t held_since;	/* when the backlog started to be held back (ms) */
+	bool forced;		/* is nb_buffer_socket_send flushing? */
+	bool corked;		/* has the last send been made with MSG_MORE? */
+
+	/* MSG_ZEROCOPY */
+	bool zerocopy;		/* is SO_ZEROCOPY set? */
+	struct zc_window zc[ZC_WINDOWS];
+	uint32_t zc_next;	/* number of the next zerocopy send */
+	size_t zc_busy;		/* number of busy windows */
+};
+
+
+/*
+ * Create a buffer for the socket sock. The socket doesn't have to be in
+ * non-blocking mode, the buffer never blocks anyway. Data still pending when
+ * the buffer is deleted are lost.
+ *
+ * opts (see nb_buffer_new_file_opts) may be NULL.
+ */
+struct nb_buffer *nb_buffer_new_socket(int sock, const struct nb_buffer_opts *opts)
+{
+	struct nb_buffer_socket *sb;
+
+	sb = nb_malloc(sizeof(*sb));
+	nb_buffer_init_opts(&sb->buf, opts);
+	sb->buf.ops = &socket_ops;
+	sb->fd = sock;
+
+	/* the window is taken over, as it doubles as the receive buffer */
+	sb->buf.own_buf = false;
+	sb->buf.max_bufsize = sb->buf.bufsize;
+	sb->in = sb->buf.buf;
+	sb->in_size = sb->buf.bufsize;
+	sb->in_len = 0;
+	sb->in_base = 0;
+	sb->mark = 0;
+	sb->marked = false;
+
+	sb->out = NULL;
+	sb->out_size = 0;
+	sb->out_len = 0;
+	sb->out_sent = 0;
+	memset(&sb->policy, 0, sizeof(sb->policy));
+	sb->held_since = 0;
+	sb->forced = false;
+	sb->corked = false;
+
+	sb->zerocopy = false;
+	memset(sb->zc, 0, sizeof(sb->zc));
+	sb->zc_next = 0;
+	sb->zc_busy = 0;
+
+	return &sb->buf;
+}
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Set the policy of sending the data flushed, the data already held back
+ * are subject to it from the next flush on. A zero threshold selects the
+ * window size. NB_ERR_UNSUP is returned if the socket does not support
+ * MSG_ZEROCOPY (the rest of the policy applies nevertheless).
+ *
+ * Windows sent with MSG_ZEROCOPY are reported done on the socket's error
+ * queue, so poll() reports POLLERR then; nb_buffer_socket_send reaps them.
+ */
+nb_err_t nb_buffer_socket_policy(struct nb_buffer *buf, const struct nb_socket_policy *policy)
+{
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+	int one = 1;
+
+	assert(buf->ops == &socket_ops);
+
+	sb->policy = *policy;
+	if (sb->policy.threshold == 0)
+		sb->policy.threshold = sb->in_size;
+
+	if (policy->zerocopy_min > 0 && !sb->zerocopy) {
+		if (setsockopt(sb->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+			sb->policy.zerocopy_min = 0;
+			return NB_ERR_UNSUP;
+		}
+		sb->zerocopy = true;
+	}
+
+	return NB_ERR_OK;
+}
+
+
+/*
+ * Release the windows which the kernel has reported done.
+ */
+static void reap_zerocopy(struct nb_buffer_socket *sb)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	size_t i;
+
+	while (sb->zc_busy > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sb->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			return;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+				&& !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+				continue;
+
+			/* sends ee_info to ee_data (inclusive) are done */
+			for (i = 0; i < ZC_WINDOWS; i++) {
+				if (sb->zc[i].busy
+					&& sb->zc[i].seq - serr->ee_info <= serr->ee_data - serr->ee_info) {
+					sb->zc[i].busy = false;
+					sb->zc_busy--;
+				}
+			}
+		}
+	}
+}
+
+
+/*
+ * Find a slot for the window to be sent with MSG_ZEROCOPY, preferably one
+ * with a spare window.
+ */
+static struct zc_window *find_zc_slot(struct nb_buffer_socket *sb)
+{
+	struct zc_window *empty = NULL;
+	size_t i;
+
+	if (sb->zc_busy == ZC_WINDOWS)
+		reap_zerocopy(sb);
+
+	for (i = 0; i < ZC_WINDOWS; i++) {
+		if (sb->zc[i].busy)
+			continue;
+		if (sb->zc[i].buf)
+			return &sb->zc[i];
+		if (!empty)
+			empty = &sb->zc[i];
+	}
+
+	return empty;
+}
+
+
+/*
+ * Set the window aside until the kernel is done with it, and continue with
+ * the spare window of the slot (or a new one).
+ */
+static void retire_window(struct nb_buffer_socket *sb, struct zc_window *slot)
+{
+	nb_byte_t *spare = slot->buf ? slot->buf : nb_malloc(sb->in_size);
+
+	slot->buf = sb->in;
+	slot->seq = sb->zc_next++;
+	slot->busy = true;
+	sb->zc_busy++;
+
+	sb->in = sb->buf.buf = spare;
+}
+
+
+/*
+ * The windows still being sent are waited for a while, freeing them early
+ * could change the data before they go out.
+ */
+static void socket_delete(struct nb_buffer *buf)
+{
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+	struct pollfd pfd = { .fd = sb->fd };
+	int waited;
+	size_t i;
+
+	for (waited = 0; sb->zc_busy > 0 && waited < ZC_LINGER_MS; waited += 10) {
+		reap_zerocopy(sb);
+		if (sb->zc_busy > 0)
+			poll(&pfd, 1, 10);	/* POLLERR once the error queue gets something */
+	}
+
+	for (i = 0; i < ZC_WINDOWS; i++)
+		xfree(sb->zc[i].buf);
+
+	xfree(sb->in);
+	xfree(sb->out);
+	xfree(sb);
+}
+
+
+/*
+ * Make room for new data in the receive buffer: drop the data preceding
+ * the mark (or all of them) and grow the buffer if it's still full.
+ */
+static void make_room(struct nb_buffer_socket *sb, size_t *end)
+{
+	size_t keep_from = sb->marked ? sb->mark : sb->in_len;
+
+	if (keep_from > 0) {
+		memmove(sb->in, sb->in + keep_from, sb->in_len - keep_from);
+		sb->in_base += keep_from;
+		sb->in_len -= keep_from;
+		*end -= keep_from;
+		sb->mark = 0;
+	}
+
+	if (sb->in_len == sb->in_size) {
+		sb->in_size *= 2;
+		sb->in = nb_realloc(sb->in, sb->in_size);
+	}
+}
+
+
+static void socket_fill(struct nb_buffer *buf)
+{
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+	size_t end = (buf->buf - sb->in) + buf->len;
+	ssize_t ret;
+
+	/* hand out what's been received after a reset first */
+	if (end < sb->in_len)
+		goto window;
+
+	make_room(sb, &end);
+
+	do {
+		ret = recv(sb->fd, sb->in + sb->in_len, sb->in_size - sb->in_len, MSG_DONTWAIT);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1) {
+		buf->err = (errno == EAGAIN || errno == EWOULDBLOCK) ? NB_ERR_AGAIN : NB_ERR_READ;
+		ret = 0;
+	}
+	else if (ret == 0) {
+		buf->eof = true;
+	}
+
+	sb->in_len += ret;
+
+window:
+	buf->buf = sb->in + end;
+	buf->len = sb->in_len - end;
+	buf->bufsize = sb->in_size - end;
+}
+
+
+/*
+ * Set the mark at the current read position. The data from the mark on are
+ * kept until the next mark is set.
+ */
+void nb_buffer_socket_mark(struct nb_buffer *buf)
+{
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+
+	assert(buf->ops == &socket_ops);
+	assert(buf->mode != BUF_MODE_WRITING);
+
+	sb->mark = (buf->buf - sb->in) + buf->pos;
+	sb->marked = true;
+}
+
+
+/*
+ * Return to the mark, e.g. after decoding has failed with NB_ERR_AGAIN.
+ */
+void nb_buffer_socket_reset(struct nb_buffer *buf)
+{
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+
+	assert(buf->ops == &socket_ops);
+	assert(sb->marked);
+
+	buf->buf = sb->in + sb->mark;
+	buf->offset = sb->in_base + sb->mark;
+	buf->pos = 0;
+	buf->len = sb->in_len - sb->mark;
+	buf->bufsize = sb->in_size - sb->mark;
+	buf->eof = false;
+}
+
+
+/*
+ * Append bytes to the backlog.
+ */
+static void push_backlog(struct nb_buffer_socket *sb, nb_byte_t *bytes, size_t count)
+{
+	if (count == 0)
+		return;
+
+	if (sb->out_len == sb->out_sent && sb->policy.flush == NB_SOCKET_FLUSH_DEADLINE)
+		sb->held_since = now_ms();
+
+	if (sb->out_sent > 0) {
+		memmove(sb->out, sb->out + sb->out_sent, sb->out_len - sb->out_sent);
+		sb->out_len -= sb->out_sent;
+		sb->out_sent = 0;
+	}
+
+	if (sb->out_len + count > sb->out_size) {
+		sb->out_size = MAX(2 * sb->out_size, sb->out_len + count);
+		sb->out = nb_realloc(sb->out, sb->out_size);
+	}
+
+	memcpy(sb->out + sb->out_len, bytes, count);
+	sb->out_len += count;
+}
+
+
+/*
+ * Send the backlog followed by count bytes of the window, keep what can't
+ * be sent in the backlog. With MSG_ZEROCOPY in flags, the backlog has to
+ * be empty, and the window is retired into slot if anything gets sent.
+ */
+static void send_pending(struct nb_buffer_socket *sb, size_t count, int flags,
+	struct zc_window *slot)
+{
+	struct nb_buffer *buf = &sb->buf;
+	struct iovec iov[2];
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+	size_t backlog = sb->out_len - sb->out_sent;
+	ssize_t sent;
+
+	if (backlog + count == 0)
+		return;
+
+	iov[0].iov_base = sb->out + sb->out_sent;
+	iov[0].iov_len = backlog;
+	iov[1].iov_base = buf->buf;
+	iov[1].iov_len = count;
+
+	while ((sent = sendmsg(sb->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL | flags)) == -1) {
+		if (errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+			flags &= ~MSG_ZEROCOPY;	/* no memory to pin the pages, copy them */
+		else if (errno != EINTR)
+			break;
+	}
+
+	if (sent == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			/* the connection is broken, the data are lost */
+			buf->err = NB_ERR_WRITE;
+			sb->out_len = sb->out_sent = 0;
+			return;
+		}
+		sent = 0;
+	}
+
+	if (sent > 0)
+		sb->corked = (flags & MSG_MORE);
+
+	if ((size_t)sent < backlog) {
+		sb->out_sent += sent;
+		push_backlog(sb, buf->buf, count);
+	}
+	else {
+		sb->out_len = sb->out_sent = 0;
+		sent -= backlog;
+		push_backlog(sb, buf->buf + sent, count - sent);
+	}
+
+	if ((flags & MSG_ZEROCOPY) && sent > 0)
+		retire_window(sb, slot);
+
+	if (sb->out_len > sb->out_sent)
+		buf->err = NB_ERR_AGAIN;
+}
+
+
+/*
+ * Are the pending data (the backlog and count more bytes) due to be sent?
+ */
+static bool is_due(struct nb_buffer_socket *sb, size_t count)
+{
+	size_t backlog = sb->out_len - sb->out_sent;
+
+	switch (sb->policy.flush) {
+	case NB_SOCKET_FLUSH_THRESHOLD:
+		return backlog + count >= sb->policy.threshold;
+	case NB_SOCKET_FLUSH_DEADLINE:
+		return backlog + count >= sb->policy.threshold
+			|| (backlog > 0 && now_ms() - sb->held_since >= sb->policy.deadline_ms);
+	default:
+		return true;
+	}
+}
+
+
+static void socket_flush(struct nb_buffer *buf)
+{
+	NB_DEBUG_TRACE;
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+	struct zc_window *slot = NULL;
+	int flags = 0;
+
+	assert(buf->buf == sb->in); /* the buffer is used for writing only */
+
+	if (!sb->forced && !is_due(sb, buf->len)) {
+		push_backlog(sb, buf->buf, buf->len);
+		return;
+	}
+
+	if (sb->zerocopy && sb->policy.zerocopy_min > 0 && buf->len >= sb->policy.zerocopy_min
+		&& sb->out_len == sb->out_sent && (slot = find_zc_slot(sb)) != NULL)
+		flags |= MSG_ZEROCOPY;
+
+	/*
+	 * A window flushed to make room (which may be a few bytes short of
+	 * full, see nb_buffer_reserve) is followed by the rest of the message,
+	 * an explicit flush ends it. Not with MSG_ZEROCOPY though, the kernel
+	 * holds corked zerocopy data back until the cork is removed, which
+	 * stalls the sender as long.
+	 */
+	if (sb->policy.cork && !sb->forced && buf->flush_cause == BUF_FLUSH_FULL
+		&& !(flags & MSG_ZEROCOPY))
+		flags |= MSG_MORE;
+
+	send_pending(sb, buf->len, flags, slot);
+}
+
+
+/*
+ * Flush the buffer and try to send the backlog, e.g. once poll() reports
+ * that the socket is writable, or that the deadline of the data held back
+ * has passed (see nb_buffer_socket_timeout). All the data are sent
+ * regardless of the flush policy, and a cork set by MSG_MORE is removed.
+ * NB_ERR_AGAIN is returned if some data are still pending.
+ */
+nb_err_t nb_buffer_socket_send(struct nb_buffer *buf)
+{
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+	int off = 0;
+
+	assert(buf->ops == &socket_ops);
+
+	if (sb->zc_busy > 0)
+		reap_zerocopy(sb);
+
+	if (buf->mode == BUF_MODE_WRITING) {
+		sb->forced = true;
+		nb_buffer_flush(buf);
+		sb->forced = false;
+	}
+	else {
+		buf->err = NB_ERR_OK;
+		send_pending(sb, 0, 0, NULL);
+	}
+
+	/* nothing has been sent to push the corked data out */
+	if (sb->corked) {
+		setsockopt(sb->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+		sb->corked = false;
+	}
+
+	return buf->err;
+}
+
+
+/*
+ * Return the number of milliseconds (for poll()) until the data held back
+ * by the deadline policy are due, or -1 if there are none. Once they are,
+ * call nb_buffer_socket_send.
+ */
+int nb_buffer_socket_timeout(struct nb_buffer *buf)
+{
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+	uint64_t held;
+
+	assert(buf->ops == &socket_ops);
+
+	if (sb->policy.flush != NB_SOCKET_FLUSH_DEADLINE || sb->out_len == sb->out_sent)
+		return -1;
+
+	held = now_ms() - sb->held_since;
+	return held >= sb->policy.deadline_ms ? 0 : (int)(sb->policy.deadline_ms - held);
+}
+
+
+/*
+ * Return the number of bytes written into the buffer but not sent yet.
+ */
+size_t nb_buffer_socket_pending(struct nb_buffer *buf)
+{
+	struct nb_buffer_socket *sb = (struct nb_buffer_socket *)buf;
+
+	assert(buf->ops == &socket_ops);
+
+	return sb->out_len - sb->out_sent + (buf->mode == BUF_MODE_WRITING ? buf->len : 0);
+}
@@ -0,0 +1,420 @@
+/*
+ * buffer-spsc:
+ * Single-Producer Single-Consumer Ring Buffers
+ *
+ * A pair of buffers passing a stream from one thread to another through a
+ * ring, without locks or system calls. The windows of both buffers point
+ * right into the ring: the writer's window covers free space, a flush
+ * publishes what's been written into it; the reader's window covers the
+ * published data, which are released by the next fill. Nothing is copied.
+ * Either window covers at most a quarter of the ring (a chunk), so that the
+ * reader works on one chunk while the writer fills the next one.
+ *
+ * The ring may also be shared between two processes: nb_buffer_shm_create
+ * puts it into a memfd, which is passed to the other process (by fork, or
+ * over a Unix socket with SCM_RIGHTS), and each process maps it with
+ * nb_buffer_new_shm.
+ *
+ * The writer and the reader only share the two indices of the ring, each of
+ * which is stored by one side only (with release semantics, and loaded with
+ * acquire semantics by the other side). Each side caches the other side's
+ * index, so the indices' cache lines are touched only when the cached value
+ * does not suffice. A side which has to wait spins for a while and then
+ * sleeps on a futex, after announcing so in the ring. The other side issues
+ * a wakeup only if it finds a sleeper, i.e. when the ring has gone from
+ * empty to non-empty (or from full to non-full), so a busy stream costs no
+ * system calls at all.
+ *
+ * The data written become visible to the reader when the writer's window
+ * gets full, so flush the writer (nb_buffer_flush) to pass e.g. a complete
+ * message on right away. Deleting the writer flushes it and marks the end
+ * of the stream.
+ */
+
+#define _GNU_SOURCE
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "memory.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CACHE_LINE	64
+#define SPIN_LIMIT	1000	/* sleep after spinning this many times */
+#define RING_DATA	4096	/* offset of the data, past the ring's header */
+#define RING_MAGIC	0x6e627370	/* "nbsp", marks a ring in a memfd */
+#define RING_CHUNKS	4	/* a window covers at most this part of the ring */
+
+
+static void spsc_delete(struct nb_buffer *buf);
+static void spsc_fill(struct nb_buffer *buf);
+static void spsc_flush(struct nb_buffer *buf);
+
+const struct nb_buffer_ops spsc_writer_ops = {
+	.free = spsc_delete,
+	.fill = NULL,
+	.flush = spsc_flush,
+};
+
+const struct nb_buffer_ops spsc_reader_ops = {
+	.free = spsc_delete,
+	.fill = spsc_fill,
+	.flush = NULL,
+};
+
+/*
+ * The header of the ring, followed by the data at RING_DATA. It contains no
+ * pointers, so that it can be mapped at different addresses.
+ */
+struct spsc_ring
+{
+	_Alignas(CACHE_LINE) atomic_size_t head;	/* end of published data */
+	atomic_uint data_seq;				/* futex of a waiting reader */
+	atomic_bool reader_waiting;
+	_Alignas(CACHE_LINE) atomic_size_t tail;	/* end of released data */
+	atomic_uint space_seq;				/* futex of a waiting writer */
+	atomic_bool writer_waiting;
+	_Alignas(CACHE_LINE) atomic_bool writer_done;	/* no more data will come */
+	atomic_bool reader_done;			/* no more data will be read */
+	atomic_int refs;				/* buffers using the ring */
+	uint32_t magic;
+	size_t size;					/* a power of two */
+};
+
+_Static_assert(sizeof(struct spsc_ring) <= RING_DATA, "ring header too big");
+
+struct nb_buffer_spsc
+{
+	struct nb_buffer buf;
+	struct spsc_ring *ring;
+	nb_byte_t *data;	/* the data of the ring */
+	size_t index;		/* the writer's head or the reader's tail */
+	size_t other;		/* last seen tail (writer) or head (reader) */
+	bool has_reader;	/* has the reader been created? (writer) */
+	bool shared;		/* is the ring mapped from a memfd? */
+	int futex_private;	/* FUTEX_PRIVATE_FLAG, unless shared */
+};
+
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+
+static size_t ring_size(size_t size)
+{
+	size_t ring_size = 1;
+
+	while (ring_size < MAX(size, CACHE_LINE))
+		ring_size <<= 1;
+
+	return ring_size;
+}
+
+
+static void init_ring(struct spsc_ring *ring, size_t size)
+{
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->data_seq, 0);
+	atomic_init(&ring->reader_waiting, false);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->space_seq, 0);
+	atomic_init(&ring->writer_waiting, false);
+	atomic_init(&ring->writer_done, false);
+	atomic_init(&ring->reader_done, false);
+	atomic_init(&ring->refs, 1);
+	ring->magic = RING_MAGIC;
+	ring->size = size;
+}
+
+
+/*
+ * Wait while the other side's index is still seen and the other side is
+ * not done. Spin first, then announce the wait in waiting and sleep on seq,
+ * which the other side bumps when it finds waiting set (see wake).
+ */
+static void wait_for(struct nb_buffer_spsc *sb, atomic_size_t *index, size_t seen,
+	atomic_uint *seq, atomic_bool *waiting, atomic_bool *done)
+{
+	unsigned spins;
+	unsigned val;
+
+	for (spins = 0; spins < SPIN_LIMIT; spins++) {
+		if (atomic_load_explicit(index, memory_order_relaxed) != seen
+			|| atomic_load_explicit(done, memory_order_relaxed))
+			return;
+		cpu_relax();
+	}
+
+	val = atomic_load(seq);
+	atomic_store(waiting, true);
+	/* pairs with the fence in wake: either we see the index, or it sees us */
+	if (atomic_load(index) == seen && !atomic_load(done))
+		syscall(SYS_futex, seq, FUTEX_WAIT | sb->futex_private, val, NULL, NULL, 0);
+	atomic_store_explicit(waiting, false, memory_order_relaxed);
+}
+
+
+/*
+ * Wake the other side up if it's sleeping in wait_for, after storing the
+ * index (or done flag) it waits for.
+ */
+static void wake(struct nb_buffer_spsc *sb, atomic_uint *seq, atomic_bool *waiting)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(waiting, memory_order_relaxed))
+		return;
+
+	atomic_fetch_add(seq, 1);
+	syscall(SYS_futex, seq, FUTEX_WAKE | sb->futex_private, 1, NULL, NULL, 0);
+}
+
+
+/*
+ * Return the most of the ring following index a window may cover: up to the
+ * end of the ring, and a chunk at most.
+ */
+static size_t max_window(struct spsc_ring *ring, size_t index)
+{
+	return MIN(ring->size - (index & (ring->size - 1)), ring->size / RING_CHUNKS);
+}
+
+
+/*
+ * Point the window at the free space of the ring following index (see
+ * max_window). The window may be empty if the ring is full.
+ */
+static void set_free_window(struct nb_buffer_spsc *sb)
+{
+	struct spsc_ring *ring = sb->ring;
+	size_t want = max_window(ring, sb->index);
+
+	/* the cached tail may be behind */
+	if (ring->size - (sb->index - sb->other) < want)
+		sb->other = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	sb->buf.buf = sb->data + (sb->index & (ring->size - 1));
+	sb->buf.bufsize = MIN(want, ring->size - (sb->index - sb->other));
+}
+
+
+static struct nb_buffer *new_end(struct spsc_ring *ring, bool writer, bool shared)
+{
+	struct nb_buffer_spsc *sb = nb_malloc(sizeof(*sb));
+
+	sb->ring = ring;
+	sb->data = (nb_byte_t *)ring + RING_DATA;
+	sb->index = 0;
+	sb->other = 0;
+	sb->has_reader = false;
+	sb->shared = shared;
+	sb->futex_private = shared ? 0 : FUTEX_PRIVATE_FLAG;
+
+	nb_buffer_init_window(&sb->buf, sb->data, writer ? max_window(ring, 0) : 0);
+	sb->buf.ops = writer ? &spsc_writer_ops : &spsc_reader_ops;
+
+	return &sb->buf;
+}
+
+
+/*
+ * Create the writer of a ring of (at least) size bytes, see
+ * nb_buffer_spsc_reader for the reader.
+ */
+struct nb_buffer *nb_buffer_new_spsc(size_t size)
+{
+	struct spsc_ring *ring;
+
+	size = ring_size(size);
+	ring = nb_malloc_aligned(CACHE_LINE, RING_DATA + size);
+	init_ring(ring, size);
+
+	return new_end(ring, true, false);
+}
+
+
+/*
+ * Create the reader of the ring written by the writer, to be used by
+ * another thread. A writer has a single reader.
+ */
+struct nb_buffer *nb_buffer_spsc_reader(struct nb_buffer *writer)
+{
+	struct nb_buffer_spsc *wb = (struct nb_buffer_spsc *)writer;
+
+	assert(writer->ops == &spsc_writer_ops);
+	assert(!wb->shared);
+	assert(!wb->has_reader);
+
+	wb->has_reader = true;
+	atomic_fetch_add_explicit(&wb->ring->refs, 1, memory_order_relaxed);
+
+	return new_end(wb->ring, false, false);
+}
+
+
+/*
+ * Create a ring of (at least) size bytes in a memfd, to be shared by two
+ * processes (see nb_buffer_new_shm). Returns the memfd (with FD_CLOEXEC
+ * set), or -1 with errno set.
+ */
+int nb_buffer_shm_create(size_t size)
+{
+	struct spsc_ring *ring;
+	int fd;
+
+	size = ring_size(size);
+
+	if ((fd = memfd_create("netbufs-ring", MFD_CLOEXEC)) == -1)
+		return -1;
+
+	if (ftruncate(fd, RING_DATA + size) == -1
+		|| (ring = mmap(NULL, RING_DATA, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	init_ring(ring, size);
+	munmap(ring, RING_DATA);
+
+	return fd;
+}
+
+
+/*
+ * Map the ring in the memfd created by nb_buffer_shm_create, as its writer
+ * or as its reader. A ring has a single writer and a single reader, in one
+ * or two processes. The memfd may be closed afterwards. Returns NULL with
+ * errno set if the ring cannot be mapped, EINVAL if fd is not a ring.
+ */
+struct nb_buffer *nb_buffer_new_shm(int fd, bool writer)
+{
+	struct spsc_ring *ring;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return NULL;
+
+	if ((size_t)st.st_size <= RING_DATA) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
+
+	if (ring->magic != RING_MAGIC || RING_DATA + ring->size != (size_t)st.st_size) {
+		munmap(ring, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return new_end(ring, writer, true);
+}
+
+
+/*
+ * Publish the window and move on to the free space following it. If there's
+ * none, the writer waits for the reader, unless the window has been
+ * published just now; the next flush waits then (see write_internal).
+ */
+static void spsc_flush(struct nb_buffer *buf)
+{
+	struct nb_buffer_spsc *sb = (struct nb_buffer_spsc *)buf;
+	struct spsc_ring *ring = sb->ring;
+
+	if (atomic_load_explicit(&ring->reader_done, memory_order_relaxed)) {
+		buf->err = NB_ERR_WRITE;	/* nobody's going to read the data */
+		return;
+	}
+
+	if (buf->len > 0) {
+		sb->index += buf->len;
+		atomic_store_explicit(&ring->head, sb->index, memory_order_release);
+		wake(sb, &ring->data_seq, &ring->reader_waiting);
+		set_free_window(sb);
+		return;
+	}
+
+	for (set_free_window(sb); buf->bufsize == 0; set_free_window(sb)) {
+		if (atomic_load_explicit(&ring->reader_done, memory_order_relaxed)) {
+			buf->err = NB_ERR_WRITE;
+			return;
+		}
+		wait_for(sb, &ring->tail, sb->other, &ring->space_seq, &ring->writer_waiting,
+			&ring->reader_done);
+	}
+}
+
+
+/*
+ * Release the window and wait for data following it. The end of the stream
+ * is reached once the writer is gone and all its data have been read.
+ */
+static void spsc_fill(struct nb_buffer *buf)
+{
+	struct nb_buffer_spsc *sb = (struct nb_buffer_spsc *)buf;
+	struct spsc_ring *ring = sb->ring;
+	bool done;
+
+	if (buf->len > 0) {
+		sb->index += buf->len;
+		atomic_store_explicit(&ring->tail, sb->index, memory_order_release);
+		wake(sb, &ring->space_seq, &ring->writer_waiting);
+	}
+
+	while (sb->other == sb->index) {
+		done = atomic_load_explicit(&ring->writer_done, memory_order_acquire);
+		sb->other = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (sb->other != sb->index)
+			break;
+		if (done) {
+			buf->len = 0;
+			buf->eof = true;
+			return;
+		}
+		wait_for(sb, &ring->head, sb->index, &ring->data_seq, &ring->reader_waiting,
+			&ring->writer_done);
+	}
+
+	buf->buf = sb->data + (sb->index & (ring->size - 1));
+	buf->len = MIN(max_window(ring, sb->index), sb->other - sb->index);
+	buf->bufsize = buf->len;
+}
+
+
+static void spsc_delete(struct nb_buffer *buf)
+{
+	struct nb_buffer_spsc *sb = (struct nb_buffer_spsc *)buf;
+	struct spsc_ring *ring = sb->ring;
+
+	if (buf->ops == &spsc_writer_ops) {
+		atomic_store_explicit(&ring->writer_done, true, memory_order_release);
+		wake(sb, &ring->data_seq, &ring->reader_waiting);
+	}
+	else {
+		atomic_store_explicit(&ring->reader_done, true, memory_order_relaxed);
+		wake(sb, &ring->space_seq, &ring->writer_waiting);
+	}
+
+	if (sb->shared)
+		munmap(ring, RING_DATA + ring->size);
+	else if (atomic_fetch_sub_explicit(&ring->refs, 1, memory_order_acq_rel) == 1)
+		xfree(ring);
+
+	xfree(sb);
+}
@@ -0,0 +1,256 @@
+/*
+ * buffer-tee:
+ * Tee Buffer
+ *
+ * Each flushed window is written into several sink buffers, so a stream is
+ * encoded once and sent e.g. both to a peer and to an archive. Like filters
+ * (see buffer-filter.c), the tee does not own its sinks. Deleting the tee
+ * flushes it into the sinks, which have to be deleted by the caller then.
+ *
+ * Sinks exert backpressure on their own: socket buffers keep a backlog (see
+ * nb_buffer_new_socket), so the tee never blocks on them. A slow sink, such
+ * as a file on a busy disk, may be set to spill: the windows are queued for
+ * it, and only nb_buffer_tee_drain writes the queue out, as much of it at a
+ * time as the caller allows. Flushing the tee never waits for such a sink.
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "memory.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+
+
+static void tee_delete(struct nb_buffer *buf);
+static void tee_flush(struct nb_buffer *buf);
+
+const struct nb_buffer_ops tee_ops = {
+	.free = tee_delete,
+	.fill = NULL,
+	.flush = tee_flush,
+};
+
+struct tee_sink
+{
+	struct nb_buffer *buf;
+	bool spill;		/* queue the data instead of writing them? */
+	size_t spill_max;	/* write the queue out once it's bigger than this */
+	nb_byte_t *queue;	/* data not written into the sink yet */
+	size_t queue_size;	/* size of queue */
+	size_t queue_pos;	/* start of the data in queue */
+	size_t queue_len;	/* end of the data in queue */
+};
+
+struct nb_buffer_tee
+{
+	struct nb_buffer buf;
+	struct tee_sink *sinks;
+	size_t nsinks;
+};
+
+
+/*
+ * Create a tee writing into the sink buffers listed, the list is terminated
+ * by NULL.
+ */
+struct nb_buffer *nb_buffer_new_tee(struct nb_buffer *sink, ...)
+{
+	struct nb_buffer_tee *tee;
+	struct nb_buffer *next;
+	va_list args;
+	size_t i;
+
+	tee = nb_malloc(sizeof(*tee));
+	nb_buffer_init(&tee->buf);
+	tee->buf.ops = &tee_ops;
+
+	va_start(args, sink);
+	for (tee->nsinks = 0, next = sink; next; next = va_arg(args, struct nb_buffer *))
+		tee->nsinks++;
+	va_end(args);
+
+	tee->sinks = nb_malloc(tee->nsinks * sizeof(*tee->sinks));
+	memset(tee->sinks, 0, tee->nsinks * sizeof(*tee->sinks));
+
+	va_start(args, sink);
+	for (i = 0, next = sink; next; next = va_arg(args, struct nb_buffer *), i++)
+		tee->sinks[i].buf = next;
+	va_end(args);
+
+	return &tee->buf;
+}
+
+
+static struct tee_sink *find_sink(struct nb_buffer_tee *tee, struct nb_buffer *sink)
+{
+	size_t i;
+
+	for (i = 0; i < tee->nsinks; i++)
+		if (tee->sinks[i].buf == sink)
+			return &tee->sinks[i];
+
+	assert(false); /* not a sink of the tee */
+	return NULL;
+}
+
+
+/*
+ * Queue the data for the sink instead of writing them into it, which is left
+ * to nb_buffer_tee_drain. Once more than max_queued bytes are queued, the
+ * tee's flushes report NB_ERR_AGAIN, asking for a drain. Nothing is dropped
+ * though: the queue grows until it's drained.
+ */
+void nb_buffer_tee_spill(struct nb_buffer *buf, struct nb_buffer *sink, size_t max_queued)
+{
+	struct tee_sink *ts;
+
+	assert(buf->ops == &tee_ops);
+
+	ts = find_sink((struct nb_buffer_tee *)buf, sink);
+	ts->spill = true;
+	ts->spill_max = max_queued;
+}
+
+
+static void set_error(struct nb_buffer *buf, struct nb_buffer *sink)
+{
+	/* the first error sticks */
+	if (buf->err == NB_ERR_OK)
+		buf->err = sink->err;
+}
+
+
+/*
+ * Write up to max bytes of the queue into the sink, return their number.
+ */
+static size_t write_queue(struct nb_buffer *buf, struct tee_sink *ts, size_t max)
+{
+	size_t len = MIN(ts->queue_len - ts->queue_pos, max);
+
+	if (len == 0)
+		return 0;
+
+	nb_buffer_write(ts->buf, ts->queue + ts->queue_pos, len);
+	ts->queue_pos += len;
+	if (ts->queue_pos == ts->queue_len)
+		ts->queue_pos = ts->queue_len = 0;
+
+	set_error(buf, ts->buf);
+	return len;
+}
+
+
+static void push_queue(struct tee_sink *ts, nb_byte_t *bytes, size_t count)
+{
+	if (ts->queue_len + count > ts->queue_size && ts->queue_pos > 0) {
+		memmove(ts->queue, ts->queue + ts->queue_pos, ts->queue_len - ts->queue_pos);
+		ts->queue_len -= ts->queue_pos;
+		ts->queue_pos = 0;
+	}
+
+	if (ts->queue_len + count > ts->queue_size) {
+		ts->queue_size = MAX(2 * ts->queue_size, ts->queue_len + count);
+		ts->queue = nb_realloc(ts->queue, ts->queue_size);
+	}
+
+	memcpy(ts->queue + ts->queue_len, bytes, count);
+	ts->queue_len += count;
+}
+
+
+/*
+ * Sinks with an error are skipped, the other sinks still get the data. The
+ * tee's error is the error of the first sink which has failed.
+ */
+static void tee_flush(struct nb_buffer *buf)
+{
+	struct nb_buffer_tee *tee = (struct nb_buffer_tee *)buf;
+	struct tee_sink *ts;
+	size_t i;
+
+	for (i = 0; i < tee->nsinks; i++) {
+		ts = &tee->sinks[i];
+		if (ts->buf->err != NB_ERR_OK && ts->buf->err != NB_ERR_AGAIN) {
+			set_error(buf, ts->buf);
+			continue;
+		}
+
+		if (!ts->spill) {
+			nb_buffer_write(ts->buf, buf->buf, buf->len);
+			set_error(buf, ts->buf);
+			continue;
+		}
+
+		push_queue(ts, buf->buf, buf->len);
+		if (ts->queue_len - ts->queue_pos > ts->spill_max && buf->err == NB_ERR_OK)
+			buf->err = NB_ERR_AGAIN;
+	}
+}
+
+
+/*
+ * Flush the tee, write up to budget bytes of the queues out (SIZE_MAX for
+ * all of them) and flush all sinks. Call it e.g. whenever a spilled sink's
+ * file descriptor is writable. Returns the tee's error: NB_ERR_AGAIN if data
+ * are left queued, or if a socket sink could not send all the data (its
+ * backlog is sent by nb_buffer_socket_send then).
+ */
+nb_err_t nb_buffer_tee_drain(struct nb_buffer *buf, size_t budget)
+{
+	struct nb_buffer_tee *tee = (struct nb_buffer_tee *)buf;
+	struct tee_sink *ts;
+	size_t i;
+
+	assert(buf->ops == &tee_ops);
+
+	nb_buffer_flush(buf);
+
+	/* whether data are left queued is checked below */
+	if (buf->err == NB_ERR_AGAIN)
+		buf->err = NB_ERR_OK;
+
+	for (i = 0; i < tee->nsinks; i++) {
+		ts = &tee->sinks[i];
+		budget -= write_queue(buf, ts, budget);
+		nb_buffer_flush(ts->buf);
+		set_error(buf, ts->buf);
+		if (ts->queue_len > 0 && buf->err == NB_ERR_OK)
+			buf->err = NB_ERR_AGAIN;
+	}
+
+	return buf->err;
+}
+
+
+/*
+ * Return the number of bytes queued for the sink.
+ */
+size_t nb_buffer_tee_pending(struct nb_buffer *buf, struct nb_buffer *sink)
+{
+	struct tee_sink *ts;
+
+	assert(buf->ops == &tee_ops);
+
+	ts = find_sink((struct nb_buffer_tee *)buf, sink);
+	return ts->queue_len - ts->queue_pos;
+}
+
+
+static void tee_delete(struct nb_buffer *buf)
+{
+	struct nb_buffer_tee *tee = (struct nb_buffer_tee *)buf;
+	size_t i;
+
+	/* the end of the stream, the queues are written out anyway */
+	for (i = 0; i < tee->nsinks; i++) {
+		write_queue(buf, &tee->sinks[i], SIZE_MAX);
+		xfree(tee->sinks[i].queue);
+	}
+
+	xfree(tee->sinks);
+	xfree(tee);
+}
@@ -0,0 +1,534 @@
+/*
+ * buffer-uring:
+ * Asynchronous File Buffer Implementation (io_uring)
+ *
+ * The buffer owns a few windows (slots) which are kept in flight using
+ * io_uring: when reading, the following chunks of the file are read ahead
+ * while the current window is being decoded; when writing, a flush only
+ * queues the window for writing and continues in the next free slot.
+ *
+ * When io_uring is not available (at compile time or at run time), a regular
+ * file buffer is used instead.
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "debug.h"
+#include "memory.h"
+#include "util.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define NB_DEBUG_THIS	0
+
+#define URING_NUM_SLOTS	4
+#define URING_SLOT_SIZE	(64 * 1024)
+
+
+static void uring_delete(struct nb_buffer *buf);
+static void uring_fill(struct nb_buffer *buf);
+static void uring_flush(struct nb_buffer *buf);
+
+const struct nb_buffer_ops uring_ops = {
+	.free = uring_delete,
+	.fill = uring_fill,
+	.flush = uring_flush,
+};
+
+enum slot_state
+{
+	SLOT_FREE,		/* the slot is unused or holds the current window */
+	SLOT_BUSY,		/* a request is in flight */
+	SLOT_DONE,		/* the request has completed */
+};
+
+struct uring_slot
+{
+	nb_byte_t *data;	/* slot's memory */
+	struct iovec iov;	/* used unless the memory is registered */
+	off_t offset;		/* file offset of the request */
+	size_t len;		/* length of the request */
+	size_t done;		/* bytes transferred so far */
+	int res;		/* result of the last submission (-errno on failure) */
+	enum slot_state state;
+};
+
+struct nb_buffer_uring
+{
+	struct nb_buffer buf;
+	int fd;
+	int ring_fd;
+	bool seekable;		/* are requests issued at explicit offsets? */
+	bool fixed;		/* are slots registered with the ring? */
+	bool reading;		/* is the buffer used for reading? */
+	bool read_eof;		/* has any read hit EOF? */
+	nb_err_t write_err;	/* failure of any write, reported by later flushes */
+	bool broken;		/* has waiting for completions failed? */
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	nb_byte_t *mem;		/* memory of all slots */
+	struct uring_slot slots[URING_NUM_SLOTS];
+	size_t cur;		/* slot holding the window */
+	bool cur_valid;		/* does cur hold a window handed out by fill? */
+	size_t queue;		/* slot to be queued for reading next */
+	size_t in_flight;	/* number of busy slots */
+	off_t offset;		/* file offset of the next request */
+	size_t tell;		/* file offset after the windows handed out */
+};
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+static void unmap_ring(struct nb_buffer_uring *ub)
+{
+	if (ub->sqes)
+		munmap(ub->sqes, ub->sqes_size);
+	if (ub->cq_ring && ub->cq_ring != ub->sq_ring)
+		munmap(ub->cq_ring, ub->cq_ring_size);
+	if (ub->sq_ring)
+		munmap(ub->sq_ring, ub->sq_ring_size);
+}
+
+
+static bool setup_ring(struct nb_buffer_uring *ub)
+{
+	struct io_uring_params p = { 0 };
+	nb_byte_t *sq;
+	nb_byte_t *cq;
+
+	if ((ub->ring_fd = sys_io_uring_setup(URING_NUM_SLOTS, &p)) == -1)
+		return false;
+
+	ub->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ub->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ub->sq_ring_size = ub->cq_ring_size = MAX(ub->sq_ring_size, ub->cq_ring_size);
+
+	ub->sq_ring = mmap(NULL, ub->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ub->ring_fd, IORING_OFF_SQ_RING);
+	if (ub->sq_ring == MAP_FAILED) {
+		ub->sq_ring = NULL;
+		return false;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ub->cq_ring = ub->sq_ring;
+	}
+	else {
+		ub->cq_ring = mmap(NULL, ub->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ub->ring_fd, IORING_OFF_CQ_RING);
+		if (ub->cq_ring == MAP_FAILED) {
+			ub->cq_ring = NULL;
+			return false;
+		}
+	}
+
+	ub->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ub->sqes = mmap(NULL, ub->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ub->ring_fd, IORING_OFF_SQES);
+	if (ub->sqes == MAP_FAILED) {
+		ub->sqes = NULL;
+		return false;
+	}
+
+	sq = ub->sq_ring;
+	ub->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ub->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ub->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	cq = ub->cq_ring;
+	ub->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ub->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ub->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ub->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return true;
+}
+
+
+/*
+ * Create a file buffer which reads ahead and writes behind asynchronously
+ * using io_uring. Reading or writing starts at fd's current offset; the buffer
+ * can only be used in one direction. As writes complete behind, a failed one
+ * is reported by the flushes that follow it (see nb_buffer_get_error).
+ *
+ * If io_uring is not available, a regular file buffer is returned instead.
+ */
+struct nb_buffer *nb_buffer_new_file_uring(int fd)
+{
+	struct nb_buffer_uring *ub;
+	struct iovec iov;
+	off_t offset;
+	size_t i;
+
+	ub = nb_malloc(sizeof(*ub));
+	memset(ub, 0, sizeof(*ub));
+	if (!setup_ring(ub)) {
+		unmap_ring(ub);
+		if (ub->ring_fd != -1)
+			close(ub->ring_fd);
+		xfree(ub);
+		return nb_buffer_new_file(fd);
+	}
+
+	ub->mem = nb_malloc(URING_NUM_SLOTS * URING_SLOT_SIZE);
+	for (i = 0; i < URING_NUM_SLOTS; i++) {
+		ub->slots[i].data = ub->mem + i * URING_SLOT_SIZE;
+		ub->slots[i].state = SLOT_FREE;
+	}
+
+	/* registration may fail due to RLIMIT_MEMLOCK; readv/writev will do */
+	iov.iov_base = ub->mem;
+	iov.iov_len = URING_NUM_SLOTS * URING_SLOT_SIZE;
+	ub->fixed = (sys_io_uring_register(ub->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	ub->fd = fd;
+	ub->seekable = (offset != -1);
+	ub->offset = MAX(offset, 0);
+	ub->tell = ub->offset;
+
+	nb_buffer_init_window(&ub->buf, ub->slots[0].data, URING_SLOT_SIZE);
+	ub->buf.ops = &uring_ops;
+	ub->buf.offset = ub->offset;
+
+	return &ub->buf;
+}
+
+
+/*
+ * Submit the rest of the request of the slot (the whole of it unless some
+ * has been transferred already). If that fails, the slot is done with the
+ * error.
+ */
+static void submit_rest(struct nb_buffer_uring *ub, size_t i, bool writing)
+{
+	struct uring_slot *slot = &ub->slots[i];
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	unsigned idx;
+	int ret;
+
+	tail = *ub->sq_tail;
+	idx = tail & *ub->sq_mask;
+	sqe = &ub->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (ub->fixed) {
+		sqe->opcode = writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long)(slot->data + slot->done);
+		sqe->len = slot->len - slot->done;
+		sqe->buf_index = 0;
+	}
+	else {
+		slot->iov.iov_base = slot->data + slot->done;
+		slot->iov.iov_len = slot->len - slot->done;
+		sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (unsigned long)&slot->iov;
+		sqe->len = 1;
+	}
+
+	sqe->fd = ub->fd;
+	sqe->off = ub->seekable ? (__u64)(slot->offset + slot->done) : (__u64)-1;
+	sqe->user_data = i;
+
+	ub->sq_array[idx] = idx;
+	__atomic_store_n(ub->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(ub->ring_fd, 1, 0, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	/* the kernel has not taken the entry, take it back */
+	if (ret != 1) {
+		__atomic_store_n(ub->sq_tail, tail, __ATOMIC_RELEASE);
+		slot->res = (ret == -1) ? -errno : -EAGAIN;
+		slot->state = SLOT_DONE;
+		return;
+	}
+
+	slot->state = SLOT_BUSY;
+	ub->in_flight++;
+}
+
+
+/*
+ * Queue a request for the slot and submit it right away.
+ */
+static void submit_slot(struct nb_buffer_uring *ub, size_t i, bool writing, size_t len)
+{
+	struct uring_slot *slot = &ub->slots[i];
+
+	assert(slot->state == SLOT_FREE);
+
+	slot->len = len;
+	slot->done = 0;
+	slot->offset = ub->offset;
+	if (ub->seekable)
+		ub->offset += len;
+
+	submit_rest(ub, i, writing);
+}
+
+
+static void reap(struct nb_buffer_uring *ub)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_slot *slot;
+	unsigned head;
+
+	head = *ub->cq_head;
+	while (head != __atomic_load_n(ub->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ub->cqes[head & *ub->cq_mask];
+		slot = &ub->slots[cqe->user_data];
+		slot->res = cqe->res;
+		slot->state = SLOT_DONE;
+		ub->in_flight--;
+		head++;
+	}
+
+	__atomic_store_n(ub->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Wait for the request of the slot to complete, and return the number of
+ * bytes transferred, like read() and write() do. Requests which completed
+ * partially are resubmitted for the rest: writes always, reads unless they
+ * hit EOF or read from a pipe (where a short read is fine).
+ *
+ * If waiting for completions fails, the slot is left busy and the buffer
+ * broken: no more requests are submitted.
+ */
+static ssize_t wait_slot(struct nb_buffer_uring *ub, size_t i, bool writing)
+{
+	struct uring_slot *slot = &ub->slots[i];
+	int ret;
+
+	assert(slot->state != SLOT_FREE);
+
+	for (;;) {
+		for (reap(ub); slot->state == SLOT_BUSY; reap(ub)) {
+			ret = sys_io_uring_enter(ub->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+			if (ret == -1 && errno != EINTR) {
+				ub->broken = true;
+				return -1;
+			}
+		}
+
+		/* interrupted, or short of resources to submit (files do not block) */
+		if (slot->res == -EINTR || (slot->res == -EAGAIN && ub->seekable)) {
+			submit_rest(ub, i, writing);
+			continue;
+		}
+
+		slot->state = SLOT_FREE;
+
+		if (slot->res < 0) {
+			errno = -slot->res;
+			return -1;
+		}
+
+		slot->done += slot->res;
+		if (slot->done == slot->len || (!writing && (slot->res == 0 || !ub->seekable)))
+			return slot->done;
+
+		/* nothing written is an error, as it is with regular file buffers */
+		if (writing && slot->res == 0) {
+			errno = EIO;
+			return -1;
+		}
+
+		submit_rest(ub, i, writing);
+	}
+}
+
+
+static void wait_all(struct nb_buffer_uring *ub, bool writing)
+{
+	size_t i;
+
+	for (i = 0; i < URING_NUM_SLOTS; i++)
+		if (ub->slots[i].state != SLOT_FREE && wait_slot(ub, i, writing) == -1 && writing)
+			ub->write_err = NB_ERR_WRITE;
+}
+
+
+static void uring_delete(struct nb_buffer *buf)
+{
+	struct nb_buffer_uring *ub = (struct nb_buffer_uring *)buf;
+
+	wait_all(ub, !ub->reading);
+
+	/* leave the file offset where a regular file buffer would */
+	if (ub->seekable)
+		lseek(ub->fd, ub->tell, SEEK_SET);
+
+	unmap_ring(ub);
+	close(ub->ring_fd);
+
+	/* requests which could not be waited for may still use the slots */
+	if (ub->in_flight == 0)
+		xfree(ub->mem);
+	xfree(ub);
+}
+
+
+/*
+ * Keep the slots following the window busy reading.
+ */
+static void read_ahead(struct nb_buffer_uring *ub)
+{
+	size_t max_in_flight = ub->seekable ? URING_NUM_SLOTS - 1 : 1;
+
+	while (!ub->read_eof && ub->in_flight < max_in_flight
+		&& ub->slots[ub->queue].state == SLOT_FREE
+		&& !(ub->cur_valid && ub->queue == ub->cur)) {
+		submit_slot(ub, ub->queue, false, URING_SLOT_SIZE);
+		ub->queue = (ub->queue + 1) % URING_NUM_SLOTS;
+	}
+}
+
+
+static void uring_fill(struct nb_buffer *buf)
+{
+	struct nb_buffer_uring *ub = (struct nb_buffer_uring *)buf;
+	size_t next;
+	ssize_t ret;
+	size_t len;
+
+	next = ub->cur_valid ? (ub->cur + 1) % URING_NUM_SLOTS : ub->cur;
+	ub->reading = true;
+	ub->cur_valid = false;
+
+	if (ub->broken) {
+		buf->err = NB_ERR_READ;
+		buf->len = 0;
+		buf->eof = true;
+		return;
+	}
+
+	if (ub->slots[next].state == SLOT_FREE) {
+		if (ub->read_eof) {
+			buf->len = 0;
+			buf->eof = true;
+			return;
+		}
+
+		assert(ub->queue == next);
+		read_ahead(ub);
+	}
+
+	ret = wait_slot(ub, next, false);
+	if (ret == -1 && !ub->broken && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		/* a non-blocking pipe or socket, issue the read again next time */
+		buf->err = NB_ERR_AGAIN;
+		buf->len = 0;
+		buf->eof = false;
+		ub->cur = ub->queue = next;
+		return;
+	}
+	if (ret == -1)
+		buf->err = NB_ERR_READ;
+
+	len = MAX(ret, 0);
+	if (len == 0 || (ub->seekable && len < URING_SLOT_SIZE))
+		ub->read_eof = true;
+
+	ub->cur = next;
+	ub->cur_valid = true;
+	ub->tell += len;
+
+	buf->buf = ub->slots[next].data;
+	buf->len = len;
+	buf->eof = (len == 0);	/* after a read error too */
+
+	read_ahead(ub);
+}
+
+
+static void uring_flush(struct nb_buffer *buf)
+{
+	NB_DEBUG_TRACE;
+	struct nb_buffer_uring *ub = (struct nb_buffer_uring *)buf;
+	size_t next;
+
+	assert(!ub->reading);
+
+	/* writes to a pipe or a socket have to be issued in order */
+	if (!ub->seekable)
+		wait_all(ub, true);
+
+	/* the slots may still be in flight, the data are dropped */
+	if (ub->broken) {
+		buf->err = NB_ERR_WRITE;
+		return;
+	}
+
+	submit_slot(ub, ub->cur, true, buf->len);
+	ub->tell += buf->len;
+
+	next = (ub->cur + 1) % URING_NUM_SLOTS;
+	if (ub->slots[next].state != SLOT_FREE && wait_slot(ub, next, true) == -1)
+		ub->write_err = NB_ERR_WRITE;
+
+	ub->cur = next;
+	buf->buf = ub->slots[next].data;
+
+	/* the data of earlier flushes are written behind, report their failure */
+	if (ub->write_err != NB_ERR_OK)
+		buf->err = ub->write_err;
+}
+
+#else
+
+struct nb_buffer *nb_buffer_new_file_uring(int fd)
+{
+	return nb_buffer_new_file(fd);
+}
+
+#endif
@@ -9,52 +9,292 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #define NB_DEBUG_THIS	0
 
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+#define GROW_STREAK	4	/* number of full fills/flushes before the window grows */
+
 static ssize_t write_internal(struct nb_buffer *buf, nb_byte_t *bytes, size_t nbytes);
 extern ssize_t nb_buffer_read(struct nb_buffer *buf, nb_byte_t *bytes, size_t nbytes);
 extern ssize_t nb_buffer_write(struct nb_buffer *buf, nb_byte_t *bytes, size_t nbytes);
+extern nb_byte_t *nb_buffer_reserve(struct nb_buffer *buf, size_t count);
+extern void nb_buffer_commit(struct nb_buffer *buf, size_t count);
+extern nb_byte_t *nb_buffer_peek_span(struct nb_buffer *buf, size_t min, size_t *avail);
+extern void nb_buffer_consume(struct nb_buffer *buf, size_t count);
+extern size_t nb_buffer_tell(struct nb_buffer *buf);
 extern int nb_buffer_getc(struct nb_buffer *buf);
 extern void nb_buffer_ungetc(struct nb_buffer *buf, int c);
 extern int nb_buffer_peek(struct nb_buffer *buf);
 
 
-void nb_buffer_init(struct nb_buffer *buf)
+static void alloc_window(struct nb_buffer *buf, size_t size)
 {
-	size_t size = 4 * 4096;
+	size_t align = buf->align;
 
-	buf->buf = nb_malloc(size);
+	if (buf->huge_pages && size >= HUGE_PAGE_SIZE) {
+		align = MAX(align, HUGE_PAGE_SIZE);
+		size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	}
+
+	if (align)
+		buf->buf = nb_malloc_aligned(align, size);
+	else
+		buf->buf = nb_malloc(size);
 	TEMP_ASSERT(buf->buf);
 
+#ifdef MADV_HUGEPAGE
+	if (align >= HUGE_PAGE_SIZE)
+		(void) madvise(buf->buf, size, MADV_HUGEPAGE);
+#endif
+
+	buf->bufsize = size;
+}
+
+
+/*
+ * Double the size of the window if it keeps being filled up. The data kept
+ * in the window by a flush (see struct nb_buffer's kept) are moved over.
+ */
+static void grow_window(struct nb_buffer *buf)
+{
+	nb_byte_t *old = buf->buf;
+
+	if (!buf->own_buf || buf->bufsize >= buf->max_bufsize)
+		return;
+
+	alloc_window(buf, MIN(2 * buf->bufsize, buf->max_bufsize));
+	memcpy(buf->buf, old, buf->len);
+	xfree(old);
+	buf->full_streak = 0;
+}
+
+
+/*
+ * Replace the (empty) window by one of at least size bytes, for backends
+ * which have to fit units bigger than the window.
+ */
+void nb_buffer_resize_window(struct nb_buffer *buf, size_t size)
+{
+	assert(buf->own_buf);
+
+	if (size <= buf->bufsize)
+		return;
+
+	xfree(buf->buf);
+	alloc_window(buf, size);
+}
+
+
+static void count_full(struct nb_buffer *buf, bool full)
+{
+	if (!full)
+		buf->full_streak = 0;
+	else if (buf->full_streak < GROW_STREAK)
+		buf->full_streak++;
+}
+
+
+void nb_buffer_init(struct nb_buffer *buf)
+{
+	nb_buffer_init_opts(buf, NULL);
+}
+
+
+void nb_buffer_init_opts(struct nb_buffer *buf, const struct nb_buffer_opts *opts)
+{
+	struct nb_buffer_opts defaults = { 0 };
+
+	if (!opts)
+		opts = &defaults;
+
+	buf->align = opts->align;
+	buf->huge_pages = opts->huge_pages;
+	alloc_window(buf, opts->size ? opts->size : NB_BUFFER_SIZE);
+
+	buf->max_bufsize = buf->bufsize;
+	if (opts->adaptive)
+		buf->max_bufsize = MAX(buf->bufsize, opts->max_size ? opts->max_size : NB_BUFFER_MAX_SIZE);
+
+	buf->mode = BUF_MODE_IDLE;
+	buf->pos = 0;
+	buf->len = 0;
+	buf->offset = 0;
+	buf->eof = false;
+	buf->ungetc = -1;
+	buf->written_total = 0;
+	buf->own_buf = true;
+	buf->persistent = false;
+	buf->full_streak = 0;
+	buf->fills = 0;
+	buf->flushes = 0;
+	buf->flush_cause = BUF_FLUSH_EXPLICIT;
+	buf->kept = 0;
+	buf->err = NB_ERR_OK;
+}
+
+
+/*
+ * Initialize a buffer whose window is provided (and owned) by the backend.
+ */
+void nb_buffer_init_window(struct nb_buffer *buf, nb_byte_t *window, size_t size)
+{
+	buf->buf = window;
 	buf->mode = BUF_MODE_IDLE;
 	buf->bufsize = size;
 	buf->pos = 0;
 	buf->len = 0;
+	buf->offset = 0;
 	buf->eof = false;
 	buf->ungetc = -1;
 	buf->written_total = 0;
+	buf->own_buf = false;
+	buf->persistent = false;
+	buf->max_bufsize = size;
+	buf->align = 0;
+	buf->huge_pages = false;
+	buf->full_streak = 0;
+	buf->fills = 0;
+	buf->flushes = 0;
+	buf->flush_cause = BUF_FLUSH_EXPLICIT;
+	buf->kept = 0;
+	buf->err = NB_ERR_OK;
 }
 
 
-void nb_buffer_flush(struct nb_buffer *buf)
+/*
+ * Discard the contents of the buffer and return it to the state it was
+ * created in, keeping its memory (including a grown window). Only buffers
+ * with the reset op support this.
+ */
+void nb_buffer_reset(struct nb_buffer *buf)
 {
+	assert(buf->ops->reset != NULL);
+
+	buf->mode = BUF_MODE_IDLE;
+	buf->pos = 0;
+	buf->len = 0;
+	buf->offset = 0;
+	buf->eof = false;
+	buf->ungetc = -1;
+	buf->last_read_len = 0;
+	buf->written_total = 0;
+	buf->full_streak = 0;
+	buf->fills = 0;
+	buf->flushes = 0;
+	buf->err = NB_ERR_OK;
+
+	buf->ops->reset(buf);
+}
+
+
+/*
+ * A window flushed to make room counts as full even if it's a few bytes
+ * short of full, see nb_buffer_reserve. Unless the flush is final, the
+ * backend may keep the end of the data at the start of the window, they
+ * are written with the next window then (see file_flush).
+ */
+static void flush_window(struct nb_buffer *buf, enum buf_flush cause)
+{
+	buf->kept = 0;
+
 	if (buf->mode == BUF_MODE_WRITING) {
 		NB_DEBUG_TRACE;
+		assert(buf->ops->flush != NULL); /* buffer is read-only */
+		buf->err = NB_ERR_OK;
+		buf->flush_cause = cause;
 		buf->ops->flush(buf);
+		buf->flushes++;
+		count_full(buf, cause == BUF_FLUSH_FULL || buf->len == buf->bufsize);
 	}
 
-	buf->pos = 0;
-	buf->len = 0;
-	buf->mode = BUF_MODE_IDLE;
+	assert(buf->kept <= buf->len);
+	assert(cause != BUF_FLUSH_FINAL || buf->kept == 0);
+
+	buf->offset += buf->len - buf->kept;
+	buf->pos = buf->kept;
+	buf->len = buf->kept;
+	buf->mode = buf->kept ? BUF_MODE_WRITING : BUF_MODE_IDLE;
+
+	if (buf->full_streak == GROW_STREAK)
+		grow_window(buf);
+}
+
+
+void nb_buffer_flush(struct nb_buffer *buf)
+{
+	flush_window(buf, BUF_FLUSH_EXPLICIT);
+}
+
+
+/*
+ * Flush everything, no more data will be written (the buffer is going to
+ * be reset, for example).
+ */
+void nb_buffer_flush_final(struct nb_buffer *buf)
+{
+	flush_window(buf, BUF_FLUSH_FINAL);
+}
+
+
+/*
+ * Flush the buffer and start reading what has been written into it from the
+ * beginning. Only some buffers (such as memory buffers) support this.
+ */
+void nb_buffer_rewind(struct nb_buffer *buf)
+{
+	assert(buf->ops->rewind != NULL);
+
+	nb_buffer_flush(buf);
+	buf->ops->rewind(buf);
+	buf->offset = 0;
+}
+
+
+/*
+ * Continue reading or writing at the stream offset (see nb_buffer_tell).
+ * Pending data are flushed first. Seeking within the data read into the
+ * window is cheap and works with all buffers, other seeks only with the
+ * buffers which support them (file, mmap and memory buffers); NB_ERR_UNSUP
+ * is returned otherwise.
+ */
+nb_err_t nb_buffer_seek(struct nb_buffer *buf, size_t offset)
+{
+	nb_err_t err;
+
+	if (buf->mode == BUF_MODE_READING
+		&& offset >= buf->offset && offset - buf->offset <= buf->len) {
+		buf->pos = offset - buf->offset;
+		return NB_ERR_OK;
+	}
+
+	if (!buf->ops->seek)
+		return NB_ERR_UNSUP;
+
+	flush_window(buf, BUF_FLUSH_FINAL);
+	if ((err = buf->ops->seek(buf, offset)) != NB_ERR_OK)
+		return err;
+
+	buf->offset = offset;
+	buf->eof = false;
+	return NB_ERR_OK;
 }
 
 
 bool nb_buffer_fill(struct nb_buffer *buf)
 {
+	if (buf->full_streak == GROW_STREAK)
+		grow_window(buf);
+
+	buf->err = NB_ERR_OK;
+	buf->offset += buf->len;
 	buf->ops->fill(buf);
 	buf->pos = 0;
+	buf->fills++;
+	count_full(buf, buf->len == buf->bufsize);
+
 	return buf->len > 0;
 }
 
@@ -98,6 +338,19 @@ static ssize_t read_internal(struct nb_buffer *buf, nb_byte_t *bytes, size_t nby
 }
 
 
+/*
+ * Only an empty window is refilled, the unread bytes would be lost otherwise.
+ */
+nb_byte_t *nb_buffer_peek_span_slow(struct nb_buffer *buf, size_t *avail)
+{
+	if (buf->pos == buf->len)
+		nb_buffer_fill(buf);
+
+	*avail = buf->len - buf->pos;
+	return buf->buf + buf->pos;
+}
+
+
 static inline nb_byte_t hexval(char c)
 {
 	assert(isxdigit(c));
@@ -148,9 +401,11 @@ static ssize_t write_internal(struct nb_buffer *buf, nb_byte_t *bytes, size_t nb
 		assert(avail >= 0);
 
 		if (__builtin_expect(!avail, 0)) {
-			nb_buffer_flush(buf);
+			flush_window(buf, BUF_FLUSH_FULL);
 			buf->mode = BUF_MODE_WRITING;
-			avail = buf->bufsize;
+			if (buf->err == NB_ERR_OVERFLOW)
+				break;	/* no room can be made, see nb_buffer_new_fixed */
+			avail = buf->bufsize - buf->len;
 		}
 
 		ncpy = MIN(avail, nbytes);
@@ -163,12 +418,44 @@ static ssize_t write_internal(struct nb_buffer *buf, nb_byte_t *bytes, size_t nb
 		nbytes -= ncpy;
 	}
 
-	assert(nbytes == 0);
+	assert(nbytes == 0 || buf->err == NB_ERR_OVERFLOW);
 
 	return written;
 }
 
 
+nb_byte_t *nb_buffer_reserve_slow(struct nb_buffer *buf, size_t count)
+{
+	assert(buf->mode != BUF_MODE_READING);
+
+	if (count > buf->bufsize)
+		return NULL;
+
+	/* a flush need not make room, see mem_flush and file_flush */
+	flush_window(buf, BUF_FLUSH_FULL);
+	if (count > buf->bufsize - buf->len)
+		return NULL;
+
+	return buf->buf + buf->pos;
+}
+
+
+ssize_t nb_buffer_write_ref(struct nb_buffer *buf, nb_byte_t *bytes, size_t nbytes)
+{
+	if (!buf->ops->write_ref || nbytes < NB_BUFFER_REF_MIN)
+		return nb_buffer_write(buf, bytes, nbytes);
+
+	assert(buf->mode != BUF_MODE_READING);
+	buf->mode = BUF_MODE_WRITING;
+	buf->ops->write_ref(buf, bytes, nbytes);
+	buf->mode = BUF_MODE_WRITING;	/* write_ref may have flushed the buffer */
+	buf->written_total += nbytes;
+	buf->offset += nbytes;
+
+	return nbytes;
+}
+
+
 bool nb_buffer_is_eof(struct nb_buffer *buf)
 {
 	assert(buf->mode != BUF_MODE_WRITING);
@@ -185,9 +472,23 @@ bool nb_buffer_is_eof(struct nb_buffer *buf)
 }
 
 
-size_t nb_buffer_tell(struct nb_buffer *buf)
+nb_byte_t *nb_buffer_read_ref(struct nb_buffer *buf, size_t nbytes)
 {
-	return buf->ops->tell(buf);
+	nb_byte_t *bytes;
+
+	assert(buf->mode != BUF_MODE_WRITING);
+
+	if (buf->pos == buf->len)
+		nb_buffer_fill(buf);
+
+	if (!buf->persistent || buf->len - buf->pos < nbytes)
+		return NULL;
+
+	buf->mode = BUF_MODE_READING;
+	bytes = buf->buf + buf->pos;
+	buf->pos += nbytes;
+	buf->last_read_len = nbytes;
+	return bytes;
 }
 
 
@@ -200,10 +501,13 @@ size_t nb_buffer_read_len(struct nb_buffer *buf, nb_byte_t *bytes, size_t nbytes
 
 void nb_buffer_delete(struct nb_buffer *buf)
 {
-	if (buf->mode == BUF_MODE_WRITING)
+	if (buf->mode == BUF_MODE_WRITING) {
+		buf->flush_cause = BUF_FLUSH_FINAL;
 		buf->ops->flush(buf);
+	}
 
-	xfree(buf->buf);
+	if (buf->own_buf)
+		xfree(buf->buf);
 	buf->ops->free(buf);
 }
 
@@ -212,3 +516,31 @@ size_t nb_buffer_get_written_total(struct nb_buffer *buf)
 {
 	return buf->written_total;
 }
+
+
+/*
+ * Return the error of the last fill or flush, such as NB_ERR_AGAIN when
+ * a non-blocking buffer (see nb_buffer_new_socket) would block.
+ */
+nb_err_t nb_buffer_get_error(struct nb_buffer *buf)
+{
+	return buf->err;
+}
+
+
+size_t nb_buffer_get_fills(struct nb_buffer *buf)
+{
+	return buf->fills;
+}
+
+
+size_t nb_buffer_get_flushes(struct nb_buffer *buf)
+{
+	return buf->flushes;
+}
+
+
+size_t nb_buffer_get_size(struct nb_buffer *buf)
+{
+	return buf->bufsize;
+}
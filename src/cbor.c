@@ -64,6 +64,26 @@ void cbor_stream_init(struct cbor_stream *cs, struct nb_buffer *buf)
 }
 
 
+/*
+ * Start over with a new buffer as if the stream was just initialized, but
+ * reuse the memory. The error handler and diagnostics stay set.
+ */
+void cbor_stream_reset(struct cbor_stream *cs, struct nb_buffer *buf)
+{
+	cs->buf = buf;
+	mempool_reset(cs->mempool);
+
+	cs->err = NB_ERR_OK;
+	cs->peeking = false;
+
+	strbuf_reset(&cs->err_buf);
+
+	stack_reset(&cs->blocks);
+	push_block(cs, -1, true, 0);
+	top_block(cs)->group = NULL;
+}
+
+
 void cbor_stream_free(struct cbor_stream *cs)
 {
 	strbuf_free(&cs->err_buf);
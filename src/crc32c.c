@@ -0,0 +1,215 @@
+/*
+ * crc32c:
+ * CRC-32C (Castagnoli) Checksums
+ *
+ * The implementation is picked when it's first used, see crc32c_init. The
+ * hardware ones process 8 bytes per instruction, the software one (for
+ * other CPUs, or if NB_CRC32C_SW is set in the environment) uses 8 tables
+ * to process 8 bytes per step ("slicing-by-8").
+ */
+
+#include "crc32c.h"
+
+#include <endian.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define CRC32C_HW_TARGET	__attribute__((target("sse4.2")))
+#define crc32c_hw_u8(crc, v)	_mm_crc32_u8(crc, v)
+#define crc32c_hw_u64(crc, v)	((uint32_t)_mm_crc32_u64(crc, v))
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define CRC32C_HW_TARGET	__attribute__((target("+crc")))
+#define crc32c_hw_u8(crc, v)	__crc32cb(crc, v)
+#define crc32c_hw_u64(crc, v)	__crc32cd(crc, v)
+#endif
+
+#define CRC32C_POLY	0x82f63b78	/* reversed */
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len);
+
+static uint32_t sw_table[8][256];
+static crc32c_fn crc32c_update;
+static crc32c_fn crc32c_update_copy;
+static bool hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+
+static inline uint64_t load64le(const uint8_t *p)
+{
+	uint64_t val;
+	memcpy(&val, p, sizeof(val));
+	return le64toh(val);
+}
+
+
+/*
+ * Copying is a compile-time constant, so the loops specialize.
+ */
+static inline __attribute__((always_inline))
+uint32_t sw_crc(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len, bool copy)
+{
+	uint64_t word;
+
+	for (; len >= 8; len -= 8, src += 8) {
+		word = load64le(src) ^ crc;
+		if (copy) {
+			memcpy(dst, src, 8);
+			dst += 8;
+		}
+
+		crc = sw_table[7][word & 0xff]
+			^ sw_table[6][(word >> 8) & 0xff]
+			^ sw_table[5][(word >> 16) & 0xff]
+			^ sw_table[4][(word >> 24) & 0xff]
+			^ sw_table[3][(word >> 32) & 0xff]
+			^ sw_table[2][(word >> 40) & 0xff]
+			^ sw_table[1][(word >> 48) & 0xff]
+			^ sw_table[0][word >> 56];
+	}
+
+	for (; len > 0; len--, src++) {
+		crc = sw_table[0][(crc ^ *src) & 0xff] ^ (crc >> 8);
+		if (copy)
+			*dst++ = *src;
+	}
+
+	return crc;
+}
+
+
+static uint32_t sw_update(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+	return sw_crc(crc, dst, src, len, false);
+}
+
+
+static uint32_t sw_update_copy(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+	return sw_crc(crc, dst, src, len, true);
+}
+
+
+static void sw_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		sw_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			sw_table[j][i] = (sw_table[j - 1][i] >> 8) ^ sw_table[0][sw_table[j - 1][i] & 0xff];
+}
+
+
+#ifdef CRC32C_HW_TARGET
+
+static inline __attribute__((always_inline)) CRC32C_HW_TARGET
+uint32_t hw_crc(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len, bool copy)
+{
+	uint64_t word;
+
+	for (; len >= 8; len -= 8, src += 8) {
+		memcpy(&word, src, 8);
+		crc = crc32c_hw_u64(crc, le64toh(word));
+		if (copy) {
+			memcpy(dst, &word, 8);
+			dst += 8;
+		}
+	}
+
+	for (; len > 0; len--, src++) {
+		crc = crc32c_hw_u8(crc, *src);
+		if (copy)
+			*dst++ = *src;
+	}
+
+	return crc;
+}
+
+
+static CRC32C_HW_TARGET uint32_t hw_update(uint32_t crc, uint8_t *dst, const uint8_t *src,
+	size_t len)
+{
+	return hw_crc(crc, dst, src, len, false);
+}
+
+
+static CRC32C_HW_TARGET uint32_t hw_update_copy(uint32_t crc, uint8_t *dst,
+	const uint8_t *src, size_t len)
+{
+	return hw_crc(crc, dst, src, len, true);
+}
+
+
+static bool hw_supported(void)
+{
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+
+	return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#else
+	return getauxval(AT_HWCAP) & HWCAP_CRC32;
+#endif
+}
+
+#else
+
+static bool hw_supported(void)
+{
+	return false;
+}
+
+#endif
+
+
+static void crc32c_init(void)
+{
+	crc32c_update = sw_update;
+	crc32c_update_copy = sw_update_copy;
+	sw_init();
+
+#ifdef CRC32C_HW_TARGET
+	if (hw_supported() && !getenv("NB_CRC32C_SW")) {
+		crc32c_update = hw_update;
+		crc32c_update_copy = hw_update_copy;
+		hw = true;
+	}
+#endif
+}
+
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_update(~crc, NULL, data, len);
+}
+
+
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_update_copy(~crc, dst, src, len);
+}
+
+
+/*
+ * Tell whether the CRC instructions are used.
+ */
+bool crc32c_is_hw(void)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return hw;
+}
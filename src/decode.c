@@ -20,6 +20,7 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <string.h>
 
 #define CBOR_ARRAY_INIT_SIZE	8
 #define CBOR_BSTACK_INIT_SIZE	4
@@ -28,27 +29,96 @@
 #define	MAJOR_MASK	0xE0
 #define	LBITS_MASK	0x1F
 
+/* initial bytes of a block of array elements (see unpack_block) */
+typedef nb_byte_t hdr_block_t __attribute__((vector_size(CBOR_ARRAY_BLOCK)));
+
 extern void cbor_decode_uint64(struct cbor_stream *cs, uint64_t *val);
 extern bool cbor_is_break(struct cbor_stream *cs);
 extern void cbor_peek(struct cbor_stream *cs, struct cbor_item *item);
 extern void diag_finish_item_do(struct cbor_stream *cs);
 
 
-static inline uint8_t lbits_to_nbytes(enum lbits lbits)
+/*
+ * What the initial byte of an item says about it.
+ */
+struct hdr_info
 {
-	assert(lbits >= LBITS_1B && lbits <= LBITS_8B);
+	nb_byte_t type;		/* enum cbor_type */
+	nb_byte_t nbytes;	/* length of the argument following the initial byte */
+	nb_byte_t flags;	/* HDR_VALID, HDR_INDEF */
+};
+
+#define HDR_VALID	(1 << 0)	/* well-formed (even if unsupported) */
+#define HDR_INDEF	(1 << 1)	/* indefinite length */
+
+/* initial bytes hdr...hdr + 23, which carry the argument themselves */
+#define HDR_DIRECT(hdr, type)	[(hdr)] = { (type), 0, HDR_VALID }
+#define HDR_DIRECT4(hdr, type) \
+	HDR_DIRECT((hdr), type), HDR_DIRECT((hdr) + 1, type), \
+	HDR_DIRECT((hdr) + 2, type), HDR_DIRECT((hdr) + 3, type)
+#define HDR_DIRECT24(hdr, type) \
+	HDR_DIRECT4((hdr), type), HDR_DIRECT4((hdr) + 4, type), HDR_DIRECT4((hdr) + 8, type), \
+	HDR_DIRECT4((hdr) + 12, type), HDR_DIRECT4((hdr) + 16, type), HDR_DIRECT4((hdr) + 20, type)
+
+#define HDR_DEFINITE(major, type) \
+	HDR_DIRECT24((major) << 5, (type)), \
+	[((major) << 5) + LBITS_1B] = { (type), 1, HDR_VALID }, \
+	[((major) << 5) + LBITS_2B] = { (type), 2, HDR_VALID }, \
+	[((major) << 5) + LBITS_4B] = { (type), 4, HDR_VALID }, \
+	[((major) << 5) + LBITS_8B] = { (type), 8, HDR_VALID }
+
+#define HDR_INDEFINITE(major, type) \
+	[((major) << 5) + LBITS_INDEFINITE] = { (type), 0, HDR_VALID | HDR_INDEF }
 
-	switch (lbits) {
-	case LBITS_1B:
-		return 1;
-	case LBITS_2B:
-		return 2;
-	case LBITS_4B:
-		return 4;
-	case LBITS_8B:
-		return 8;
+/*
+ * Initial bytes with reserved Additional Information (28...30) are invalid,
+ * i.e. all zeroes.
+ */
+static const struct hdr_info hdr_table[256] = {
+	HDR_DEFINITE(CBOR_MAJOR_UINT, CBOR_TYPE_UINT),
+	HDR_INDEFINITE(CBOR_MAJOR_UINT, CBOR_TYPE_UINT),
+	HDR_DEFINITE(CBOR_MAJOR_NEGINT, CBOR_TYPE_INT),
+	HDR_INDEFINITE(CBOR_MAJOR_NEGINT, CBOR_TYPE_INT),
+	HDR_DEFINITE(CBOR_MAJOR_BYTES, CBOR_TYPE_BYTES),
+	HDR_INDEFINITE(CBOR_MAJOR_BYTES, CBOR_TYPE_BYTES),
+	HDR_DEFINITE(CBOR_MAJOR_TEXT, CBOR_TYPE_TEXT),
+	HDR_INDEFINITE(CBOR_MAJOR_TEXT, CBOR_TYPE_TEXT),
+	HDR_DEFINITE(CBOR_MAJOR_ARRAY, CBOR_TYPE_ARRAY),
+	HDR_INDEFINITE(CBOR_MAJOR_ARRAY, CBOR_TYPE_ARRAY),
+	HDR_DEFINITE(CBOR_MAJOR_MAP, CBOR_TYPE_MAP),
+	HDR_INDEFINITE(CBOR_MAJOR_MAP, CBOR_TYPE_MAP),
+	HDR_DEFINITE(CBOR_MAJOR_TAG, CBOR_TYPE_TAG),
+	HDR_INDEFINITE(CBOR_MAJOR_TAG, CBOR_TYPE_TAG),
+
+	HDR_DIRECT24(CBOR_MAJOR_7 << 5, CBOR_TYPE_SVAL),
+	[(CBOR_MAJOR_7 << 5) + CBOR_MINOR_SVAL] = { CBOR_TYPE_SVAL, 1, HDR_VALID },
+	[(CBOR_MAJOR_7 << 5) + CBOR_MINOR_FLOAT16] = { CBOR_TYPE_FLOAT16, 2, HDR_VALID },
+	[(CBOR_MAJOR_7 << 5) + CBOR_MINOR_FLOAT32] = { CBOR_TYPE_FLOAT32, 4, HDR_VALID },
+	[(CBOR_MAJOR_7 << 5) + CBOR_MINOR_FLOAT64] = { CBOR_TYPE_FLOAT64, 8, HDR_VALID },
+	[CBOR_BREAK] = { CBOR_TYPE_BREAK, 0, HDR_VALID },
+};
+
+
+/*
+ * Report why the buffer has run out of data.
+ */
+static void short_read(struct cbor_stream *cs)
+{
+	switch (nb_buffer_get_error(cs->buf)) {
+	case NB_ERR_AGAIN:
+		error(cs, NB_ERR_AGAIN, "Reading would block.");
+		break;
+	case NB_ERR_READ:
+		error(cs, NB_ERR_READ, "Reading has failed.");
+		break;
+	case NB_ERR_PARSE:
+		error(cs, NB_ERR_PARSE, "Filtered data are corrupt.");
+		break;
+	case NB_ERR_CHECKSUM:
+		error(cs, NB_ERR_CHECKSUM, "Checksum mismatch.");
+		break;
 	default:
-		return 0;
+		error(cs, NB_ERR_EOF, "EOF was unexpected.");
 	}
 }
 
@@ -57,31 +127,132 @@ static inline void read_stream(struct cbor_stream *cs, nb_byte_t *bytes, size_t
 {
 	diag_log_offset(cs->diag, nb_buffer_tell(cs->buf));
 	if (nb_buffer_read(cs->buf, bytes, nbytes) != nbytes)
-		error(cs, NB_ERR_EOF, "EOF was unexpected.");
+		short_read(cs);
 	diag_log_raw(cs->diag, bytes, MIN(nbytes, 4));
 }
 
 
-static uint64_t decode_u64(struct cbor_stream *cs, enum lbits lbits)
+/*
+ * Load the big-endian argument of nbytes bytes.
+ */
+static inline uint64_t load_u64(const nb_byte_t *bytes, uint8_t nbytes)
+{
+	uint16_t u16be;
+	uint32_t u32be;
+	uint64_t u64be;
+
+	switch (nbytes) {
+	case 1:
+		return bytes[0];
+	case 2:
+		memcpy(&u16be, bytes, 2);
+		return be16toh(u16be);
+	case 4:
+		memcpy(&u32be, bytes, 4);
+		return be32toh(u32be);
+	default:
+		memcpy(&u64be, bytes, 8);
+		return be64toh(u64be);
+	}
+}
+
+
+/*
+ * Return the argument stored in the initial byte itself.
+ */
+static inline uint64_t direct_arg(nb_byte_t hdr)
 {
-	assert(lbits != LBITS_INDEFINITE);
+	return (hdr & LBITS_MASK) <= 23 ? hdr & LBITS_MASK : 0;
+}
+
 
+static nb_byte_t read_hdr_slow(struct cbor_stream *cs, uint64_t *u64)
+{
+	nb_byte_t hdr;
 	nb_byte_t bytes[8];
 	uint8_t nbytes;
-	uint64_t u64be = 0;
-	nb_byte_t *u64be_ptr = (nb_byte_t *)&u64be;
-	size_t i;
 
-	if (lbits <= 23)
-		return lbits;
+	read_stream(cs, &hdr, 1);
 
-	if (unlikely(lbits > LBITS_8B))
-		error(cs, NB_ERR_PARSE,
-			"Invalid value of Additional Information: 0x%02X.", lbits);
+	if (!(nbytes = hdr_table[hdr].nbytes)) {
+		*u64 = direct_arg(hdr);
+		return hdr;
+	}
+
+	read_stream(cs, bytes, nbytes);
+	*u64 = load_u64(bytes, nbytes);
+	return hdr;
+}
+
+
+/*
+ * Read the initial byte of an item and its argument, which is stored in u64
+ * (the Additional Information itself for values up to 23, 0 if there is no
+ * argument). Unless the item crosses the window boundary, the whole header
+ * is decoded right from the buffer's window.
+ */
+static inline nb_byte_t read_hdr(struct cbor_stream *cs, uint64_t *u64)
+{
+	nb_byte_t *bytes;
+	size_t avail;
+	uint8_t nbytes;
 
-	nbytes = lbits_to_nbytes(lbits);
-	read_stream(cs, &u64be_ptr[8 - nbytes], nbytes);
-	return be64toh(u64be);
+	bytes = nb_buffer_peek_span(cs->buf, CBOR_HDR_MAX_LEN, &avail);
+	if (unlikely(avail < CBOR_HDR_MAX_LEN))
+		return read_hdr_slow(cs, u64);
+
+	diag_log_offset(cs->diag, nb_buffer_tell(cs->buf));
+	diag_log_raw(cs->diag, bytes, 1);
+	nb_buffer_consume(cs->buf, 1);
+
+	if (likely(!(nbytes = hdr_table[bytes[0]].nbytes))) {
+		*u64 = direct_arg(bytes[0]);
+		return bytes[0];
+	}
+
+	*u64 = load_u64(bytes + 1, nbytes);
+
+	diag_log_offset(cs->diag, nb_buffer_tell(cs->buf));
+	diag_log_raw(cs->diag, bytes + 1, MIN(nbytes, 4));
+	nb_buffer_consume(cs->buf, nbytes);
+
+	return bytes[0];
+}
+
+
+/*
+ * Peek at the header of the next item for the fast paths of the typed
+ * readers, which decode it right from the window, without predecode. NULL
+ * is returned if fewer than min bytes are available in the window, or if
+ * diagnostics are on (the generic path logs the item then).
+ */
+static inline const nb_byte_t *peek_hdr(struct cbor_stream *cs, size_t min)
+{
+	nb_byte_t *bytes;
+	size_t avail;
+
+	if (DIAG_ENABLE && cs->diag->enabled)
+		return NULL;
+
+	bytes = nb_buffer_peek_span(cs->buf, min, &avail);
+	return likely(avail >= min) ? bytes : NULL;
+}
+
+
+/*
+ * Consume the definite-length header peeked at by peek_hdr and return its
+ * argument.
+ */
+static inline uint64_t consume_hdr(struct cbor_stream *cs, const nb_byte_t *bytes)
+{
+	uint8_t nbytes = hdr_table[bytes[0]].nbytes;
+	uint64_t u64;
+
+	u64 = nbytes ? load_u64(bytes + 1, nbytes) : bytes[0] & LBITS_MASK;
+	nb_buffer_consume(cs->buf, 1 + nbytes);
+	top_block(cs)->num_items++;
+
+	return u64;
 }
 
 
@@ -114,10 +285,8 @@ static void print_sval_diag(struct cbor_stream *cs, enum cbor_sval sval)
 
 
 static void decode_item_major7(struct cbor_stream *cs, struct cbor_item *item,
-	enum minor minor)
+	enum minor minor, uint64_t u64)
 {
-	uint64_t u64 = 0;
-
 	assert(minor >= 0);
 	assert(minor != CBOR_MINOR_BREAK);
 
@@ -129,9 +298,6 @@ static void decode_item_major7(struct cbor_stream *cs, struct cbor_item *item,
 		return;
 	}
 
-	/* leverage decode_u64 to read the appropriate amount of data */
-	u64 = decode_u64(cs, (enum lbits)minor);
-
 	switch (minor) {
 	case CBOR_MINOR_SVAL:
 		item->type = CBOR_TYPE_SVAL; /* deduplicate */
@@ -154,43 +320,43 @@ static void decode_item_major7(struct cbor_stream *cs, struct cbor_item *item,
 
 void predecode(struct cbor_stream *cs, struct cbor_item *item)
 {
+	const struct hdr_info *info;
 	nb_byte_t hdr;
 	enum major major;
-	nb_byte_t lbits;
-	uint64_t u64 = 0;
+	uint64_t u64;
 
-	read_stream(cs, &hdr, 1);
+	hdr = read_hdr(cs, &u64);
 	if (hdr == CBOR_BREAK) {
 		item->type = CBOR_TYPE_BREAK;
 		return;
 	}
 
+	info = &hdr_table[hdr];
 	major = (hdr & MAJOR_MASK) >> 5;
-	lbits = hdr & LBITS_MASK;
 	item->flags = 0;
 	top_block(cs)->num_items++;
 
 	diag_comma(cs->diag); /* append a comma to previous line if needed */
 
-	if (major == CBOR_MAJOR_UINT && lbits <= 23) {
+	if (hdr <= 23) {
 		item->type = CBOR_TYPE_UINT;
-		u64 = lbits;
 	}
 	else {
+		if (unlikely(!(info->flags & HDR_VALID)))
+			error(cs, NB_ERR_PARSE,
+				"Invalid value of Additional Information: 0x%02X.", hdr & LBITS_MASK);
+
 		if (major == CBOR_MAJOR_7) {
-			decode_item_major7(cs, item, lbits);
+			decode_item_major7(cs, item, hdr & LBITS_MASK, u64);
 			return;
 		}
 
-		item->type = (enum cbor_type)major;
+		item->type = info->type;
 
-		if (lbits == LBITS_INDEFINITE)
+		if (info->flags & HDR_INDEF)
 			item->flags |= CBOR_FLAG_INDEFINITE;
 
-		if (!is_indefinite(item)) {
-			u64 = decode_u64(cs, lbits);
-		}
-		else {
+		if (is_indefinite(item)) {
 			if (!major_allows_indefinite(major))
 				error(cs, NB_ERR_INDEF, "Indefinite-length encoding "
 					"is not allowed for %s items.", cbor_type_to_string(major));
@@ -253,9 +419,33 @@ static inline void predecode_check(struct cbor_stream *cs, struct cbor_item *ite
 }
 
 
+/*
+ * Return the last initial byte of unsigned integers which are never greater
+ * than max (one of UINTn_MAX).
+ */
+static inline nb_byte_t uint_hdr_max(uint64_t max)
+{
+	if (max <= UINT8_MAX)
+		return LBITS_1B;
+	if (max <= UINT16_MAX)
+		return LBITS_2B;
+	if (max <= UINT32_MAX)
+		return LBITS_4B;
+	return LBITS_8B;
+}
+
+
+/*
+ * Unsigned integers whose initial byte guarantees the range are decoded
+ * right away, anything else (including errors) takes the generic path.
+ */
 uint64_t decode_uint(struct cbor_stream *cs, uint64_t max)
 {
 	struct cbor_item item;
+	const nb_byte_t *bytes;
+
+	if (likely((bytes = peek_hdr(cs, CBOR_HDR_MAX_LEN)) != NULL && bytes[0] <= uint_hdr_max(max)))
+		return consume_hdr(cs, bytes);
 
 	predecode(cs, &item);
 	if (unlikely(item.u64 > max))
@@ -265,11 +455,37 @@ uint64_t decode_uint(struct cbor_stream *cs, uint64_t max)
 }
 
 
+/*
+ * Return the last Additional Information of integers which always fit into
+ * the range of min...max (one of INTn_MIN...INTn_MAX): an argument of n bits
+ * fits into an integer of more than n bits.
+ */
+static inline nb_byte_t int_lbits_max(int64_t max)
+{
+	if (max <= INT8_MAX)
+		return 23;
+	if (max <= INT16_MAX)
+		return LBITS_1B;
+	if (max <= INT32_MAX)
+		return LBITS_2B;
+	return LBITS_4B;
+}
+
+
 /* TODO have a look at the range checks and make sure nothing overflows */
 static int64_t decode_int(struct cbor_stream *cs, int64_t min, int64_t max)
 {
 	struct cbor_item item;
+	const nb_byte_t *bytes;
 	int64_t i64;
+	int64_t sign;
+
+	/* masking the major type bit 0x20 out matches both unsigned and negative */
+	if (likely((bytes = peek_hdr(cs, CBOR_HDR_MAX_LEN)) != NULL
+		&& (bytes[0] & ~0x20) <= int_lbits_max(max))) {
+		sign = -(int64_t)(bytes[0] >> 5);	/* 0 or -1 */
+		return sign ^ (int64_t)consume_hdr(cs, bytes);	/* -1 - n for negative */
+	}
 
 	predecode(cs, &item);
 
@@ -342,6 +558,149 @@ void cbor_decode_int64(struct cbor_stream *cs, int64_t *val)
 }
 
 
+/*
+ * Store u64 as the element i of an array of unsigned integers of size bytes.
+ */
+static inline void store_uint(void *vals, size_t size, size_t i, uint64_t u64)
+{
+	switch (size) {
+	case 1:
+		((uint8_t *)vals)[i] = (uint8_t)u64;
+		break;
+	case 2:
+		((uint16_t *)vals)[i] = (uint16_t)u64;
+		break;
+	case 4:
+		((uint32_t *)vals)[i] = (uint32_t)u64;
+		break;
+	default:
+		((uint64_t *)vals)[i] = u64;
+		break;
+	}
+}
+
+
+/*
+ * Load the arguments of a block whose headers are all alike, with arguments
+ * of nbytes bytes, from fixed strides.
+ */
+static inline size_t unpack_uniform(const nb_byte_t *bytes, cbor_block_t *v, uint8_t nbytes)
+{
+	size_t stride = 1 + nbytes;
+	size_t i;
+
+	for (i = 0; i < CBOR_ARRAY_BLOCK; i++)
+		(*v)[i] = load_u64(bytes + i * stride + 1, nbytes);
+	return CBOR_ARRAY_BLOCK * stride;
+}
+
+
+/*
+ * Decode a block of unsigned integers with headers all alike (typical of AS
+ * numbers and communities) from bytes, which hold at least
+ * CBOR_ARRAY_BLOCK_MAX_LEN bytes. Returns the length of the headers, or 0
+ * if they differ, or are not unsigned integers at all.
+ */
+static inline size_t unpack_block(const nb_byte_t *bytes, cbor_block_t *v)
+{
+	hdr_block_t hdrs;
+	uint64_t not_direct;
+	nb_byte_t hdr = bytes[0];
+	size_t stride;
+	size_t i;
+
+	if (hdr <= 23) {
+		/* direct values are the initial bytes themselves */
+		memcpy(&hdrs, bytes, sizeof(hdrs));
+		hdrs = (hdr_block_t)(hdrs > 23);
+		memcpy(&not_direct, &hdrs, sizeof(not_direct));
+		if (not_direct)
+			return 0;
+
+		for (i = 0; i < CBOR_ARRAY_BLOCK; i++)
+			(*v)[i] = bytes[i];
+		return CBOR_ARRAY_BLOCK;
+	}
+
+	if (hdr > LBITS_8B)
+		return 0;
+
+	stride = 1 + hdr_table[hdr].nbytes;
+	for (i = 1; i < CBOR_ARRAY_BLOCK; i++)
+		if (bytes[i * stride] != hdr)
+			return 0;
+
+	switch (hdr) {
+	case LBITS_1B:
+		return unpack_uniform(bytes, v, 1);
+	case LBITS_2B:
+		return unpack_uniform(bytes, v, 2);
+	case LBITS_4B:
+		return unpack_uniform(bytes, v, 4);
+	default:
+		return unpack_uniform(bytes, v, 8);
+	}
+}
+
+
+/*
+ * Blocks of the array are decoded right from the window when their headers
+ * are all alike and all values are in range. Anything else, including the
+ * end of the window, errors and diagnostics, takes decode_uint.
+ */
+static inline void decode_uint_array(struct cbor_stream *cs, void *vals, size_t size,
+	size_t len, uint64_t max)
+{
+	const nb_byte_t *bytes;
+	cbor_block_t v;
+	cbor_block_t over;
+	size_t nbytes;
+	size_t i = 0;
+	size_t j;
+
+	while (i < len) {
+		if (len - i >= CBOR_ARRAY_BLOCK
+			&& (bytes = peek_hdr(cs, CBOR_ARRAY_BLOCK_MAX_LEN)) != NULL
+			&& (nbytes = unpack_block(bytes, &v)) != 0
+			&& (over = (cbor_block_t)(v > max), !cbor_block_any(&over))) {
+			for (j = 0; j < CBOR_ARRAY_BLOCK; j++)
+				store_uint(vals, size, i + j, v[j]);
+			nb_buffer_consume(cs->buf, nbytes);
+			top_block(cs)->num_items += CBOR_ARRAY_BLOCK;
+			i += CBOR_ARRAY_BLOCK;
+		}
+		else {
+			store_uint(vals, size, i, decode_uint(cs, max));
+			i++;
+		}
+	}
+}
+
+
+void cbor_decode_uint8_array(struct cbor_stream *cs, uint8_t *vals, size_t len)
+{
+	decode_uint_array(cs, vals, sizeof(*vals), len, UINT8_MAX);
+}
+
+
+void cbor_decode_uint16_array(struct cbor_stream *cs, uint16_t *vals, size_t len)
+{
+	decode_uint_array(cs, vals, sizeof(*vals), len, UINT16_MAX);
+}
+
+
+void cbor_decode_uint32_array(struct cbor_stream *cs, uint32_t *vals, size_t len)
+{
+	decode_uint_array(cs, vals, sizeof(*vals), len, UINT32_MAX);
+}
+
+
+void cbor_decode_uint64_array(struct cbor_stream *cs, uint64_t *vals, size_t len)
+{
+	decode_uint_array(cs, vals, sizeof(*vals), len, UINT64_MAX);
+}
+
+
 void cbor_decode_tag(struct cbor_stream *cs, uint32_t *tag)
 {
 	struct cbor_item item;
@@ -366,7 +725,16 @@ void cbor_decode_sval(struct cbor_stream *cs, enum cbor_sval *sval)
 
 void cbor_decode_bool(struct cbor_stream *cs, bool *b)
 {
+	const nb_byte_t *bytes;
 	enum cbor_sval sval;
+
+	if (likely((bytes = peek_hdr(cs, 1)) != NULL
+		&& (bytes[0] & ~1) == (CBOR_MAJOR_7 << 5) + CBOR_SVAL_FALSE)) {
+		*b = bytes[0] & 1;
+		consume_hdr(cs, bytes);
+		return;
+	}
+
 	cbor_decode_sval(cs, &sval);
 	if (sval != CBOR_SVAL_TRUE && sval != CBOR_SVAL_FALSE)
 		error(cs, NB_ERR_RANGE, "expected bool, but the decoded simple "
@@ -528,12 +896,15 @@ void cbor_decode_stream(struct cbor_stream *cs, struct cbor_item *stream,
 
 	while (!cbor_is_break(cs)) {
 		predecode_check(cs, &chunk, stream->type);
+		top_block(cs)->num_items--;	/* chunks are not items of the block */
 		if (!is_indefinite(&chunk))
 			read_stream_chunk(cs, stream, &chunk, bytes, len);
 		else
 			error(cs, NB_ERR_INDEF, "Indefinite-length streams cannot "
 				"contain indefinite-length chunks");
 	}
+
+	decode_break(cs);
 }
 
 
@@ -545,23 +916,19 @@ void cbor_decode_stream0(struct cbor_stream *cs, struct cbor_item *stream,
 }
 
 
-void cbor_decode_bytes(struct cbor_stream *cs, nb_byte_t **str, size_t *len)
+static void log_bytes_diag(struct cbor_stream *cs, const nb_byte_t *bytes, size_t len)
 {
-	struct cbor_item item;
-	size_t i;
+	struct strbuf bytes_dump;
 	size_t dump_len;
+	size_t i;
 
-	predecode_check(cs, &item, CBOR_TYPE_BYTES);
-	cbor_decode_stream(cs, &item, str, len);
-
-	struct strbuf bytes_dump;
 	strbuf_init(&bytes_dump, 64);
-	dump_len = MIN(*len, cs->diag->bytes_dump_maxlen);
+	dump_len = MIN(len, cs->diag->bytes_dump_maxlen);
 
-	strbuf_printf(&bytes_dump, item.type == CBOR_TYPE_TEXT ? "\"" : "h'");
+	strbuf_printf(&bytes_dump, "h'");
 	for (i = 0; i < dump_len; i++)
-		strbuf_printf(&bytes_dump, "%02X", (*str)[i]);
-	if (i < *len)
+		strbuf_printf(&bytes_dump, "%02X", bytes[i]);
+	if (i < len)
 		strbuf_printf(&bytes_dump, "...");
 	strbuf_printf(&bytes_dump, "\'");
 
@@ -571,32 +938,256 @@ void cbor_decode_bytes(struct cbor_stream *cs, nb_byte_t **str, size_t *len)
 }
 
 
-static void decode_text(struct cbor_stream *cs, char **str, size_t *len)
+static void log_text_diag(struct cbor_stream *cs, const char *str, size_t len)
 {
-	struct cbor_item item;
-	size_t i;
+	struct strbuf str_dump;
 	size_t dump_len;
+	size_t i;
 
-	predecode_check(cs, &item, CBOR_TYPE_TEXT);
-	cbor_decode_stream0(cs, &item, (nb_byte_t **)str, len);
-
-	struct strbuf str_dump;
 	strbuf_init(&str_dump, 64);
-	dump_len = MIN(*len, cs->diag->str_dump_maxlen);
+	dump_len = MIN(len, cs->diag->str_dump_maxlen);
 
-	strbuf_printf(&str_dump, item.type == CBOR_TYPE_TEXT ? "\"" : "h\"");
+	strbuf_printf(&str_dump, "\"");
 	for (i = 0; i < dump_len; i++)
-		strbuf_printf(&str_dump, "%c", (*str)[i]);
-	if (i < *len)
+		strbuf_printf(&str_dump, "%c", str[i]);
+	if (i < len)
 		strbuf_printf(&str_dump, "...");
 	strbuf_printf(&str_dump, "\"");
 
 	diag_log_cbor(cs->diag, "%s", strbuf_get_string(&str_dump));
-
+	strbuf_free(&str_dump);
 	diag_finish_item(cs);
 }
 
 
+/*
+ * Decode the header of a bytes or text item (major is CBOR_MAJOR_BYTES or
+ * CBOR_MAJOR_TEXT). Definite-length ones are decoded right away if possible.
+ */
+static inline void decode_stream_hdr(struct cbor_stream *cs, struct cbor_item *item,
+	enum major major)
+{
+	const nb_byte_t *bytes;
+
+	assert(major == CBOR_MAJOR_BYTES || major == CBOR_MAJOR_TEXT);
+
+	if (likely((bytes = peek_hdr(cs, CBOR_HDR_MAX_LEN)) != NULL
+		&& (nb_byte_t)(bytes[0] - (major << 5)) <= LBITS_8B)) {
+		item->type = (enum cbor_type)major;
+		item->flags = 0;
+		item->u64 = consume_hdr(cs, bytes);
+		return;
+	}
+
+	predecode_check(cs, item, (enum cbor_type)major);
+}
+
+
+void cbor_decode_bytes(struct cbor_stream *cs, nb_byte_t **str, size_t *len)
+{
+	struct cbor_item item;
+
+	decode_stream_hdr(cs, &item, CBOR_MAJOR_BYTES);
+	cbor_decode_stream(cs, &item, str, len);
+	diag_if_on(cs->diag, log_bytes_diag(cs, *str, *len));
+}
+
+
+static void decode_text(struct cbor_stream *cs, char **str, size_t *len)
+{
+	struct cbor_item item;
+
+	decode_stream_hdr(cs, &item, CBOR_MAJOR_TEXT);
+	cbor_decode_stream0(cs, &item, (nb_byte_t **)str, len);
+	diag_if_on(cs->diag, log_text_diag(cs, *str, *len));
+}
+
+
+/*
+ * Reference the contents of a bytes or text stream in the buffer if possible,
+ * or copy them into the stream's memory pool otherwise: a definite-length
+ * stream is read straight into it, the chunks of an indefinite-length one are
+ * joined first. The result must not be freed nor modified and it's not
+ * NUL-terminated.
+ */
+static void decode_stream_ref(struct cbor_stream *cs, struct cbor_item *stream,
+	const nb_byte_t **bytes, size_t *len)
+{
+	nb_byte_t *copy;
+
+	if (!is_indefinite(stream) && stream->u64 <= SIZE_MAX) {
+		*len = stream->u64;
+		diag_log_offset(cs->diag, nb_buffer_tell(cs->buf));
+		if ((*bytes = nb_buffer_read_ref(cs->buf, *len)) == NULL) {
+			copy = mempool_malloc(cs->mempool, *len);
+			if (nb_buffer_read(cs->buf, copy, *len) != *len)
+				short_read(cs);
+			*bytes = copy;
+		}
+		diag_log_raw(cs->diag, (nb_byte_t *)*bytes, MIN(*len, 4));
+		return;
+	}
+
+	cbor_decode_stream(cs, stream, &copy, len);
+	*bytes = mempool_malloc(cs->mempool, *len);
+	memcpy((nb_byte_t *)*bytes, copy, *len);
+	xfree(copy);
+}
+
+
+/*
+ * Like cbor_decode_bytes, but point into the buffer instead of copying
+ * the bytes out whenever the buffer allows that (see nb_buffer_read_ref).
+ */
+void cbor_decode_bytes_ref(struct cbor_stream *cs, const nb_byte_t **bytes, size_t *len)
+{
+	struct cbor_item item;
+
+	decode_stream_hdr(cs, &item, CBOR_MAJOR_BYTES);
+	decode_stream_ref(cs, &item, bytes, len);
+	diag_if_on(cs->diag, log_bytes_diag(cs, *bytes, *len));
+}
+
+
+/*
+ * Zero-copy counterpart of cbor_decode_text. Note that *str is not
+ * NUL-terminated, use *len.
+ */
+void cbor_decode_text_ref(struct cbor_stream *cs, const char **str, size_t *len)
+{
+	struct cbor_item item;
+
+	decode_stream_hdr(cs, &item, CBOR_MAJOR_TEXT);
+	decode_stream_ref(cs, &item, (const nb_byte_t **)str, len);
+	diag_if_on(cs->diag, log_text_diag(cs, *str, *len));
+}
+
+
+/*
+ * Allocate memory for len bytes of elements of size bytes from the stream's
+ * mempool. The mempool does not align its allocations, so align it here.
+ */
+static nb_byte_t *alloc_typed_array(struct cbor_stream *cs, size_t len, size_t size)
+{
+	nb_byte_t *mem;
+
+	mem = mempool_malloc(cs->mempool, len + size - 1);
+	return (nb_byte_t *)(((uintptr_t)mem + size - 1) & ~(uintptr_t)(size - 1));
+}
+
+
+/*
+ * Swap the bytes of the elements of size bytes from src into dst, which may
+ * be src itself.
+ */
+static void swap_typed_array(nb_byte_t *dst, const nb_byte_t *src, size_t len, size_t size)
+{
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+	size_t i;
+
+	for (i = 0; i < len; i += size) {
+		switch (size) {
+		case 2:
+			memcpy(&u16, src + i, 2);
+			u16 = __builtin_bswap16(u16);
+			memcpy(dst + i, &u16, 2);
+			break;
+		case 4:
+			memcpy(&u32, src + i, 4);
+			u32 = __builtin_bswap32(u32);
+			memcpy(dst + i, &u32, 4);
+			break;
+		default:
+			memcpy(&u64, src + i, 8);
+			u64 = __builtin_bswap64(u64);
+			memcpy(dst + i, &u64, 8);
+			break;
+		}
+	}
+}
+
+
+/*
+ * The elements are referenced right in the buffer, unless it does not
+ * support that (see nb_buffer_read_ref), or they are misaligned or in the
+ * other byte order. They end up in memory of the stream's mempool then:
+ * a definite-length array is read straight into it and swapped in place,
+ * the chunks of an indefinite-length one are joined first.
+ */
+void cbor_decode_typed_array(struct cbor_stream *cs, enum cbor_ta_type type,
+	const void **vals, size_t *nitems)
+{
+	size_t size = ta_size(type);
+	struct cbor_item item;
+	const nb_byte_t *bytes;
+	nb_byte_t *copy = NULL;
+	uint32_t tag;
+	size_t len;
+	bool swap;
+
+	*vals = NULL;
+	*nitems = 0;
+
+	cbor_decode_tag(cs, &tag);
+	if (tag == ta_tag(type, CBOR_TA_HOST_LE)
+		|| (type == CBOR_TA_UINT8 && tag == CBOR_TAG_TA_UINT8_CLAMPED)) {
+		swap = false;
+	}
+	else if (tag == ta_tag(type, !CBOR_TA_HOST_LE)) {
+		swap = true;
+	}
+	else {
+		error(cs, NB_ERR_ITEM, "Typed array of tag %u was expected, tag %u was decoded",
+			ta_tag(type, CBOR_TA_HOST_LE), tag);
+		return;
+	}
+
+	decode_stream_hdr(cs, &item, CBOR_MAJOR_BYTES);
+	if (!is_indefinite(&item) && item.u64 <= SIZE_MAX && item.u64 % size == 0) {
+		len = item.u64;
+		diag_log_offset(cs->diag, nb_buffer_tell(cs->buf));
+		if ((bytes = nb_buffer_read_ref(cs->buf, len)) != NULL) {
+			diag_log_raw(cs->diag, (nb_byte_t *)bytes, MIN(len, 4));
+		}
+		else {
+			copy = alloc_typed_array(cs, len, size);
+			if (nb_buffer_read(cs->buf, copy, len) != len)
+				short_read(cs);
+			diag_log_raw(cs->diag, copy, MIN(len, 4));
+			bytes = copy;
+		}
+	}
+	else {
+		decode_stream_ref(cs, &item, &bytes, &len);
+	}
+	diag_if_on(cs->diag, log_bytes_diag(cs, bytes, len));
+
+	if (len % size != 0) {
+		error(cs, NB_ERR_PARSE, "Length of typed array (%zu) is not a multiple "
+			"of its element size (%zu)", len, size);
+		return;
+	}
+
+	if (bytes == copy) {
+		if (swap)
+			swap_typed_array(copy, copy, len, size);
+	}
+	else if (swap || (uintptr_t)bytes % size != 0) {
+		copy = alloc_typed_array(cs, len, size);
+		if (swap)
+			swap_typed_array(copy, bytes, len, size);
+		else
+			memcpy(copy, bytes, len);
+		bytes = copy;
+	}
+
+	*vals = bytes;
+	*nitems = len / size;
+}
+
+
 void cbor_decode_text(struct cbor_stream *cs, char **str)
 {
 	size_t unused;
@@ -238,6 +238,24 @@ void diag_init(struct diag *diag, FILE *fout)
 	for (i = 0; i < ARRAY_SIZE(diag->lines); i++)
 		init_line(&diag->lines[i]);
 
+	diag_reset(diag, fout);
+}
+
+
+/*
+ * Return the diagnostics to the state diag_init leaves them in, reusing
+ * the line buffers.
+ */
+void diag_reset(struct diag *diag, FILE *fout)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(diag->lines); i++) {
+		reset_line(&diag->lines[i]);
+		diag->lines[i].cbor.indent_level = 0;
+		diag->lines[i].proto.indent_level = 0;
+	}
+
 	for (i = 0; i < ARRAY_SIZE(diag->cols_enabled); i++)
 		diag->cols_enabled[i] = false;
 
@@ -297,10 +315,14 @@ nb_err_t diag_dump_cbor_stream(struct diag *diag, struct cbor_stream *cs)
 
 void diag_free(struct diag *diag)
 {
-	strbuf_free(&diag->line->raw);
-	strbuf_free(&diag->line->item);
-	isbuf_free(&diag->line->cbor);
-	isbuf_free(&diag->line->proto);
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(diag->lines); i++) {
+		strbuf_free(&diag->lines[i].raw);
+		strbuf_free(&diag->lines[i].item);
+		isbuf_free(&diag->lines[i].cbor);
+		isbuf_free(&diag->lines[i].proto);
+	}
 }
 
 
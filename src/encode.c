@@ -9,6 +9,7 @@
 #include "debug.h"
 #include "memory.h"
 #include "stack.h"
+#include "util.h"
 
 #include <assert.h>
 #include <endian.h>
@@ -19,11 +20,23 @@
 #include <string.h>
 
 
+/*
+ * A flush need not make room for the header (see nb_buffer_reserve), the
+ * write waits for it then, or fails.
+ */
 static nb_err_t write_hdr(struct cbor_stream *cs, enum major major, nb_byte_t lbits)
 {
-	nb_byte_t hdr;
-	hdr = (major << 5) + lbits;
-	return nb_buffer_write(cs->buf, &hdr, 1) == 1 ? NB_ERR_OK : NB_ERR_WRITE;
+	nb_byte_t *hdr;
+	nb_byte_t byte;
+
+	if (likely((hdr = nb_buffer_reserve(cs->buf, 1)) != NULL)) {
+		*hdr = (major << 5) + lbits;
+		nb_buffer_commit(cs->buf, 1);
+		return NB_ERR_OK;
+	}
+
+	byte = (major << 5) + lbits;
+	return nb_buffer_write(cs->buf, &byte, 1) == 1 ? NB_ERR_OK : cbor_write_error(cs);
 }
 
 
@@ -52,49 +65,69 @@ static nb_err_t write_break(struct cbor_stream *cs)
 }
 
 
-static nb_err_t write_hdr_u64(struct cbor_stream *cs, enum major major, uint64_t u64)
+/*
+ * Additional Information of the header by the index of the most significant
+ * byte of its argument (greater than 23).
+ */
+static const nb_byte_t arg_lbits[8] = {
+	LBITS_1B, LBITS_2B, LBITS_4B, LBITS_4B,
+	LBITS_8B, LBITS_8B, LBITS_8B, LBITS_8B,
+};
+
+
+/*
+ * Store the header with argument u64 into bytes, which have room for
+ * CBOR_HDR_MAX_LEN bytes. Returns the length of the header.
+ *
+ * The width of the argument is looked up by its leading zeros, and the
+ * argument is shifted to the top of a word, which is stored big-endian
+ * after the initial byte whatever its width. The bytes beyond the header
+ * are garbage.
+ */
+static inline size_t store_hdr_u64(nb_byte_t *bytes, enum major major, uint64_t u64)
 {
 	nb_byte_t lbits;
-	//nb_byte_t bytes[8];
-	size_t len;
+	size_t nbytes;
 	uint64_t u64be;
-	nb_byte_t *u64be_ptr = (nb_byte_t *)&u64be;
-	nb_err_t err;
-	size_t i;
-
-	assert(major >= 0 && major < 7);
 
 	if (u64 <= 23) {
-		return write_hdr_count(cs, major, (nb_byte_t)u64);
+		bytes[0] = (major << 5) + (nb_byte_t)u64;
+		return 1;
 	}
 
-	if (u64 <= UINT8_MAX) {
-		len = 1;
-		lbits = LBITS_1B;
-	}
-	else if (u64 <= UINT16_MAX) {
-		len = 2;
-		lbits = LBITS_2B;
-	}
-	else if (u64 <= UINT32_MAX) {
-		len = 4;
-		lbits = LBITS_4B;
-	}
-	else {
-		len = 8;
-		lbits = LBITS_8B;
-	}
+	lbits = arg_lbits[(63 - __builtin_clzll(u64)) >> 3];
+	nbytes = (size_t)1 << (lbits - LBITS_1B);
 
-	if ((err = write_hdr_count(cs, major, lbits)) != NB_ERR_OK)
-		return err;
+	bytes[0] = (major << 5) + lbits;
+	u64be = htobe64(u64 << (64 - 8 * nbytes));
+	memcpy(bytes + 1, &u64be, 8);
+	return 1 + nbytes;
+}
 
-	u64be = htobe64(u64);
-	//for (i = 0; i < len; i++)
-	//	bytes[i] = u64be_ptr[(8 - len) + i];
 
-	return nb_buffer_write(cs->buf, &u64be_ptr[8 - len], len) == len
-		? NB_ERR_OK
-		: NB_ERR_WRITE;
+/*
+ * The header is encoded right into the buffer's window if the window has
+ * room for the longest header (store_hdr_u64 stores a whole word). Otherwise
+ * only the bytes of the header are written, across the end of the window if
+ * necessary, so the window is not flushed before it's full.
+ */
+static nb_err_t write_hdr_u64(struct cbor_stream *cs, enum major major, uint64_t u64)
+{
+	nb_byte_t hdr[CBOR_HDR_MAX_LEN];
+	nb_byte_t *bytes;
+	size_t len;
+
+	assert(major >= 0 && major < 7);
+
+	top_block(cs)->num_items++;
+
+	if (likely((bytes = nb_buffer_try_reserve(cs->buf, CBOR_HDR_MAX_LEN)) != NULL)) {
+		nb_buffer_commit(cs->buf, store_hdr_u64(bytes, major, u64));
+		return NB_ERR_OK;
+	}
+
+	len = store_hdr_u64(hdr, major, u64);
+	return nb_buffer_write(cs->buf, hdr, len) == len ? NB_ERR_OK : cbor_write_error(cs);
 }
 
 
@@ -167,6 +200,156 @@ nb_err_t cbor_encode_int64(struct cbor_stream *cs, int64_t val)
 }
 
 
+/*
+ * Load the element i of an array of unsigned integers of size bytes.
+ */
+static inline uint64_t load_uint(const void *vals, size_t size, size_t i)
+{
+	switch (size) {
+	case 1:
+		return ((const uint8_t *)vals)[i];
+	case 2:
+		return ((const uint16_t *)vals)[i];
+	case 4:
+		return ((const uint32_t *)vals)[i];
+	default:
+		return ((const uint64_t *)vals)[i];
+	}
+}
+
+
+/*
+ * Return the width classes of the arguments of a block of unsigned integers:
+ * 0 for values stored in the initial byte, 1 to 4 for arguments of 1, 2, 4
+ * and 8 bytes. (Comparisons of vectors give -1 for true.)
+ */
+static inline void block_classes(const cbor_block_t *v, cbor_block_t *classes)
+{
+	*classes = (cbor_block_t)-((*v > 23) + (*v > UINT8_MAX) + (*v > UINT16_MAX) + (*v > UINT32_MAX));
+}
+
+
+/*
+ * Store the headers of a block whose arguments are all nbytes wide (see
+ * store_hdr_u64), at fixed strides.
+ */
+static inline size_t pack_uniform(nb_byte_t *bytes, const cbor_block_t *v, nb_byte_t lbits,
+	size_t nbytes)
+{
+	cbor_block_t args = *v << (64 - 8 * nbytes);
+	size_t stride = 1 + nbytes;
+	uint64_t u64be;
+	size_t i;
+
+	for (i = 0; i < CBOR_ARRAY_BLOCK; i++) {
+		bytes[i * stride] = (CBOR_MAJOR_UINT << 5) + lbits;
+		u64be = htobe64(args[i]);
+		memcpy(bytes + i * stride + 1, &u64be, 8);
+	}
+	return CBOR_ARRAY_BLOCK * stride;
+}
+
+
+/*
+ * Store the headers of a block of unsigned integers into bytes, which have
+ * room for CBOR_ARRAY_BLOCK_MAX_LEN bytes. Returns their length.
+ */
+static inline size_t pack_block(nb_byte_t *bytes, const cbor_block_t *v)
+{
+	cbor_block_t classes;
+	cbor_block_t diff;
+	size_t len = 0;
+	size_t i;
+
+	block_classes(v, &classes);
+	diff = classes ^ classes[0];
+
+	if (!cbor_block_any(&diff)) {
+		switch (classes[0]) {
+		case 0:
+			for (i = 0; i < CBOR_ARRAY_BLOCK; i++)
+				bytes[i] = (nb_byte_t)(*v)[i];
+			return CBOR_ARRAY_BLOCK;
+		case 1:
+			return pack_uniform(bytes, v, LBITS_1B, 1);
+		case 2:
+			return pack_uniform(bytes, v, LBITS_2B, 2);
+		case 3:
+			return pack_uniform(bytes, v, LBITS_4B, 4);
+		default:
+			return pack_uniform(bytes, v, LBITS_8B, 8);
+		}
+	}
+
+	for (i = 0; i < CBOR_ARRAY_BLOCK; i++)
+		len += store_hdr_u64(bytes + len, CBOR_MAJOR_UINT, (*v)[i]);
+	return len;
+}
+
+
+/*
+ * Whole blocks of the array are encoded right into the buffer's window: the
+ * widths of a block are classified at once, and blocks of elements of the
+ * same width (typical of AS numbers and communities) are stored at fixed
+ * strides. A block which may not fit into the rest of the window, and the
+ * rest of the array, are encoded element by element.
+ */
+static inline nb_err_t encode_uint_array(struct cbor_stream *cs, const void *vals,
+	size_t size, size_t len)
+{
+	nb_byte_t *bytes;
+	cbor_block_t v;
+	nb_err_t err;
+	size_t i;
+	size_t j;
+
+	for (i = 0; i + CBOR_ARRAY_BLOCK <= len; i += CBOR_ARRAY_BLOCK) {
+		if (!(bytes = nb_buffer_try_reserve(cs->buf, CBOR_ARRAY_BLOCK_MAX_LEN))) {
+			for (j = 0; j < CBOR_ARRAY_BLOCK; j++)
+				if ((err = write_hdr_u64(cs, CBOR_MAJOR_UINT,
+					load_uint(vals, size, i + j))) != NB_ERR_OK)
+					return err;
+			continue;
+		}
+
+		for (j = 0; j < CBOR_ARRAY_BLOCK; j++)
+			v[j] = load_uint(vals, size, i + j);
+		nb_buffer_commit(cs->buf, pack_block(bytes, &v));
+		top_block(cs)->num_items += CBOR_ARRAY_BLOCK;
+	}
+
+	for (; i < len; i++)
+		if ((err = write_hdr_u64(cs, CBOR_MAJOR_UINT, load_uint(vals, size, i))) != NB_ERR_OK)
+			return err;
+
+	return NB_ERR_OK;
+}
+
+
+nb_err_t cbor_encode_uint8_array(struct cbor_stream *cs, const uint8_t *vals, size_t len)
+{
+	return encode_uint_array(cs, vals, sizeof(*vals), len);
+}
+
+
+nb_err_t cbor_encode_uint16_array(struct cbor_stream *cs, const uint16_t *vals, size_t len)
+{
+	return encode_uint_array(cs, vals, sizeof(*vals), len);
+}
+
+
+nb_err_t cbor_encode_uint32_array(struct cbor_stream *cs, const uint32_t *vals, size_t len)
+{
+	return encode_uint_array(cs, vals, sizeof(*vals), len);
+}
+
+
+nb_err_t cbor_encode_uint64_array(struct cbor_stream *cs, const uint64_t *vals, size_t len)
+{
+	return encode_uint_array(cs, vals, sizeof(*vals), len);
+}
+
+
 static nb_err_t start_block(struct cbor_stream *cs, enum major major, uint64_t len)
 {
 	nb_err_t err;
@@ -252,7 +435,7 @@ static nb_err_t encode_bytes(struct cbor_stream *cs, enum major major, nb_byte_t
 {
 	nb_err_t err;
 	if ((err = write_hdr_u64(cs, major, len)) == NB_ERR_OK)
-		return nb_buffer_write(cs->buf, bytes, len) == len ? NB_ERR_OK : NB_ERR_WRITE;
+		return nb_buffer_write_ref(cs->buf, bytes, len) == len ? NB_ERR_OK : cbor_write_error(cs);
 	return err;
 }
 
@@ -294,6 +477,100 @@ nb_err_t cbor_encode_text_end(struct cbor_stream *cs)
 }
 
 
+/*
+ * Return the length of the shortest header with argument u64.
+ */
+static size_t hdr_len(uint64_t u64)
+{
+	if (u64 <= 23)
+		return 1;
+	return 1 + ((size_t)1 << (arg_lbits[(63 - __builtin_clzll(u64)) >> 3] - LBITS_1B));
+}
+
+
+/*
+ * Write a header of len bytes (1, 2, 3, 5 or 9, at least hdr_len(u64)),
+ * which may be longer than needed.
+ */
+static nb_err_t write_hdr_len(struct cbor_stream *cs, enum major major, uint64_t u64, size_t len)
+{
+	nb_byte_t hdr[CBOR_HDR_MAX_LEN];
+	size_t nbytes = len - 1;
+	uint64_t u64be;
+
+	assert(len >= hdr_len(u64));
+
+	top_block(cs)->num_items++;
+
+	if (nbytes == 0) {
+		hdr[0] = (major << 5) + (nb_byte_t)u64;
+	}
+	else {
+		hdr[0] = (major << 5) + LBITS_1B + __builtin_ctzll(nbytes);
+		u64be = htobe64(u64 << (64 - 8 * nbytes));
+		memcpy(hdr + 1, &u64be, nbytes);
+	}
+
+	return nb_buffer_write(cs->buf, hdr, len) == len ? NB_ERR_OK : cbor_write_error(cs);
+}
+
+
+/*
+ * Choose the lengths of the headers of the tag and of the byte string of a
+ * typed array starting at offset, so that its elements of size bytes start
+ * at an aligned offset. Longer headers than needed are valid CBOR. The
+ * shortest headers are chosen if there are no such (for 1 in 8 offsets of
+ * arrays of 8-byte elements).
+ */
+static void choose_ta_hdr_lens(size_t offset, size_t size, uint32_t tag, size_t nbytes,
+	size_t *tag_len, size_t *len_len)
+{
+	static const size_t lens[] = { 1, 2, 3, 5, 9 };
+	size_t best = SIZE_MAX;
+	size_t i;
+	size_t j;
+
+	*tag_len = hdr_len(tag);
+	*len_len = hdr_len(nbytes);
+
+	for (i = 0; i < ARRAY_SIZE(lens); i++) {
+		for (j = 0; j < ARRAY_SIZE(lens); j++) {
+			if (lens[i] < hdr_len(tag) || lens[j] < hdr_len(nbytes))
+				continue;
+			if ((offset + lens[i] + lens[j]) % size == 0 && lens[i] + lens[j] < best) {
+				best = lens[i] + lens[j];
+				*tag_len = lens[i];
+				*len_len = lens[j];
+			}
+		}
+	}
+}
+
+
+/*
+ * The elements are aligned at their stream offset, so that decoders can
+ * use them right in a buffer mapping the stream, and written as they are in
+ * memory, by reference if the buffer supports that (see nb_buffer_write_ref).
+ */
+nb_err_t cbor_encode_typed_array(struct cbor_stream *cs, enum cbor_ta_type type,
+	const void *vals, size_t nitems)
+{
+	uint32_t tag = ta_tag(type, CBOR_TA_HOST_LE);
+	size_t nbytes = nitems * ta_size(type);
+	size_t tag_len;
+	size_t len_len;
+	nb_err_t err;
+
+	choose_ta_hdr_lens(nb_buffer_tell(cs->buf), ta_size(type), tag, nbytes, &tag_len, &len_len);
+
+	if ((err = write_hdr_len(cs, CBOR_MAJOR_TAG, tag, tag_len)) != NB_ERR_OK)
+		return err;
+	if ((err = write_hdr_len(cs, CBOR_MAJOR_BYTES, nbytes, len_len)) != NB_ERR_OK)
+		return err;
+	return nb_buffer_write_ref(cs->buf, (nb_byte_t *)vals, nbytes) == nbytes ? NB_ERR_OK : cbor_write_error(cs);
+}
+
+
 nb_err_t cbor_encode_tag(struct cbor_stream *cs, uint32_t tag)
 {
 	return write_hdr_u64(cs, CBOR_MAJOR_TAG, tag);
@@ -311,7 +588,7 @@ nb_err_t cbor_encode_sval(struct cbor_stream *cs, enum cbor_sval sval)
 		if ((err = write_hdr_major7(cs, CBOR_MINOR_SVAL)) == NB_ERR_OK)
 			return nb_buffer_write(cs->buf, (nb_byte_t *)&sval, 1) == 1
 				? NB_ERR_OK
-				: NB_ERR_WRITE;
+				: cbor_write_error(cs);
 		return err;
 	}
 
@@ -2,6 +2,7 @@
 #define BUFFER_INTERNAL_H
 
 #include "common.h"
+#include "error.h"
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -11,8 +12,11 @@ struct nb_buffer_ops
 {
 	void (*free)(struct nb_buffer *buf);
 	void (*fill)(struct nb_buffer *buf);
-	void (*flush)(struct nb_buffer *buf);
-	size_t (*tell)(struct nb_buffer *buf);
+	void (*flush)(struct nb_buffer *buf);	/* NULL for read-only buffers */
+	void (*rewind)(struct nb_buffer *buf);	/* optional */
+	nb_err_t (*seek)(struct nb_buffer *buf, size_t offset);	/* optional, see nb_buffer_seek */
+	void (*write_ref)(struct nb_buffer *buf, nb_byte_t *bytes, size_t count); /* optional */
+	void (*reset)(struct nb_buffer *buf);	/* optional, see nb_buffer_reset */
 };
 
 enum buf_mode
@@ -22,6 +26,17 @@ enum buf_mode
 	BUF_MODE_WRITING,	/* the buffer contains data to be written */
 };
 
+/*
+ * Why the window is being flushed, for backends which treat full windows
+ * differently (see struct nb_buffer_opts and struct nb_socket_policy).
+ */
+enum buf_flush
+{
+	BUF_FLUSH_FULL,		/* to make room for more data */
+	BUF_FLUSH_EXPLICIT,	/* nb_buffer_flush has been called */
+	BUF_FLUSH_FINAL,	/* no data follow (the buffer is deleted, reset or seeks) */
+};
+
 struct nb_buffer
 {
 	const struct nb_buffer_ops *ops;	/* buffer operations */
@@ -31,15 +46,56 @@ struct nb_buffer
 	size_t bufsize;		/* size of the buffer */
 	size_t pos;		/* current read/write position within the buf */
 	size_t len;		/* number of valid bytes in the buffer (for reading) */
+	size_t offset;		/* stream offset of the window's start */
 	bool dirty;		/* do we have data to be written? */
 	bool eof;		/* did we hit EOF during last filling? */
 	int ungetc;		/* character to be returned by next getc()-call */
 	size_t last_read_len;
 	size_t written_total;	/* total number of bytes written into this buffer */
+	bool own_buf;		/* was buf allocated by nb_buffer_init? */
+	bool persistent;	/* do windows stay valid until the buffer is deleted? */
+	size_t max_bufsize;	/* the window may grow up to this size */
+	size_t align;		/* alignment of the window */
+	bool huge_pages;	/* advise huge pages for big windows */
+	nb_byte_t full_streak;	/* number of consecutive full fills/flushes */
+	size_t fills;		/* number of fills */
+	size_t flushes;		/* number of flushes */
+	nb_byte_t flush_cause;	/* why the window is being flushed, see enum buf_flush */
+	size_t kept;		/* bytes the flush has left at the start of the window */
+	nb_err_t err;		/* error of the last fill or flush */
 };
 
 
+/*
+ * A filter buffer is stacked on top of a lower buffer. It transforms the
+ * data written into its window in flush and writes them into the lower
+ * buffer, and fills its window with data read from the lower buffer and
+ * transformed back.
+ */
+struct nb_buffer_filter
+{
+	struct nb_buffer buf;
+	struct nb_buffer *lower;	/* the buffer the filter is stacked on */
+};
+
+
+struct nb_buffer_opts;
+
 void nb_buffer_init(struct nb_buffer *buf);
+void nb_buffer_init_opts(struct nb_buffer *buf, const struct nb_buffer_opts *opts);
+void nb_buffer_init_window(struct nb_buffer *buf, nb_byte_t *window, size_t size);
+void nb_buffer_reset(struct nb_buffer *buf);
+void nb_buffer_flush_final(struct nb_buffer *buf);
+void nb_buffer_resize_window(struct nb_buffer *buf, size_t size);
+void nb_buffer_file_set_fd(struct nb_buffer *buf, int fd);
+
+void nb_buffer_filter_init(struct nb_buffer_filter *filter, struct nb_buffer *lower,
+	const struct nb_buffer_opts *opts);
+bool nb_buffer_filter_read(struct nb_buffer_filter *filter, nb_byte_t *bytes, size_t count,
+	bool eof_ok);
+void nb_buffer_filter_write(struct nb_buffer_filter *filter, nb_byte_t *bytes, size_t count);
+nb_byte_t *nb_buffer_filter_reserve(struct nb_buffer_filter *filter, size_t *avail);
+nb_byte_t *nb_buffer_filter_peek(struct nb_buffer_filter *filter, size_t *avail);
 
 /*
  * This is a test helper.
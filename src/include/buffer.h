@@ -12,13 +12,76 @@
 
 #define BUF_EOF	(-1)
 
+#define NB_BUFFER_REF_MIN	512	/* nb_buffer_write_ref copies smaller chunks */
+
+#define NB_BUFFER_SIZE		(4 * 4096)		/* default window size */
+#define NB_BUFFER_MAX_SIZE	(4 * 1024 * 1024)	/* default limit of adaptive growth */
+
 struct nb_buffer;
 
+/*
+ * Buffer options. Zero fields select the defaults.
+ */
+struct nb_buffer_opts
+{
+	size_t size;		/* (initial) size of the window */
+	size_t align;		/* alignment of the window (a power of two) */
+	bool huge_pages;	/* back big windows with transparent huge pages */
+	bool adaptive;		/* grow the window while fills/flushes keep filling it up */
+	size_t max_size;	/* limit of adaptive growth */
+	bool direct;		/* bypass the page cache, see nb_buffer_new_file_opts */
+};
+
+/*
+ * When a socket buffer sends the data flushed, see nb_buffer_socket_policy.
+ */
+enum nb_socket_flush
+{
+	NB_SOCKET_FLUSH_IMMEDIATE,	/* on every flush (the default) */
+	NB_SOCKET_FLUSH_THRESHOLD,	/* once threshold bytes are pending */
+	NB_SOCKET_FLUSH_DEADLINE,	/* ... or the oldest data are deadline_ms old */
+};
+
+struct nb_socket_policy
+{
+	enum nb_socket_flush flush;
+	size_t threshold;	/* pending bytes worth a send */
+	unsigned deadline_ms;	/* how long data may be held back */
+	bool cork;		/* send windows flushed when full with MSG_MORE (unless zerocopy) */
+	size_t zerocopy_min;	/* send windows this big with MSG_ZEROCOPY (0: never) */
+};
+
 bool nb_buffer_is_eof(struct nb_buffer *buf);
 bool nb_buffer_fill(struct nb_buffer *buf);
 
 struct nb_buffer *nb_buffer_new_file(int fd_in);
+struct nb_buffer *nb_buffer_new_file_opts(int fd, const struct nb_buffer_opts *opts);
+struct nb_buffer *nb_buffer_new_file_writev(int fd_out);
+struct nb_buffer *nb_buffer_new_file_uring(int fd);
+struct nb_buffer *nb_buffer_new_file_prefetch(int fd, size_t nbufs);
 struct nb_buffer *nb_buffer_new_memory(void);
+struct nb_buffer *nb_buffer_new_memory_view(const void *ptr, size_t len);
+struct nb_buffer *nb_buffer_new_fixed(void *dst, size_t cap);
+struct nb_buffer *nb_buffer_new_mmap(int fd_in);
+struct nb_buffer *nb_buffer_new_socket(int sock, const struct nb_buffer_opts *opts);
+struct nb_buffer *nb_buffer_new_lz(struct nb_buffer *lower, const struct nb_buffer_opts *opts);
+struct nb_buffer *nb_buffer_new_crc(struct nb_buffer *lower, const struct nb_buffer_opts *opts);
+struct nb_buffer *nb_buffer_new_tee(struct nb_buffer *sink, ...);
+struct nb_buffer *nb_buffer_new_spsc(size_t size);
+struct nb_buffer *nb_buffer_spsc_reader(struct nb_buffer *writer);
+int nb_buffer_shm_create(size_t size);
+struct nb_buffer *nb_buffer_new_shm(int fd, bool writer);
+
+void nb_buffer_socket_mark(struct nb_buffer *buf);
+void nb_buffer_socket_reset(struct nb_buffer *buf);
+nb_err_t nb_buffer_socket_send(struct nb_buffer *buf);
+size_t nb_buffer_socket_pending(struct nb_buffer *buf);
+nb_err_t nb_buffer_socket_policy(struct nb_buffer *buf, const struct nb_socket_policy *policy);
+int nb_buffer_socket_timeout(struct nb_buffer *buf);
+
+void nb_buffer_tee_spill(struct nb_buffer *buf, struct nb_buffer *sink, size_t max_queued);
+nb_err_t nb_buffer_tee_drain(struct nb_buffer *buf, size_t budget);
+size_t nb_buffer_tee_pending(struct nb_buffer *buf, struct nb_buffer *sink);
 
 void nb_buffer_delete(struct nb_buffer *buf);
 
@@ -45,6 +108,65 @@ static inline ssize_t nb_buffer_write(struct nb_buffer *buf, nb_byte_t *bytes, s
 	}
 }
 
+/*
+ * Get a pointer to at least count contiguous bytes of the window, to be
+ * written in place and then committed using nb_buffer_commit. Pending data
+ * are flushed to make room if necessary. NULL is returned if there is no
+ * room for count contiguous bytes even then (the window is too small or ends
+ * with a partially filled memory segment); use nb_buffer_write then.
+ *
+ * The window flushed may be up to count - 1 bytes short of full. It's
+ * treated as a full one nevertheless: it counts towards the growth of
+ * adaptive windows and it's corked by socket buffers (see
+ * nb_buffer_socket_policy). Callers which reserve more than they are going
+ * to write should use nb_buffer_try_reserve and fall back to nb_buffer_write.
+ */
+nb_byte_t *nb_buffer_reserve_slow(struct nb_buffer *buf, size_t count);
+static inline nb_byte_t *nb_buffer_reserve(struct nb_buffer *buf, size_t count)
+{
+	assert(buf->mode != BUF_MODE_READING);
+
+	if (likely(count <= buf->bufsize - buf->len))
+		return buf->buf + buf->pos;
+	else
+		return nb_buffer_reserve_slow(buf, count);
+}
+
+/*
+ * Like nb_buffer_reserve, but nothing is flushed: NULL is returned unless
+ * the window has count bytes free. Encoders which reserve more than they
+ * write use it to leave the rest of the window to nb_buffer_write.
+ */
+static inline nb_byte_t *nb_buffer_try_reserve(struct nb_buffer *buf, size_t count)
+{
+	assert(buf->mode != BUF_MODE_READING);
+
+	if (likely(count <= buf->bufsize - buf->len))
+		return buf->buf + buf->pos;
+	return NULL;
+}
+
+/*
+ * Make count bytes written to the space returned by nb_buffer_reserve part
+ * of the buffer's data. Not more than the reserved bytes may be committed.
+ */
+static inline void nb_buffer_commit(struct nb_buffer *buf, size_t count)
+{
+	assert(count <= buf->bufsize - buf->len);
+
+	buf->pos += count;
+	buf->len = buf->pos;
+	buf->written_total += count;
+	buf->mode = BUF_MODE_WRITING;
+}
+
+/*
+ * Write bytes into the buffer. Buffers which support that (see
+ * nb_buffer_new_file_writev) only reference big chunks of data instead
+ * of copying them; the bytes have to stay valid until the buffer is flushed.
+ */
+ssize_t nb_buffer_write_ref(struct nb_buffer *buf, nb_byte_t *bytes, size_t count);
+
 ssize_t nb_buffer_read_slow(struct nb_buffer *buf, nb_byte_t *bytes, size_t count);
 static inline ssize_t nb_buffer_read(struct nb_buffer *buf, nb_byte_t *bytes, size_t count)
 {
@@ -68,6 +190,36 @@ static inline ssize_t nb_buffer_read(struct nb_buffer *buf, nb_byte_t *bytes, si
 	return NB_ERR_OK;
 }
 
+/*
+ * Get a pointer to the unread bytes in the window without consuming them
+ * (see nb_buffer_consume), their number is stored in avail. An empty window
+ * is refilled first. Fewer than min bytes are available when the data end
+ * or continue in the next window; use nb_buffer_read for those then.
+ */
+nb_byte_t *nb_buffer_peek_span_slow(struct nb_buffer *buf, size_t *avail);
+static inline nb_byte_t *nb_buffer_peek_span(struct nb_buffer *buf, size_t min, size_t *avail)
+{
+	assert(buf->mode != BUF_MODE_WRITING);
+
+	*avail = buf->len - buf->pos;
+	if (likely(*avail >= min))
+		return buf->buf + buf->pos;
+	else
+		return nb_buffer_peek_span_slow(buf, avail);
+}
+
+/*
+ * Consume count bytes returned by nb_buffer_peek_span.
+ */
+static inline void nb_buffer_consume(struct nb_buffer *buf, size_t count)
+{
+	assert(count <= buf->len - buf->pos);
+
+	buf->pos += count;
+	buf->last_read_len += count;
+	buf->mode = BUF_MODE_READING;
+}
+
 static inline int nb_buffer_getc(struct nb_buffer *buf)
 {
 	if (unlikely(buf->pos >= buf->len))
@@ -76,10 +228,15 @@ static inline int nb_buffer_getc(struct nb_buffer *buf)
 	return buf->buf[buf->pos++];
 }
 
+/*
+ * Only the character returned by the last getc() may be pushed back. The window
+ * is left untouched, as it may be read-only (see nb_buffer_new_mmap).
+ */
 static inline void nb_buffer_ungetc(struct nb_buffer *buf, int c)
 {
 	assert(buf->pos > 0);
-	buf->buf[--buf->pos] = c;
+	assert(buf->buf[buf->pos - 1] == (nb_byte_t)c);
+	buf->pos--;
 }
 
 static inline int nb_buffer_peek(struct nb_buffer *buf)
@@ -90,13 +247,36 @@ static inline int nb_buffer_peek(struct nb_buffer *buf)
 	return c;
 }
 
-size_t nb_buffer_tell(struct nb_buffer *buf);
+/*
+ * Reference nbytes bytes in the buffer's window instead of copying them out.
+ * Only buffers with persistent windows (such as mmap'd ones) support this,
+ * NULL is returned if the bytes cannot be referenced; use nb_buffer_read then.
+ */
+nb_byte_t *nb_buffer_read_ref(struct nb_buffer *buf, size_t nbytes);
+
+/*
+ * Return the stream offset of the next byte to be read or written. Offsets
+ * of file buffers are file offsets.
+ */
+static inline size_t nb_buffer_tell(struct nb_buffer *buf)
+{
+	return buf->offset + buf->pos;
+}
+
 void nb_buffer_flush(struct nb_buffer *buf);
+void nb_buffer_rewind(struct nb_buffer *buf);
+nb_err_t nb_buffer_seek(struct nb_buffer *buf, size_t offset);
+nb_byte_t *nb_buffer_steal(struct nb_buffer *buf, size_t *len);
+void nb_buffer_fixed_reset(struct nb_buffer *buf, void *dst, size_t cap);
 
 int nb_buffer_getc(struct nb_buffer *buf);
 void nb_buffer_ungetc(struct nb_buffer *buf, int c);
 int nb_buffer_peek(struct nb_buffer *buf);
 
 size_t nb_buffer_get_written_total(struct nb_buffer *buf);
+nb_err_t nb_buffer_get_error(struct nb_buffer *buf);
+size_t nb_buffer_get_fills(struct nb_buffer *buf);
+size_t nb_buffer_get_flushes(struct nb_buffer *buf);
+size_t nb_buffer_get_size(struct nb_buffer *buf);
 
 #endif
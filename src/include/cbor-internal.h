@@ -2,9 +2,35 @@
 #define CBOR_INTERNAL_H
 
 #include "cbor.h"
+#include <endian.h>
 #include <stdbool.h>
 
 #define CBOR_BLOCK_STACK_INIT_SIZE	4
+#define CBOR_HDR_MAX_LEN		9	/* initial byte and 8-byte argument */
+
+/*
+ * Arrays of integers (see cbor_encode_uint32_array) are encoded and decoded
+ * in blocks of CBOR_ARRAY_BLOCK elements, which are held in a vector.
+ */
+#define CBOR_ARRAY_BLOCK		8
+#define CBOR_ARRAY_BLOCK_MAX_LEN	(CBOR_ARRAY_BLOCK * CBOR_HDR_MAX_LEN)
+
+typedef uint64_t cbor_block_t __attribute__((vector_size(CBOR_ARRAY_BLOCK * sizeof(uint64_t))));
+
+/*
+ * Return true if any element of the block is non-zero, such as in the result
+ * of a comparison of blocks. (Blocks are passed by reference, vectors this
+ * big are passed in AVX-512 registers if enabled, which changes the ABI.)
+ */
+static inline bool cbor_block_any(const cbor_block_t *block)
+{
+	uint64_t any = 0;
+	size_t i;
+
+	for (i = 0; i < CBOR_ARRAY_BLOCK; i++)
+		any |= (*block)[i];
+	return any != 0;
+}
 
 /*
  * CBOR Major Types
@@ -51,6 +77,29 @@ enum minor
 	CBOR_MINOR_BREAK = 31,
 };
 
+/*
+ * Typed arrays (RFC 8746)
+ */
+#define CBOR_TAG_TA_FIRST	64
+#define CBOR_TAG_TA_LAST	87
+#define CBOR_TA_LE		(1 << 2)	/* the e bit of the tag */
+#define CBOR_TAG_TA_UINT8_CLAMPED	68	/* bytes, meant to be clamped */
+#define CBOR_TA_HOST_LE		(__BYTE_ORDER == __LITTLE_ENDIAN)
+
+static inline size_t ta_size(enum cbor_ta_type type)
+{
+	return (type & 0x10 ? 2 : 1) << (type & 0x3);	/* floats start at 16 bits */
+}
+
+/*
+ * Return the tag of typed arrays of type with little-endian (le) or
+ * big-endian elements. Bytes have no byte order, their e bit is zero.
+ */
+static inline uint32_t ta_tag(enum cbor_ta_type type, bool le)
+{
+	return CBOR_TAG_TA_FIRST + type + (le && ta_size(type) > 1 ? CBOR_TA_LE : 0);
+}
+
 static inline bool major_allows_indefinite(enum major major)
 {
 	switch (major) {
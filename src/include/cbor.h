@@ -47,6 +47,24 @@ enum cbor_type
 
 const char *cbor_type_to_string(enum cbor_type type);
 
+/*
+ * Element types of typed arrays (see cbor_encode_typed_array). The values
+ * are the bits f, s and ll of the typed array tags (RFC 8746, section 2.1).
+ */
+enum cbor_ta_type
+{
+	CBOR_TA_UINT8 = 0x00,
+	CBOR_TA_UINT16 = 0x01,
+	CBOR_TA_UINT32 = 0x02,
+	CBOR_TA_UINT64 = 0x03,
+	CBOR_TA_INT8 = 0x08,
+	CBOR_TA_INT16 = 0x09,
+	CBOR_TA_INT32 = 0x0a,
+	CBOR_TA_INT64 = 0x0b,
+	CBOR_TA_FLOAT32 = 0x11,
+	CBOR_TA_FLOAT64 = 0x12,
+};
+
 struct cbor_pair;
 
 /*
@@ -125,6 +143,7 @@ struct cbor_stream
 };
 
 void cbor_stream_init(struct cbor_stream *cs, struct nb_buffer *buf);
+void cbor_stream_reset(struct cbor_stream *cs, struct nb_buffer *buf);
 void cbor_stream_free(struct cbor_stream *cs);
 
 void cbor_stream_set_diag(struct cbor_stream *cs, struct diag *diag);
@@ -188,6 +207,16 @@ static inline bool cbor_is_break(struct cbor_stream *cs)
  * Stream encoding and decoding of items.
  */
 
+/*
+ * Return the error of a write that stopped short: NB_ERR_OVERFLOW if a fixed
+ * buffer is full (see nb_buffer_new_fixed), NB_ERR_WRITE otherwise.
+ */
+static inline nb_err_t cbor_write_error(struct cbor_stream *cs)
+{
+	return nb_buffer_get_error(cs->buf) == NB_ERR_OVERFLOW ? NB_ERR_OVERFLOW : NB_ERR_WRITE;
+}
+
+
 nb_err_t cbor_encode_uint8(struct cbor_stream *cs, uint8_t val);
 nb_err_t cbor_encode_uint16(struct cbor_stream *cs, uint16_t val);
 nb_err_t cbor_encode_uint32_slow(struct cbor_stream *cs, uint32_t val);
@@ -202,7 +231,7 @@ static inline nb_err_t cbor_encode_uint32(struct cbor_stream *cs, uint32_t val)
 		top_block = stack_top(&cs->blocks);
 		top_block->num_items++;
 		hdr = (CBOR_TYPE_UINT << 5) + val;
-		return nb_buffer_write(cs->buf, &hdr, 1) == 1 ? NB_ERR_OK : NB_ERR_WRITE;
+		return nb_buffer_write(cs->buf, &hdr, 1) == 1 ? NB_ERR_OK : cbor_write_error(cs);
 	}
 	else {
 		return cbor_encode_uint32_slow(cs, val);
@@ -226,10 +255,10 @@ static inline nb_err_t cbor_encode_uint64(struct cbor_stream *cs, uint64_t val)
 		top_block = stack_top(&cs->blocks);
 		top_block->num_items++;
 		hdr = (CBOR_TYPE_UINT << 5) + val;
-		return nb_buffer_write(cs->buf, &hdr, 1) == 1 ? NB_ERR_OK : NB_ERR_WRITE;
+		return nb_buffer_write(cs->buf, &hdr, 1) == 1 ? NB_ERR_OK : cbor_write_error(cs);
 	}
 	else {
-		return cbor_encode_uint32_slow(cs, val);
+		return cbor_encode_uint64_slow(cs, val);
 	}
 }
 
@@ -300,6 +329,19 @@ void cbor_decode_sval(struct cbor_stream *cs, enum cbor_sval *val);
 nb_err_t cbor_encode_bool(struct cbor_stream *cs, bool b);
 void cbor_decode_bool(struct cbor_stream *cs, bool *b);
 
+/*
+ * Encode or decode the len items of an array of unsigned integers in bulk,
+ * the array itself is begun and ended by the caller.
+ */
+nb_err_t cbor_encode_uint8_array(struct cbor_stream *cs, const uint8_t *vals, size_t len);
+nb_err_t cbor_encode_uint16_array(struct cbor_stream *cs, const uint16_t *vals, size_t len);
+nb_err_t cbor_encode_uint32_array(struct cbor_stream *cs, const uint32_t *vals, size_t len);
+nb_err_t cbor_encode_uint64_array(struct cbor_stream *cs, const uint64_t *vals, size_t len);
+void cbor_decode_uint8_array(struct cbor_stream *cs, uint8_t *vals, size_t len);
+void cbor_decode_uint16_array(struct cbor_stream *cs, uint16_t *vals, size_t len);
+void cbor_decode_uint32_array(struct cbor_stream *cs, uint32_t *vals, size_t len);
+void cbor_decode_uint64_array(struct cbor_stream *cs, uint64_t *vals, size_t len);
+
 nb_err_t cbor_encode_array_begin(struct cbor_stream *cs, uint64_t len);
 nb_err_t cbor_encode_array_begin_indef(struct cbor_stream *cs);
 nb_err_t cbor_encode_array_end(struct cbor_stream *cs);
@@ -319,11 +361,26 @@ void cbor_decode_map_end(struct cbor_stream *cs);
 nb_err_t cbor_encode_bytes(struct cbor_stream *cs, nb_byte_t *bytes, size_t len);
 nb_err_t cbor_encode_bytes_begin_indef(struct cbor_stream *cs);
 nb_err_t cbor_encode_bytes_end(struct cbor_stream *cs);
+void cbor_decode_bytes(struct cbor_stream *cs, nb_byte_t **bytes, size_t *len);
+void cbor_decode_bytes_ref(struct cbor_stream *cs, const nb_byte_t **bytes, size_t *len);
 
 nb_err_t cbor_encode_text(struct cbor_stream *cs, char *str);
 nb_err_t cbor_encode_text_begin_indef(struct cbor_stream *cs);
 nb_err_t cbor_encode_text_end(struct cbor_stream *cs);
 void cbor_decode_text(struct cbor_stream *cs, char **str);
+void cbor_decode_text_ref(struct cbor_stream *cs, const char **str, size_t *len);
+
+/*
+ * Typed arrays (RFC 8746): nitems elements of the given type, sent as one
+ * tagged byte string in the host's byte order, aligned in the stream. The
+ * decoder accepts either byte order, and points into the buffer like
+ * cbor_decode_bytes_ref when the elements are in the host's byte order and
+ * aligned in memory.
+ */
+nb_err_t cbor_encode_typed_array(struct cbor_stream *cs, enum cbor_ta_type type,
+	const void *vals, size_t nitems);
+void cbor_decode_typed_array(struct cbor_stream *cs, enum cbor_ta_type type,
+	const void **vals, size_t *nitems);
 
 /*
  * DOM-oriented encoding and decoding of (generic) items.
@@ -0,0 +1,30 @@
+/*
+ * crc32c:
+ * CRC-32C (Castagnoli) Checksums
+ *
+ * The CRC instructions of SSE 4.2 or ARMv8 are used if the CPU has them,
+ * a table-driven implementation otherwise.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Update crc (0 initially) by len bytes of data. The checksum of
+ * concatenated data may be computed piece by piece.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/*
+ * Copy len bytes from src to dst, updating crc as crc32c does. The data are
+ * loaded only once.
+ */
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t len);
+
+bool crc32c_is_hw(void);
+
+#endif
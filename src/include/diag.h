@@ -101,6 +101,7 @@ struct diag
 struct cbor_stream;
 
 void diag_init(struct diag *diag, FILE *fout);
+void diag_reset(struct diag *diag, FILE *fout);
 void diag_free(struct diag *diag);
 
 const char *diag_get_sval_name(struct diag *diag, enum cbor_sval sval);
@@ -23,6 +23,9 @@ enum nb_err
 	NB_ERR_NITEMS,		/* invalid number of items */
 	NB_ERR_OPEN,		/* open()-related error */
 	NB_ERR_UNDEF_ID,	/* an ID was used prior to being defined */
+	NB_ERR_AGAIN,		/* the operation would block */
+	NB_ERR_CHECKSUM,	/* checksum mismatch */
+	NB_ERR_OVERFLOW,	/* no room left in a fixed buffer */
 	NB_ERR_OTHER,		/* other error occured */
 };
 
@@ -0,0 +1,28 @@
+/*
+ * lz:
+ * LZ77 Block Compression
+ *
+ * A block is compressed on its own, without any references to previous
+ * blocks, and it can be decompressed on its own as well.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include "common.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * The worst-case size of len bytes compressed.
+ */
+static inline size_t lz_compress_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+size_t lz_compress(const nb_byte_t *src, size_t len, nb_byte_t *dst);
+ssize_t lz_decompress(const nb_byte_t *src, size_t len, nb_byte_t *dst, size_t cap);
+
+#endif
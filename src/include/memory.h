@@ -18,13 +18,16 @@ typedef struct mempool *mempool_t; /* shan't be here */
 
 void *nb_malloc(size_t size);
 void *nb_realloc(void *ptr, size_t size);
+void *nb_malloc_aligned(size_t align, size_t size);
 void xfree(void *ptr);
+size_t nb_get_num_allocs(void);
 
 void *realloc_safe(void *ptr, size_t new_size);
 void *malloc_safe(size_t size);
 
 mempool_t mempool_new(size_t block_size);
 void mempool_delete(mempool_t pool);
+void mempool_reset(mempool_t pool);
 
 void *mempool_malloc(mempool_t pool, size_t size);
 void *mempool_realloc(mempool_t pool, void *mem, size_t size);
@@ -68,6 +68,7 @@ size_t nb_internal_recv_array_size(struct nb *nb);
 
 
 void nb_init(struct nb *nb, struct nb_buffer *buf);
+void nb_reset(struct nb *nb, struct nb_buffer *buf);
 void nb_free(struct nb *nb);
 
 void nb_bind(struct nb *nb, struct nb_group *group, nb_lid_t id, const char *name, bool reqd);
@@ -95,6 +96,11 @@ void nb_send_string(struct nb *nb, nb_lid_t id, char *str);
 void nb_send_array(struct nb *nb, nb_lid_t id, size_t nitems);
 void nb_send_array_end(struct nb *nb);
 
+void nb_send_u8_array(struct nb *nb, nb_lid_t id, const uint8_t *vals, size_t nitems);
+void nb_send_u16_array(struct nb *nb, nb_lid_t id, const uint16_t *vals, size_t nitems);
+void nb_send_u32_array(struct nb *nb, nb_lid_t id, const uint32_t *vals, size_t nitems);
+void nb_send_u64_array(struct nb *nb, nb_lid_t id, const uint64_t *vals, size_t nitems);
+
 void nb_recv_group(struct nb *nb, nb_lid_t id);
 nb_err_t nb_recv_group_end(struct nb *nb);
 
@@ -116,4 +122,10 @@ void nb_recv_string(struct nb *nb, char **str);
 /* nb_recv_array is a macro defined above */
 void nb_recv_array_end(struct nb *nb);
 
+/* receive whole arrays of integers into new arrays (see array.h) */
+void nb_recv_u8_array(struct nb *nb, uint8_t **arr);
+void nb_recv_u16_array(struct nb *nb, uint16_t **arr);
+void nb_recv_u32_array(struct nb *nb, uint32_t **arr);
+void nb_recv_u64_array(struct nb *nb, uint64_t **arr);
+
 #endif
@@ -0,0 +1,33 @@
+/*
+ * pool:
+ * Recycling of Buffers and NetBufs Contexts
+ *
+ * Sessions which come and go quickly spend much of their time allocating
+ * and freeing the same objects. A pool keeps the released ones and hands
+ * them out again after a cheap reset.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "buffer.h"
+#include "netbufs.h"
+
+#include <stddef.h>
+
+struct nb_pool;
+
+struct nb_pool *nb_pool_new(size_t max_idle);
+void nb_pool_delete(struct nb_pool *pool);
+
+struct nb *nb_pool_acquire(struct nb_pool *pool, struct nb_buffer *buf);
+void nb_pool_release(struct nb_pool *pool, struct nb *nb);
+
+struct nb_buffer *nb_pool_acquire_file(struct nb_pool *pool, int fd);
+struct nb_buffer *nb_pool_acquire_memory(struct nb_pool *pool);
+void nb_pool_release_buffer(struct nb_pool *pool, struct nb_buffer *buf);
+
+size_t nb_pool_get_reused(struct nb_pool *pool);
+size_t nb_pool_get_saved(struct nb_pool *pool);
+
+#endif
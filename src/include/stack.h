@@ -29,6 +29,7 @@ static inline void *stack_top(struct stack *stack)
 bool stack_init(struct stack *stack, size_t init_stack_size, size_t item_size);
 void *stack_push(struct stack *stack);
 void *stack_pop(struct stack *stack);
+void stack_reset(struct stack *stack);
 bool stack_is_empty(struct stack *stack);
 void stack_free(struct stack *stack);
 
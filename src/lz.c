@@ -0,0 +1,249 @@
+/*
+ * lz:
+ * LZ77 Block Compression
+ *
+ * The compressed block is a series of sequences, each of them consisting of
+ * a token, literals copied verbatim, and a match, i.e. a reference to data
+ * decompressed earlier:
+ *
+ *   token         literal length (high nibble), match length - 4 (low nibble)
+ *   [length]      if the literal length nibble is 15: 255, ..., 255, rest
+ *   literals
+ *   offset        distance of the match, 2 bytes little-endian
+ *   [length]      if the match length nibble is 15: 255, ..., 255, rest
+ *
+ * The last sequence has no match, the block ends right after its literals.
+ *
+ * Matches are found using a hash table of the most recent positions of all
+ * 4-byte sequences, so the compression is fast rather than strong. The
+ * decompressor checks all lengths and offsets, corrupt blocks are refused.
+ */
+
+#include "lz.h"
+#include "util.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS	12
+#define MIN_MATCH	4
+#define MAX_OFFSET	UINT16_MAX
+#define SKIP_TRIGGER	6	/* search faster after 2^SKIP_TRIGGER misses */
+#define NIBBLE_MAX	15
+
+
+static inline uint32_t load32(const nb_byte_t *p)
+{
+	uint32_t val;
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+
+static inline uint64_t load64le(const nb_byte_t *p)
+{
+	uint64_t val;
+	memcpy(&val, p, sizeof(val));
+	return le64toh(val);
+}
+
+
+static inline uint32_t hash(uint32_t seq)
+{
+	return (seq * 2654435761U) >> (32 - HASH_BITS);
+}
+
+
+/*
+ * Count the bytes at ip which are repeated at match, up to end.
+ */
+static inline size_t count_match(const nb_byte_t *ip, const nb_byte_t *match,
+	const nb_byte_t *end)
+{
+	const nb_byte_t *start = ip;
+	uint64_t diff;
+
+	while (ip + 8 <= end) {
+		if ((diff = load64le(ip) ^ load64le(match)))
+			return (ip - start) + (__builtin_ctzll(diff) >> 3);
+		ip += 8;
+		match += 8;
+	}
+
+	while (ip < end && *ip == *match) {
+		ip++;
+		match++;
+	}
+
+	return ip - start;
+}
+
+
+static inline nb_byte_t *put_length(nb_byte_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (nb_byte_t)len;
+	return op;
+}
+
+
+/*
+ * Emit a sequence. A match_len of 0 stands for the last sequence.
+ */
+static nb_byte_t *put_sequence(nb_byte_t *op, const nb_byte_t *literals, size_t lit_len,
+	size_t offset, size_t match_len)
+{
+	nb_byte_t *token = op++;
+	size_t len;
+
+	*token = (nb_byte_t)(MIN(lit_len, NIBBLE_MAX) << 4);
+	if (lit_len >= NIBBLE_MAX)
+		op = put_length(op, lit_len - NIBBLE_MAX);
+
+	memcpy(op, literals, lit_len);
+	op += lit_len;
+
+	if (match_len == 0)
+		return op;
+
+	*op++ = (nb_byte_t)offset;
+	*op++ = (nb_byte_t)(offset >> 8);
+
+	len = match_len - MIN_MATCH;
+	*token |= (nb_byte_t)MIN(len, NIBBLE_MAX);
+	if (len >= NIBBLE_MAX)
+		op = put_length(op, len - NIBBLE_MAX);
+
+	return op;
+}
+
+
+/*
+ * Compress len bytes at src into dst, which has to have room for
+ * lz_compress_bound(len) bytes. Returns the length of the compressed block.
+ */
+size_t lz_compress(const nb_byte_t *src, size_t len, nb_byte_t *dst)
+{
+	uint32_t table[1 << HASH_BITS];
+	const nb_byte_t *end = src + len;
+	const nb_byte_t *anchor = src;
+	const nb_byte_t *ip = src;
+	const nb_byte_t *match;
+	nb_byte_t *op = dst;
+	size_t misses = 0;
+	size_t match_len;
+	uint32_t seq;
+	uint32_t h;
+
+	assert(len <= UINT32_MAX);
+	memset(table, 0, sizeof(table));
+
+	while (ip + MIN_MATCH <= end) {
+		seq = load32(ip);
+		h = hash(seq);
+		match = src + table[h];
+		table[h] = (uint32_t)(ip - src);
+
+		if (match >= ip || ip - match > MAX_OFFSET || load32(match) != seq) {
+			/* skip incompressible data quickly */
+			ip += 1 + (misses++ >> SKIP_TRIGGER);
+			continue;
+		}
+
+		match_len = MIN_MATCH + count_match(ip + MIN_MATCH, match + MIN_MATCH, end);
+		op = put_sequence(op, anchor, ip - anchor, ip - match, match_len);
+
+		ip += match_len;
+		anchor = ip;
+		misses = 0;
+	}
+
+	op = put_sequence(op, anchor, end - anchor, 0, 0);
+
+	assert((size_t)(op - dst) <= lz_compress_bound(len));
+	return op - dst;
+}
+
+
+/*
+ * Read an extended length, returns false if the block ends prematurely.
+ */
+static inline bool get_length(const nb_byte_t **ip, const nb_byte_t *end, size_t *len)
+{
+	nb_byte_t byte;
+
+	do {
+		if (*ip == end)
+			return false;
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+
+	return true;
+}
+
+
+/*
+ * Decompress the block of len bytes at src into dst of cap bytes. Returns
+ * the length of the decompressed data, or -1 if the block is corrupt or
+ * the data do not fit.
+ */
+ssize_t lz_decompress(const nb_byte_t *src, size_t len, nb_byte_t *dst, size_t cap)
+{
+	const nb_byte_t *ip = src;
+	const nb_byte_t *end = src + len;
+	nb_byte_t *op = dst;
+	nb_byte_t *op_end = dst + cap;
+	const nb_byte_t *from;
+	nb_byte_t token;
+	size_t lit_len;
+	size_t match_len;
+	size_t offset;
+	size_t i;
+
+	while (ip < end) {
+		token = *ip++;
+
+		lit_len = token >> 4;
+		if (lit_len == NIBBLE_MAX && !get_length(&ip, end, &lit_len))
+			return -1;
+		if (lit_len > (size_t)(end - ip) || lit_len > (size_t)(op_end - op))
+			return -1;
+
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		if (ip == end)
+			break; /* the last sequence */
+
+		if (end - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		match_len = token & NIBBLE_MAX;
+		if (match_len == NIBBLE_MAX && !get_length(&ip, end, &match_len))
+			return -1;
+		match_len += MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t)(op - dst) || match_len > (size_t)(op_end - op))
+			return -1;
+
+		if (offset >= match_len) {
+			memcpy(op, op - offset, match_len);
+		}
+		else {
+			/* the match overlaps the data being produced */
+			for (from = op - offset, i = 0; i < match_len; i++)
+				op[i] = from[i];
+		}
+		op += match_len;
+	}
+
+	return op - dst;
+}
@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+static _Thread_local size_t num_allocs;	/* allocator calls of this thread */
+
 
 void *nb_malloc(size_t size)
 {
@@ -20,6 +22,7 @@ void *nb_malloc(size_t size)
 
 void *nb_realloc(void *ptr, size_t size)
 {
+	num_allocs++;
 	ptr = realloc(ptr, size);
 	if (!ptr) {
 		assert(false);
@@ -30,6 +33,36 @@ void *nb_realloc(void *ptr, size_t size)
 }
 
 
+/*
+ * Allocate memory aligned to align bytes (a power of two). The memory is
+ * freed using xfree.
+ */
+void *nb_malloc_aligned(size_t align, size_t size)
+{
+	void *ptr;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+
+	num_allocs++;
+	if (posix_memalign(&ptr, align, size) != 0) {
+		assert(false);
+		nb_die("Cannot allocate %zu bytes of aligned memory.\n", size);
+	}
+
+	return ptr;
+}
+
+
+/*
+ * Return the number of (re)allocations the calling thread has made so far.
+ */
+size_t nb_get_num_allocs(void)
+{
+	return num_allocs;
+}
+
+
 void xfree(void *ptr)
 {
 	free(ptr);
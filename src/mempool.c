@@ -11,6 +11,7 @@
 #include "memory.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -51,12 +52,15 @@ static void mempool_init_chain(struct mempool_chain *chain)
 }
 
 
-static void mempool_free_chain(struct mempool_chain *chain)
+/*
+ * Free all blocks of the chain, except for the first one if keep_first is set.
+ */
+static void mempool_trim_chain(struct mempool_chain *chain, bool keep_first)
 {
 	struct mempool_block *block;
 	void *mem;
 
-	while (chain->last) {
+	while (chain->last && (!keep_first || chain->last->prev)) {
 		block = chain->last;
 		chain->last = chain->last->prev;
 		
@@ -70,14 +74,20 @@ static void mempool_free_chain(struct mempool_chain *chain)
 }
 
 
-struct mempool_block *mempool_new_block(struct mempool_chain *chain, size_t size)
+static void mempool_free_chain(struct mempool_chain *chain)
 {
-	// TODO Alignment
+	mempool_trim_chain(chain, false);
+}
 
+
+struct mempool_block *mempool_new_block(struct mempool_chain *chain, size_t size)
+{
 	struct mempool_block *new_block;
 	size_t alloc_size;
 	void *mem;
 
+	/* the block trailer follows the memory of the block, keep it aligned */
+	size = (size + _Alignof(struct mempool_block) - 1) & ~(_Alignof(struct mempool_block) - 1);
 	alloc_size = size + sizeof(*new_block);
 	
 	mem = nb_malloc(alloc_size);
@@ -198,6 +208,29 @@ void mempool_delete(struct mempool *pool)
 }
 
 
+/*
+ * Free all objects allocated from the pool at once. The first block, which
+ * holds the pool itself, is kept for the objects to come.
+ */
+void mempool_reset(struct mempool *pool)
+{
+	struct mempool_chain *home = &pool->small;
+	struct mempool_block *first;
+
+	/* mempool_new has put the pool at the start of the first block of a chain */
+	mempool_trim_chain(&pool->small, true);
+	first = pool->small.last;
+	if (!first || (unsigned char *)pool != (unsigned char *)first - first->size)
+		home = &pool->big;
+
+	mempool_trim_chain(&pool->small, home == &pool->small);
+	mempool_trim_chain(&pool->big, home == &pool->big);
+	pool->small.last_free = 0;
+	pool->big.last_free = 0;
+	home->last_free = home->last->size - sizeof(*pool);
+}
+
+
 static void print_chain_stats(struct mempool_chain *chain)
 {
 	printf("%lu blocks, %lu B total\n", chain->num_blocks, chain->total_size);
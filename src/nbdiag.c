@@ -7,6 +7,8 @@
  * TODO String and bytestream trimming, dynamic col widths.
  */
 
+#define _GNU_SOURCE	/* splice, tee */
+
 #include "buffer.h"
 #include "cbor.h"
 #include "common.h"
@@ -19,6 +21,10 @@
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +33,9 @@
 
 #define EXIT_DATA_ERROR	2
 
+#define TAP_CHUNK	(64 * 1024)
+#define TAP_PIPE_SIZE	(1024 * 1024)	/* absorbs bursts the decoder lags behind */
+
 
 static const char *argv0;
 static const char *optstring = "01234b:i:I:emo:t:Jh";
@@ -36,14 +45,26 @@ static char *fname_out = "-";
 int fd_in;
 int fd_out;
 static struct nb_buffer *buf_in;
-static struct nb_buffer *buf_out;
 static struct cbor_stream cbor_in;
-static struct cbor_stream cbor_out;
 
 bool cols_given;
 static struct diag diag;
 bool mirror;
 
+enum tap_status
+{
+	TAP_OK,
+	TAP_UNSUPPORTED,	/* splice() can't be used, nothing has been moved */
+	TAP_ERROR,
+};
+
+static int diag_pipe[2];		/* carries the copy of the stream to the decoder */
+static enum tap_status tap_status;
+static int tap_errno;
+static bool tap_live;			/* is the input a live feed? */
+static bool tap_detached;		/* has the decoder been left behind? */
+static jmp_buf tap_decode_error;
+
 
 static struct option longopts[] = {
 	{ "escape",		no_argument,		0,	'e' },
@@ -66,7 +87,8 @@ static void usage(int status)
 	fprintf(stderr, "With no FILE or when FILE is -, read stdin. Default columns are -04.\n\n");
 
 	fprintf(stderr, "Mode switch:\n");
-	fprintf(stderr, "  -m, --mirror    Mirror the CBOR stream (pass-through)\n");
+	fprintf(stderr, "  -m, --mirror    Mirror the CBOR stream (pass-through), print diagnostics\n");
+	fprintf(stderr, "                  to stderr\n");
 	fprintf(stderr, "  -J, --json      Print JSON instead of CBOR Diagnostic Notation\n\n");
 
 	fprintf(stderr, "Column selection options:\n");
@@ -100,6 +122,13 @@ static void cbor_err_handler(struct cbor_stream *cs, nb_err_t err, void *arg)
 }
 
 
+static void tap_err_handler(struct cbor_stream *cs, nb_err_t err, void *arg)
+{
+	/* reported once the tap has finished (see mirror_stream) */
+	longjmp(tap_decode_error, 1);
+}
+
+
 static long long argtoll(const char *arg, const char *argname)
 {
 	char *end;
@@ -192,15 +221,291 @@ static void parse_args(int argc, char *argv[])
 }
 
 
-static void mirror_stream(void)
+static bool write_all(int fd, const nb_byte_t *bytes, size_t len)
 {
-	struct cbor_item item;
-	nb_err_t err;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, bytes, len);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return false;
+		bytes += ret;
+		len -= ret;
+	}
 
-	while (!nb_buffer_is_eof(buf_in)) {
-		cbor_decode_item(&cbor_in, &item);
-		cbor_encode_item(&cbor_out, &item);
+	return true;
+}
+
+
+/*
+ * Move len bytes from the pipe src to fd.
+ */
+static bool splice_all(int src, int fd, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = splice(src, NULL, fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		len -= ret;
 	}
+
+	return true;
+}
+
+
+/*
+ * Stop feeding the decoder, either because it has given up or because it
+ * has fallen a whole diag pipe behind a live feed.
+ */
+static void detach_decoder(int *diag_fd)
+{
+	tap_detached = (errno == EAGAIN);
+	close(*diag_fd);
+	*diag_fd = -1;
+}
+
+
+static bool wait_readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	while (poll(&pfd, 1, -1) == -1)
+		if (errno != EINTR)
+			return false;
+	return true;
+}
+
+
+static bool is_pipe(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+
+static bool is_pipe_or_socket(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode));
+}
+
+
+/*
+ * Pass the input through to the output without copying it to user space.
+ * tee() duplicates the data queued in a pipe into the diag pipe without
+ * consuming them, then the same amount is spliced to the output. Input
+ * which is not a pipe is spliced into an intermediate pipe first.
+ *
+ * A live feed never waits for the decoder: tee() doesn't block on a full
+ * diag pipe then, and the decoder is detached instead.
+ *
+ * *diag_fd is closed and set to -1 when the decoder is detached.
+ */
+static enum tap_status tap_splice(int *diag_fd)
+{
+	enum tap_status status = TAP_OK;
+	int via[2] = { -1, -1 };
+	int src = fd_in;
+	size_t queued = 0;	/* bytes waiting in via */
+	bool started = false;
+	ssize_t ret;
+
+	if (!is_pipe_or_socket(fd_out))
+		return TAP_UNSUPPORTED;
+
+	if (!is_pipe(fd_in)) {
+		if (pipe(via) == -1)
+			return TAP_UNSUPPORTED;
+		src = via[0];
+	}
+
+	for (;;) {
+		if (src != fd_in && queued == 0) {
+			ret = splice(fd_in, NULL, via[1], NULL, TAP_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret == -1 && errno == EINVAL && !started) {
+				status = TAP_UNSUPPORTED;	/* e.g. a terminal */
+				break;
+			}
+			if (ret <= 0) {
+				status = (ret == 0) ? TAP_OK : TAP_ERROR;
+				break;
+			}
+			queued = ret;
+		}
+		started = true;
+
+		if (*diag_fd == -1) {
+			/* nobody's listening, just pass the data through */
+			ret = splice(src, NULL, fd_out, NULL, queued ? queued : TAP_CHUNK,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		}
+		else {
+			/* with SPLICE_F_NONBLOCK, EAGAIN must only come from the diag pipe */
+			if (tap_live && !queued && !wait_readable(src))
+				ret = -1;
+			else
+				ret = tee(src, *diag_fd, queued ? queued : TAP_CHUNK,
+					tap_live ? SPLICE_F_NONBLOCK : 0);
+			if (ret == -1 && (errno == EPIPE || errno == EAGAIN)) {
+				detach_decoder(diag_fd);
+				continue;
+			}
+			if (ret > 0 && !splice_all(src, fd_out, ret))
+				ret = -1;
+		}
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			status = (ret == 0) ? TAP_OK : TAP_ERROR;
+			break;
+		}
+		if (queued)
+			queued -= ret;
+	}
+
+	if (status == TAP_ERROR)
+		tap_errno = errno;
+	if (src != fd_in) {
+		close(via[0]);
+		close(via[1]);
+	}
+
+	return status;
+}
+
+
+/*
+ * Pass the input through to the output by read() and write().
+ */
+static enum tap_status tap_copy(int *diag_fd)
+{
+	static nb_byte_t chunk[TAP_CHUNK];
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(fd_in, chunk, sizeof(chunk));
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		if (!write_all(fd_out, chunk, ret))
+			break;
+
+		if (*diag_fd != -1 && !write_all(*diag_fd, chunk, ret))
+			detach_decoder(diag_fd);
+	}
+
+	if (ret != 0) {
+		tap_errno = errno;
+		return TAP_ERROR;
+	}
+	return TAP_OK;
+}
+
+
+static void *tap_thread(void *arg)
+{
+	int diag_fd = diag_pipe[1];
+
+	(void) arg;
+
+	tap_status = tap_splice(&diag_fd);
+	if (tap_status == TAP_UNSUPPORTED)
+		tap_status = tap_copy(&diag_fd);
+
+	/* EOF for the consumer, even if the decoder is still catching up */
+	close(fd_out);
+
+	/* EOF for the decoder */
+	if (diag_fd != -1)
+		close(diag_fd);
+
+	return NULL;
+}
+
+
+/*
+ * Mirror the stream: a thread passes the raw bytes through to the output
+ * (see tap_splice) and the decoder prints diagnostics of a copy of them.
+ * When tapping a live feed, the decoder may lag behind by the size of the
+ * diag pipe, otherwise it's detached and only the data pass through.
+ */
+static int mirror_stream(void)
+{
+	int status = EXIT_SUCCESS;
+	volatile bool decoded = false;
+	pthread_t thread;
+
+	signal(SIGPIPE, SIG_IGN);
+	diag.fout = stderr;
+
+	if (pipe(diag_pipe) == -1) {
+		fprintf(stderr, "%s: cannot create pipe: %s\n", argv0, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	(void) fcntl(diag_pipe[1], F_SETPIPE_SZ, TAP_PIPE_SIZE);
+
+	/* a file can wait until the decoder catches up */
+	tap_live = is_pipe_or_socket(fd_in);
+	if (tap_live)
+		fcntl(diag_pipe[1], F_SETFL, O_NONBLOCK);
+
+	if (pthread_create(&thread, NULL, tap_thread, NULL) != 0) {
+		fprintf(stderr, "%s: cannot create thread\n", argv0);
+		exit(EXIT_FAILURE);
+	}
+
+	buf_in = nb_buffer_new_file(diag_pipe[0]);
+	cbor_stream_init(&cbor_in, buf_in);
+	cbor_stream_set_diag(&cbor_in, &diag);
+	cbor_stream_set_error_handler(&cbor_in, tap_err_handler, &diag);
+
+	if (setjmp(tap_decode_error) == 0) {
+		diag_dump_cbor_stream(&diag, &cbor_in);
+		decoded = true;
+	}
+
+	/* the data keep passing through even if the decoder has given up */
+	close(diag_pipe[0]);
+	pthread_join(thread, NULL);
+
+	if (tap_detached) {
+		fprintf(stderr, "\n%s: warning: the decoder has fallen behind, "
+			"diagnostics stopped\n", argv0);
+	}
+	else if (!decoded) {
+		fprintf(stderr, "\n%s: error while decoding CBOR stream: %s\n", argv0,
+			cbor_stream_strerror(&cbor_in));
+		status = EXIT_DATA_ERROR;
+	}
+	else if (!cbor_block_stack_empty(&cbor_in)) {
+		fprintf(stderr, "%s: warning: some blocks are still open after EOF\n", argv0);
+		status = EXIT_DATA_ERROR;
+	}
+
+	cbor_stream_free(&cbor_in);
+	nb_buffer_delete(buf_in);
+	diag_free(&diag);
+
+	if (tap_status == TAP_ERROR) {
+		fprintf(stderr, "%s: cannot pass the stream through: %s\n", argv0,
+			strerror(tap_errno));
+		status = EXIT_FAILURE;
+	}
+
+	return status;
 }
 
 
@@ -223,7 +528,6 @@ int main(int argc, char *argv[])
 	else {
 		fd_in = STDIN_FILENO;
 	}
-	buf_in = nb_buffer_new_file(fd_in);
 
 	if (fname_out && strcmp(fname_out, "-") != 0) {
 		if ((fd_out = open(fname_out, O_WRONLY, 0)) == -1) {
@@ -235,30 +539,24 @@ int main(int argc, char *argv[])
 	else {
 		fd_out = STDOUT_FILENO;
 	}
-	buf_out = nb_buffer_new_file(fd_out);
 
-	cbor_stream_init(&cbor_in, buf_in);
-	cbor_stream_init(&cbor_out, buf_out);
-
-	if (!mirror) {
-		cbor_stream_set_diag(&cbor_in, &diag);
-		cbor_stream_set_error_handler(&cbor_in, cbor_err_handler, &diag);
-		diag_dump_cbor_stream(&diag, &cbor_in);
-		diag_free(&diag);
+	if (mirror)
+		return mirror_stream();
 
-		if (!cbor_block_stack_empty(&cbor_in)) {
-			fprintf(stderr, "%s: warning: some blocks are still open after EOF\n", argv0);
-			return 2;
-		}
-	}
-	else {
-		mirror_stream();
+	buf_in = nb_buffer_new_mmap(fd_in);
+	cbor_stream_init(&cbor_in, buf_in);
+	cbor_stream_set_diag(&cbor_in, &diag);
+	cbor_stream_set_error_handler(&cbor_in, cbor_err_handler, &diag);
+	diag_dump_cbor_stream(&diag, &cbor_in);
+	diag_free(&diag);
+
+	if (!cbor_block_stack_empty(&cbor_in)) {
+		fprintf(stderr, "%s: warning: some blocks are still open after EOF\n", argv0);
+		return 2;
 	}
 
 	cbor_stream_free(&cbor_in);
-	cbor_stream_free(&cbor_out);
 	nb_buffer_delete(buf_in);
-	nb_buffer_delete(buf_out);
 
 	return EXIT_SUCCESS;
 }
@@ -24,6 +24,35 @@ static void init_group(struct nb *nb, struct nb_group *group, const char *name)
 }
 
 
+static void free_group(struct nb_group *group)
+{
+	array_delete(group->attrs);
+	array_delete(group->pid_to_lid);
+}
+
+
+static void reset_group(struct nb_group *group)
+{
+	array_reset(group->attrs);
+	array_reset(group->pid_to_lid);
+	group->max_pid = 1;
+	group->pid_to_lid[0] = 0;
+}
+
+
+/*
+ * Free the groups defined using nb_group. Their structs live in the mempool.
+ */
+static void free_groups(struct nb *nb)
+{
+	size_t i;
+
+	for (i = 0; i < array_size(nb->groups); i++)
+		if (nb->groups[i])
+			free_group(nb->groups[i]);
+}
+
+
 static void handle_cbor_error(struct cbor_stream *cs, nb_err_t err, void *arg)
 {
 	struct nb *nb = (struct nb *)arg;
@@ -38,6 +67,17 @@ static void handle_cbor_error(struct cbor_stream *cs, nb_err_t err, void *arg)
 }
 
 
+static void setup_diag(struct nb *nb)
+{
+	/* TODO clean-up */
+	diag_enable_col(&nb->diag, DIAG_COL_RAW);
+	diag_enable_col(&nb->diag, DIAG_COL_ITEMS);
+	diag_enable_col(&nb->diag, DIAG_COL_CBOR);
+	diag_enable_col(&nb->diag, DIAG_COL_PROTO);
+	nb->diag.enabled = true;
+}
+
+
 void nb_init(struct nb *nb, struct nb_buffer *buf)
 {
 	nb->mempool = mempool_new(NB_MEMPOOL_BLOCK_SIZE);
@@ -45,13 +85,8 @@ void nb_init(struct nb *nb, struct nb_buffer *buf)
 	cbor_stream_init(&nb->cs, buf);
 	cbor_stream_set_error_handler(&nb->cs, handle_cbor_error, nb);
 
-	/* TODO clean-up */
 	diag_init(&nb->diag, stderr);
-	diag_enable_col(&nb->diag, DIAG_COL_RAW);
-	diag_enable_col(&nb->diag, DIAG_COL_ITEMS);
-	diag_enable_col(&nb->diag, DIAG_COL_CBOR);
-	diag_enable_col(&nb->diag, DIAG_COL_PROTO);
-	nb->diag.enabled = true;
+	setup_diag(nb);
 
 	nb->active_group = NULL;
 	cbor_stream_set_diag(&nb->cs, &nb->diag);
@@ -66,9 +101,41 @@ void nb_init(struct nb *nb, struct nb_buffer *buf)
 }
 
 
+/*
+ * Prepare the context for a new session on buf. The result is the same as
+ * if the context was free'd and initialized again, but the memory of the
+ * previous session is reused (see nb_pool_acquire).
+ */
+void nb_reset(struct nb *nb, struct nb_buffer *buf)
+{
+	free_groups(nb);
+	array_reset(nb->groups);
+	mempool_reset(nb->mempool);
+
+	cbor_stream_reset(&nb->cs, buf);
+	cbor_stream_set_error_handler(&nb->cs, handle_cbor_error, nb);
+
+	diag_reset(&nb->diag, stderr);
+	setup_diag(nb);
+
+	nb->active_group = NULL;
+	cbor_stream_set_diag(&nb->cs, &nb->diag);
+
+	reset_group(&nb->groups_ns);
+	strbuf_reset(&nb->err_msg);
+	nb->err = NB_ERR_OK;
+	nb->err_handler = nb_default_err_handler;
+	nb->err_arg = NULL;
+}
+
+
 void nb_free(struct nb *nb)
 {
 	cbor_stream_free(&nb->cs);
+	diag_free(&nb->diag);
+	free_group(&nb->groups_ns);
+	free_groups(nb);
+	strbuf_free(&nb->err_msg);
 	array_delete(nb->groups);
 	mempool_delete(nb->mempool);
 }
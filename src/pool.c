@@ -0,0 +1,233 @@
+/*
+ * pool:
+ * Recycling of Buffers and NetBufs Contexts
+ *
+ * Every kind of object has its own stack of idle objects, so that the most
+ * recently released (and likely cached) one is handed out first. A stack
+ * holds at most max_idle objects, the surplus ones are free'd on release.
+ *
+ * Released buffers keep their window, including its size and options.
+ * Other buffer types than file and memory buffers are not recycled.
+ *
+ * The pool is not thread-safe.
+ */
+
+#include "buffer-internal.h"
+#include "buffer.h"
+#include "memory.h"
+#include "netbufs.h"
+#include "pool.h"
+#include "util.h"
+
+#include <assert.h>
+
+extern const struct nb_buffer_ops file_ops;
+extern const struct nb_buffer_ops mem_ops;
+
+struct idle_stack
+{
+	void **objs;		/* the idle objects */
+	size_t num_objs;	/* number of objects in objs */
+	size_t allocs;		/* allocations made to create the last new object */
+};
+
+struct nb_pool
+{
+	size_t max_idle;		/* maximum number of idle objects of each kind */
+	struct idle_stack nbs;		/* idle contexts */
+	struct idle_stack file_bufs;	/* idle file buffers */
+	struct idle_stack mem_bufs;	/* idle memory buffers */
+	size_t reused;			/* number of objects handed out again */
+	size_t saved;			/* number of allocations avoided */
+};
+
+
+static void idle_init(struct idle_stack *stack, size_t max_idle)
+{
+	stack->objs = nb_malloc(MAX(max_idle, 1) * sizeof(*stack->objs));
+	stack->num_objs = 0;
+	stack->allocs = 0;
+}
+
+
+static void *idle_pop(struct nb_pool *pool, struct idle_stack *stack)
+{
+	if (stack->num_objs == 0)
+		return NULL;
+
+	pool->reused++;
+	pool->saved += stack->allocs;
+	return stack->objs[--stack->num_objs];
+}
+
+
+static bool idle_push(struct nb_pool *pool, struct idle_stack *stack, void *obj)
+{
+	if (stack->num_objs == pool->max_idle)
+		return false;
+
+	stack->objs[stack->num_objs++] = obj;
+	return true;
+}
+
+
+/*
+ * Create a pool which keeps up to max_idle objects of each kind.
+ */
+struct nb_pool *nb_pool_new(size_t max_idle)
+{
+	struct nb_pool *pool;
+
+	pool = nb_malloc(sizeof(*pool));
+	pool->max_idle = max_idle;
+	pool->reused = 0;
+	pool->saved = 0;
+
+	idle_init(&pool->nbs, max_idle);
+	idle_init(&pool->file_bufs, max_idle);
+	idle_init(&pool->mem_bufs, max_idle);
+
+	return pool;
+}
+
+
+static void free_nb(struct nb *nb)
+{
+	nb_free(nb);
+	xfree(nb);
+}
+
+
+void nb_pool_delete(struct nb_pool *pool)
+{
+	size_t i;
+
+	for (i = 0; i < pool->nbs.num_objs; i++)
+		free_nb(pool->nbs.objs[i]);
+	for (i = 0; i < pool->file_bufs.num_objs; i++)
+		nb_buffer_delete(pool->file_bufs.objs[i]);
+	for (i = 0; i < pool->mem_bufs.num_objs; i++)
+		nb_buffer_delete(pool->mem_bufs.objs[i]);
+
+	xfree(pool->nbs.objs);
+	xfree(pool->file_bufs.objs);
+	xfree(pool->mem_bufs.objs);
+	xfree(pool);
+}
+
+
+/*
+ * Get a context for a new session on buf, as if it was set up by nb_init.
+ * Release it using nb_pool_release instead of calling nb_free.
+ */
+struct nb *nb_pool_acquire(struct nb_pool *pool, struct nb_buffer *buf)
+{
+	struct nb *nb;
+	size_t allocs;
+
+	if ((nb = idle_pop(pool, &pool->nbs))) {
+		nb_reset(nb, buf);
+	}
+	else {
+		allocs = nb_get_num_allocs();
+		nb = nb_malloc(sizeof(*nb));
+		nb_init(nb, buf);
+		pool->nbs.allocs = nb_get_num_allocs() - allocs;
+	}
+
+	return nb;
+}
+
+
+/*
+ * Return the context to the pool. The buffer is left to the caller.
+ */
+void nb_pool_release(struct nb_pool *pool, struct nb *nb)
+{
+	if (!idle_push(pool, &pool->nbs, nb))
+		free_nb(nb);
+}
+
+
+/*
+ * Get a file buffer for fd, as if it was created by nb_buffer_new_file.
+ */
+struct nb_buffer *nb_pool_acquire_file(struct nb_pool *pool, int fd)
+{
+	struct nb_buffer *buf;
+	size_t allocs;
+
+	if (!(buf = idle_pop(pool, &pool->file_bufs))) {
+		allocs = nb_get_num_allocs();
+		buf = nb_buffer_new_file(fd);
+		pool->file_bufs.allocs = nb_get_num_allocs() - allocs;
+		return buf;
+	}
+
+	nb_buffer_file_set_fd(buf, fd);
+	return buf;
+}
+
+
+/*
+ * Get an empty memory buffer, as if it was created by nb_buffer_new_memory.
+ */
+struct nb_buffer *nb_pool_acquire_memory(struct nb_pool *pool)
+{
+	struct nb_buffer *buf;
+	size_t allocs;
+
+	if (!(buf = idle_pop(pool, &pool->mem_bufs))) {
+		allocs = nb_get_num_allocs();
+		buf = nb_buffer_new_memory();
+		pool->mem_bufs.allocs = nb_get_num_allocs() - allocs;
+	}
+
+	return buf;
+}
+
+
+/*
+ * Return the buffer to the pool. Pending data are flushed first, like in
+ * nb_buffer_delete. Buffers which cannot be recycled are deleted.
+ */
+void nb_pool_release_buffer(struct nb_pool *pool, struct nb_buffer *buf)
+{
+	struct idle_stack *stack;
+
+	if (buf->ops == &file_ops)
+		stack = &pool->file_bufs;
+	else if (buf->ops == &mem_ops)
+		stack = &pool->mem_bufs;
+	else
+		stack = NULL;
+
+	if (!stack || stack->num_objs == pool->max_idle) {
+		nb_buffer_delete(buf);
+		return;
+	}
+
+	if (buf->mode == BUF_MODE_WRITING)
+		nb_buffer_flush_final(buf);
+	nb_buffer_reset(buf);
+
+	idle_push(pool, stack, buf);
+}
+
+
+/*
+ * Return the number of objects handed out again instead of being created.
+ */
+size_t nb_pool_get_reused(struct nb_pool *pool)
+{
+	return pool->reused;
+}
+
+
+/*
+ * Return the number of allocations the pool has saved.
+ */
+size_t nb_pool_get_saved(struct nb_pool *pool)
+{
+	return pool->saved;
+}
@@ -47,6 +47,7 @@ static void recv_keys(struct nb *nb, struct nb_group *group)
 			found = true;
 			break;
 		}
+	xfree(name);
 
 	TEMP_ASSERT(found); /* TODO allow usage of unknown groups! */
 	group->pid_to_lid[pid] = lid;
@@ -233,3 +234,44 @@ void nb_recv_array_end(struct nb *nb)
 	diag_dedent_proto(&nb->diag);
 	diag_log_proto(&nb->diag, "] /* %s */", attr->name);
 }
+
+
+/*
+ * Arrays are decoded in bulk, unless diagnostics are on: then each item is
+ * logged as it is received.
+ */
+#define RECV_ARRAY(nb, arr, recv_item, decode_array) \
+	do { \
+		size_t i; \
+		nb_recv_array(nb, arr); \
+		if (DIAG_ENABLE && (nb)->diag.enabled) \
+			for (i = 0; i < array_size(*(arr)); i++) \
+				recv_item(nb, &(*(arr))[i]); \
+		else \
+			decode_array(&(nb)->cs, *(arr), array_size(*(arr))); \
+		nb_recv_array_end(nb); \
+	} while (0)
+
+
+void nb_recv_u8_array(struct nb *nb, uint8_t **arr)
+{
+	RECV_ARRAY(nb, arr, nb_recv_u8, cbor_decode_uint8_array);
+}
+
+
+void nb_recv_u16_array(struct nb *nb, uint16_t **arr)
+{
+	RECV_ARRAY(nb, arr, nb_recv_u16, cbor_decode_uint16_array);
+}
+
+
+void nb_recv_u32_array(struct nb *nb, uint32_t **arr)
+{
+	RECV_ARRAY(nb, arr, nb_recv_u32, cbor_decode_uint32_array);
+}
+
+
+void nb_recv_u64_array(struct nb *nb, uint64_t **arr)
+{
+	RECV_ARRAY(nb, arr, nb_recv_u64, cbor_decode_uint64_array);
+}
@@ -189,3 +189,35 @@ void nb_send_array_end(struct nb *nb)
 {
 	cbor_encode_array_end(&nb->cs);
 }
+
+
+void nb_send_u8_array(struct nb *nb, nb_lid_t id, const uint8_t *vals, size_t nitems)
+{
+	nb_send_array(nb, id, nitems);
+	cbor_encode_uint8_array(&nb->cs, vals, nitems);
+	nb_send_array_end(nb);
+}
+
+
+void nb_send_u16_array(struct nb *nb, nb_lid_t id, const uint16_t *vals, size_t nitems)
+{
+	nb_send_array(nb, id, nitems);
+	cbor_encode_uint16_array(&nb->cs, vals, nitems);
+	nb_send_array_end(nb);
+}
+
+
+void nb_send_u32_array(struct nb *nb, nb_lid_t id, const uint32_t *vals, size_t nitems)
+{
+	nb_send_array(nb, id, nitems);
+	cbor_encode_uint32_array(&nb->cs, vals, nitems);
+	nb_send_array_end(nb);
+}
+
+
+void nb_send_u64_array(struct nb *nb, nb_lid_t id, const uint64_t *vals, size_t nitems)
+{
+	nb_send_array(nb, id, nitems);
+	cbor_encode_uint64_array(&nb->cs, vals, nitems);
+	nb_send_array_end(nb);
+}
@@ -49,6 +49,12 @@ void *stack_pop(struct stack *stack)
 }
 
 
+void stack_reset(struct stack *stack)
+{
+	stack->num_items = 0;
+}
+
+
 bool stack_is_empty(struct stack *stack)
 {
 	return (stack->num_items == 0);
@@ -0,0 +1,162 @@
+/*
+ * Check the CRC-32C implementation in use (set NB_CRC32C_SW to test the
+ * software one) against a known answer and a bitwise reference, and check
+ * that the framing filter refuses frames with a corrupted header, payload
+ * or trailer without returning any of their data.
+ */
+
+#include "buffer.h"
+#include "crc32c.h"
+#include "memory.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DATA_LEN	5000
+#define FRAME_SIZE	256
+#define FRAME_LEN	(4 + FRAME_SIZE + 4)	/* header, payload, trailer */
+#define BAD_FRAME	3
+
+static nb_byte_t data[DATA_LEN];
+
+
+static uint32_t crc32c_bitwise(const nb_byte_t *bytes, size_t len)
+{
+	uint32_t crc = ~0U;
+	size_t i;
+	int j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= bytes[i];
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+
+static void check_known_answer(void)
+{
+	nb_byte_t copy[9];
+	uint32_t crc;
+
+	assert(crc32c(0, "123456789", 9) == 0xE3069283);
+	assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xE3069283);
+
+	/* the copy stays out of assert, which may be compiled out */
+	crc = crc32c_copy(0, copy, "123456789", 9);
+	assert(crc == 0xE3069283);
+	assert(memcmp(copy, "123456789", 9) == 0);
+}
+
+
+/*
+ * Odd lengths and offsets exercise the byte-wise heads and tails of the
+ * 8-byte loops.
+ */
+static void check_reference(void)
+{
+	nb_byte_t copy[DATA_LEN];
+	uint32_t copy_crc;
+	uint32_t crc;
+	size_t len;
+	size_t off;
+
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len < 100; len++) {
+			crc = crc32c_bitwise(data + off, len);
+			assert(crc32c(0, data + off, len) == crc);
+			copy_crc = crc32c_copy(0, copy, data + off, len);
+			assert(copy_crc == crc);
+			assert(memcmp(copy, data + off, len) == 0);
+		}
+	}
+
+	crc = crc32c(0, data, 1234);
+	assert(crc32c(crc, data + 1234, DATA_LEN - 1234) == crc32c_bitwise(data, DATA_LEN));
+}
+
+
+static nb_byte_t *encode_frames(size_t *len)
+{
+	struct nb_buffer_opts opts = { .size = FRAME_SIZE };
+	struct nb_buffer *lower;
+	struct nb_buffer *crc;
+	nb_byte_t *frames;
+	ssize_t written;
+
+	lower = nb_buffer_new_memory();
+	crc = nb_buffer_new_crc(lower, &opts);
+	written = nb_buffer_write(crc, data, DATA_LEN);
+	assert(written == DATA_LEN);
+	nb_buffer_delete(crc);
+
+	frames = nb_buffer_steal(lower, len);
+	nb_buffer_delete(lower);
+	assert(*len == DATA_LEN + (DATA_LEN + FRAME_SIZE - 1) / FRAME_SIZE * 8);
+	return frames;
+}
+
+
+/*
+ * Read the frames with the byte at offset flipped (if it's not SIZE_MAX),
+ * and expect everything before the corrupted frame, and nothing more.
+ */
+static void check_frames(const nb_byte_t *frames, size_t len, size_t offset)
+{
+	nb_byte_t *corrupt;
+	struct nb_buffer *view;
+	struct nb_buffer *crc;
+	nb_byte_t got[DATA_LEN];
+	size_t nread;
+
+	corrupt = nb_malloc(len);
+	memcpy(corrupt, frames, len);
+	if (offset != SIZE_MAX)
+		corrupt[offset] ^= 0x01;
+
+	view = nb_buffer_new_memory_view(corrupt, len);
+	crc = nb_buffer_new_crc(view, NULL);
+	nread = nb_buffer_read(crc, got, sizeof(got));
+
+	if (offset == SIZE_MAX) {
+		assert(nread == DATA_LEN);
+		assert(nb_buffer_get_error(crc) == NB_ERR_OK);
+	}
+	else {
+		assert(nread == offset / FRAME_LEN * FRAME_SIZE);
+		assert(nb_buffer_get_error(crc) == NB_ERR_CHECKSUM);
+	}
+	assert(memcmp(got, data, nread) == 0);
+
+	nb_buffer_delete(crc);
+	nb_buffer_delete(view);
+	xfree(corrupt);
+}
+
+
+int main(void)
+{
+	nb_byte_t *frames;
+	size_t len;
+	size_t i;
+
+	for (i = 0; i < DATA_LEN; i++)
+		data[i] = i * 7 + i / 256;
+
+	check_known_answer();
+	check_reference();
+
+	frames = encode_frames(&len);
+	check_frames(frames, len, SIZE_MAX);
+	check_frames(frames, len, BAD_FRAME * FRAME_LEN + 3);			/* header */
+	check_frames(frames, len, BAD_FRAME * FRAME_LEN + 4 + 100);		/* payload */
+	check_frames(frames, len, BAD_FRAME * FRAME_LEN + 4 + FRAME_SIZE + 2);	/* trailer */
+	xfree(frames);
+
+	printf("crc32c (%s) OK\n", crc32c_is_hw() ? "hardware" : "software");
+	return EXIT_SUCCESS;
+}
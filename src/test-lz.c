@@ -0,0 +1,212 @@
+/*
+ * Feed corrupt blocks to the LZ filter: blocks cut short, matches with bad
+ * offsets, lengths over the limits and blocks with the LZ_STORED bit
+ * flipped shall be refused with NB_ERR_PARSE, and no data shall be returned.
+ * A lower buffer which runs out of data in the middle of a block gives
+ * NB_ERR_EOF instead.
+ */
+
+#include "buffer.h"
+#include "lz.h"
+#include "memory.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* see buffer-lz.c */
+#define LZ_HDR_LEN		8
+#define LZ_STORED		0x80000000U
+#define LZ_MAX_BLOCK_SIZE	(64 * 1024 * 1024)
+
+#define DATA_LEN	5000
+
+/* "abcd" and a match of 8 bytes at offset 4: "abcdabcdabcd" */
+static const nb_byte_t valid[] = { 0x44, 'a', 'b', 'c', 'd', 0x04, 0x00 };
+
+
+/*
+ * Read the stream through the filter, expect err and not a byte of data.
+ */
+static void expect_error(const nb_byte_t *stream, size_t len, nb_err_t err)
+{
+	struct nb_buffer *view;
+	struct nb_buffer *lz;
+	nb_byte_t got[DATA_LEN];
+	size_t nread;
+
+	view = nb_buffer_new_memory_view(stream, len);
+	lz = nb_buffer_new_lz(view, NULL);
+	nread = nb_buffer_read(lz, got, sizeof(got));
+	assert(nread == 0);
+	assert(nb_buffer_get_error(lz) == err);
+
+	nb_buffer_delete(lz);
+	nb_buffer_delete(view);
+}
+
+
+/*
+ * Put the packed data (if any, the header may be all that's needed) in
+ * a block of its own, which claims to hold len bytes.
+ */
+static size_t make_block(nb_byte_t *block, const nb_byte_t *packed, uint32_t packed_len,
+	uint32_t len, bool stored)
+{
+	uint32_t hdr[2];
+
+	hdr[0] = htobe32(packed_len | (stored ? LZ_STORED : 0));
+	hdr[1] = htobe32(len);
+	memcpy(block, hdr, LZ_HDR_LEN);
+	if (!packed)
+		return LZ_HDR_LEN;
+	memcpy(block + LZ_HDR_LEN, packed, packed_len);
+	return LZ_HDR_LEN + packed_len;
+}
+
+
+static void expect_block_error(const nb_byte_t *packed, uint32_t packed_len, uint32_t len,
+	bool stored)
+{
+	nb_byte_t block[LZ_HDR_LEN + 64];
+	size_t block_len;
+
+	assert(packed_len <= 64);
+	block_len = make_block(block, packed, packed_len, len, stored);
+	expect_error(block, block_len, NB_ERR_PARSE);
+}
+
+
+static void check_valid(void)
+{
+	struct nb_buffer *view;
+	struct nb_buffer *lz;
+	nb_byte_t block[LZ_HDR_LEN + sizeof(valid)];
+	nb_byte_t got[16];
+	size_t block_len;
+	size_t nread;
+
+	block_len = make_block(block, valid, sizeof(valid), 12, false);
+	view = nb_buffer_new_memory_view(block, block_len);
+	lz = nb_buffer_new_lz(view, NULL);
+	nread = nb_buffer_read(lz, got, sizeof(got));
+	assert(nread == 12 && memcmp(got, "abcdabcdabcd", 12) == 0);
+	assert(nb_buffer_get_error(lz) == NB_ERR_OK);
+
+	nb_buffer_delete(lz);
+	nb_buffer_delete(view);
+}
+
+
+static void check_truncated(void)
+{
+	static const nb_byte_t literals[] = { 0x50, 'a', 'b', 'c', 'd' };
+	static const nb_byte_t lit_len[] = { 0xF0, 0xFF };
+	static const nb_byte_t match_len[] = { 0x4F, 'a', 'b', 'c', 'd', 0x04, 0x00, 0xFF };
+	nb_byte_t block[LZ_HDR_LEN + sizeof(valid)];
+	size_t block_len;
+
+	expect_block_error(valid, sizeof(valid) - 1, 12, false);	/* in the offset */
+	expect_block_error(literals, sizeof(literals), 5, false);
+	expect_block_error(lit_len, sizeof(lit_len), 300, false);
+	expect_block_error(match_len, sizeof(match_len), 300, false);
+
+	/* the lower buffer runs out of data, in the header or in the block */
+	block_len = make_block(block, valid, sizeof(valid), 12, false);
+	expect_error(block, LZ_HDR_LEN / 2, NB_ERR_EOF);
+	expect_error(block, block_len - 1, NB_ERR_EOF);
+}
+
+
+static void check_bad_offsets(void)
+{
+	nb_byte_t packed[sizeof(valid)];
+
+	memcpy(packed, valid, sizeof(valid));
+	packed[5] = 0;		/* zero */
+	expect_block_error(packed, sizeof(packed), 12, false);
+
+	packed[5] = 5;		/* before the start of the data */
+	expect_block_error(packed, sizeof(packed), 12, false);
+
+	packed[5] = 0xFF;
+	packed[6] = 0xFF;
+	expect_block_error(packed, sizeof(packed), 12, false);
+}
+
+
+static void check_bad_lengths(void)
+{
+	nb_byte_t block[LZ_HDR_LEN];
+
+	expect_block_error(valid, sizeof(valid), 11, false);	/* the match overflows */
+	expect_block_error(valid, sizeof(valid), 3, false);	/* the literals overflow */
+	expect_block_error(valid, sizeof(valid), 13, false);	/* the data are short */
+
+	/* only the header is needed to refuse these */
+	make_block(block, NULL, 0, LZ_MAX_BLOCK_SIZE + 1, true);
+	expect_error(block, sizeof(block), NB_ERR_PARSE);
+	make_block(block, NULL, lz_compress_bound(100) + 1, 100, false);
+	expect_error(block, sizeof(block), NB_ERR_PARSE);
+	make_block(block, NULL, 100, 99, true);
+	expect_error(block, sizeof(block), NB_ERR_PARSE);
+}
+
+
+/*
+ * Compress the data in a single block, flip its LZ_STORED bit and expect
+ * the block to be refused.
+ */
+static void check_flipped_stored(const nb_byte_t *data, bool stored)
+{
+	struct nb_buffer_opts opts = { .size = DATA_LEN };
+	struct nb_buffer *lower;
+	struct nb_buffer *lz;
+	nb_byte_t *block;
+	ssize_t written;
+	size_t len;
+
+	lower = nb_buffer_new_memory();
+	lz = nb_buffer_new_lz(lower, &opts);
+	written = nb_buffer_write(lz, (nb_byte_t *)data, DATA_LEN);
+	assert(written == DATA_LEN);
+	nb_buffer_delete(lz);
+
+	block = nb_buffer_steal(lower, &len);
+	nb_buffer_delete(lower);
+
+	assert(((block[0] & 0x80) != 0) == stored);
+	block[0] ^= 0x80;
+	expect_error(block, len, NB_ERR_PARSE);
+	xfree(block);
+}
+
+
+int main(void)
+{
+	nb_byte_t text[DATA_LEN];
+	nb_byte_t noise[DATA_LEN];
+	uint32_t x = 2463534242U;
+	size_t i;
+
+	for (i = 0; i < DATA_LEN; i++) {
+		text[i] = "route 10.0.0.0/16 via 192.0.2.1\n"[i % 32];
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		noise[i] = x;
+	}
+
+	check_valid();
+	check_truncated();
+	check_bad_offsets();
+	check_bad_lengths();
+	check_flipped_stored(text, false);
+	check_flipped_stored(noise, true);
+
+	printf("corrupt blocks refused\n");
+	return EXIT_SUCCESS;
+}
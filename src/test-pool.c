@@ -0,0 +1,272 @@
+/*
+ * Run many short sessions through a pool and check that the recycled
+ * contexts and buffers behave exactly like new ones.
+ */
+
+#include "array.h"
+#include "buffer.h"
+#include "memory.h"
+#include "netbufs.h"
+#include "pool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_SESSIONS	1000
+#define MAX_IDLE	4
+
+enum ids
+{
+	ID_MSG,
+	ID_MSG_SEQ,
+	ID_MSG_TEXT,
+	ID_MSG_PATH,
+};
+
+static char *texts[] = { "hello", "", "recycled contexts shall not remember anything" };
+
+#define MAX_PATH	40
+
+
+static void setup_ids(struct nb *nb)
+{
+	struct nb_group *msg;
+
+	nb->diag.enabled = false;
+	msg = nb_group(nb, ID_MSG, "test/msg");
+	nb_bind(nb, msg, ID_MSG_SEQ, "./seq", true);
+	nb_bind(nb, msg, ID_MSG_TEXT, "./text", true);
+	nb_bind(nb, msg, ID_MSG_PATH, "./path", true);
+}
+
+
+/*
+ * Paths of odd messages have numbers of one width (encoded in whole blocks
+ * of the same width), those of even messages have mixed widths.
+ */
+static size_t make_path(uint32_t seq, uint32_t *path)
+{
+	size_t len = seq % MAX_PATH;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		path[i] = seq % 2 ? 64512 + i : (seq * 2654435761U) >> (i % 32);
+	return len;
+}
+
+
+static void send_msg(struct nb *nb, uint32_t seq)
+{
+	uint32_t path[MAX_PATH];
+
+	nb_send_group(nb, ID_MSG);
+	nb_send_u32(nb, ID_MSG_SEQ, seq);
+	nb_send_string(nb, ID_MSG_TEXT, texts[seq % 3]);
+	nb_send_u32_array(nb, ID_MSG_PATH, path, make_path(seq, path));
+	nb_send_group_end(nb);
+}
+
+
+static void recv_msg(struct nb *nb, uint32_t seq)
+{
+	uint32_t path[MAX_PATH];
+	uint32_t got_seq = 0;
+	uint32_t *got_path = NULL;
+	char *text = NULL;
+	size_t path_len;
+	nb_lid_t id;
+
+	nb_recv_group(nb, ID_MSG);
+	while (nb_recv_attr(nb, &id)) {
+		switch (id) {
+		case ID_MSG_SEQ:
+			nb_recv_u32(nb, &got_seq);
+			break;
+		case ID_MSG_TEXT:
+			nb_recv_string(nb, &text);
+			break;
+		case ID_MSG_PATH:
+			nb_recv_u32_array(nb, &got_path);
+			break;
+		}
+	}
+	nb_recv_group_end(nb);
+
+	assert(got_seq == seq);
+	assert(text && strcmp(text, texts[seq % 3]) == 0);
+	xfree(text);
+
+	path_len = make_path(seq, path);
+	assert(got_path && array_size(got_path) == path_len);
+	assert(memcmp(got_path, path, sizeof(*path) * array_size(got_path)) == 0);
+	array_delete(got_path);
+}
+
+
+/*
+ * Encode the message using a brand new context and buffer.
+ */
+static nb_byte_t *encode_fresh(uint32_t seq, size_t *len)
+{
+	struct nb_buffer *buf;
+	nb_byte_t *bytes;
+	struct nb nb;
+
+	buf = nb_buffer_new_memory();
+	nb_init(&nb, buf);
+	setup_ids(&nb);
+	send_msg(&nb, seq);
+	nb_free(&nb);
+
+	bytes = nb_buffer_steal(buf, len);
+	nb_buffer_delete(buf);
+	return bytes;
+}
+
+
+static void check_contents(struct nb_buffer *buf, uint32_t seq)
+{
+	nb_byte_t bytes[512];
+	nb_byte_t *expected;
+	size_t nread;
+	size_t len;
+
+	expected = encode_fresh(seq, &len);
+	assert(len <= sizeof(bytes));
+
+	nb_buffer_rewind(buf);
+	nread = nb_buffer_read(buf, bytes, sizeof(bytes));
+	assert(nread == len);
+	assert(memcmp(bytes, expected, len) == 0);
+
+	xfree(expected);
+}
+
+
+static void memory_sessions(struct nb_pool *pool)
+{
+	struct nb_buffer *buf;
+	struct nb *nb;
+	uint32_t seq;
+
+	for (seq = 0; seq < NUM_SESSIONS; seq++) {
+		buf = nb_pool_acquire_memory(pool);
+
+		nb = nb_pool_acquire(pool, buf);
+		setup_ids(nb);
+		send_msg(nb, seq);
+		nb_pool_release(pool, nb);
+
+		check_contents(buf, seq);
+
+		nb_buffer_rewind(buf);
+		nb = nb_pool_acquire(pool, buf);
+		setup_ids(nb);
+		recv_msg(nb, seq);
+		nb_pool_release(pool, nb);
+
+		nb_pool_release_buffer(pool, buf);
+	}
+}
+
+
+static void file_sessions(struct nb_pool *pool)
+{
+	struct nb_buffer *buf;
+	struct nb *nb;
+	FILE *file;
+	int fd;
+	uint32_t seq;
+
+	for (seq = 0; seq < NUM_SESSIONS / 10; seq++) {
+		file = tmpfile();
+		fd = fileno(file);
+
+		buf = nb_pool_acquire_file(pool, fd);
+		nb = nb_pool_acquire(pool, buf);
+		setup_ids(nb);
+		send_msg(nb, seq);
+		nb_pool_release(pool, nb);
+		nb_pool_release_buffer(pool, buf);	/* flushes */
+
+		lseek(fd, 0, SEEK_SET);
+		buf = nb_pool_acquire_file(pool, fd);
+		nb = nb_pool_acquire(pool, buf);
+		setup_ids(nb);
+		recv_msg(nb, seq);
+		nb_pool_release(pool, nb);
+		nb_pool_release_buffer(pool, buf);
+
+		fclose(file);
+	}
+}
+
+
+/*
+ * Check that recycled objects are handed out without allocating anything,
+ * and that the pool counts as saved what creating them has cost.
+ */
+static void check_saved(void)
+{
+	struct nb_pool *pool;
+	struct nb_buffer *buf;
+	struct nb *nb;
+	FILE *file;
+	size_t fresh = 0;
+	size_t allocs;
+	size_t saved;
+	int i;
+
+	pool = nb_pool_new(1);
+	file = tmpfile();
+
+	for (i = 0; i < 2; i++) {
+		allocs = nb_get_num_allocs();
+		saved = nb_pool_get_saved(pool);
+
+		buf = nb_pool_acquire_memory(pool);
+		nb_pool_release_buffer(pool, nb_pool_acquire_file(pool, fileno(file)));
+		nb = nb_pool_acquire(pool, buf);
+
+		allocs = nb_get_num_allocs() - allocs;
+		saved = nb_pool_get_saved(pool) - saved;
+		if (i == 0) {
+			assert(saved == 0);
+			fresh = allocs;
+		}
+		else {
+			assert(allocs == 0);
+			assert(saved == fresh);
+		}
+
+		nb_pool_release(pool, nb);
+		nb_pool_release_buffer(pool, buf);
+	}
+
+	fclose(file);
+	nb_pool_delete(pool);
+}
+
+
+int main(void)
+{
+	struct nb_pool *pool;
+
+	check_saved();
+
+	pool = nb_pool_new(MAX_IDLE);
+
+	memory_sessions(pool);
+	file_sessions(pool);
+
+	/* everything but the first context and buffers has been recycled */
+	assert(nb_pool_get_reused(pool) > 3 * NUM_SESSIONS);
+	printf("reused %zu objects, saved %zu allocations\n",
+		nb_pool_get_reused(pool), nb_pool_get_saved(pool));
+
+	nb_pool_delete(pool);
+	return EXIT_SUCCESS;
+}
@@ -1,7 +1,23 @@
 /*
  * Test I/O streams by reading a file and writing the data to another file.
+ * The optional third argument selects the buffer implementation used for
+ * reading the input file (file, mmap, view, memory, steal, uring, prefetch,
+ * adaptive, socket, span, lz, crc, direct, spsc, shm), the fourth one the
+ * implementation used for writing the output file (file, writev, uring,
+ * adaptive, socket, reserve, tee, direct, spsc, shm, batched, zerocopy,
+ * fixed).
  *
- * The files are then diffed by run-tests.sh.
+ * Socket buffers are tested through a socket pair whose other end is served
+ * by a child process copying the data from or to the file. The tee writes
+ * into such a socket buffer and into a memory buffer, which is compared with
+ * the input file at the end. Batched socket buffers hold small flushes back
+ * and cork full windows, zerocopy ones send big windows with MSG_ZEROCOPY,
+ * both over a TCP connection. SPSC ring buffers are tested through a thread
+ * copying the data from the file into the ring, or from the ring into the
+ * file; shared rings likewise through a child process.
+ *
+ * Afterwards, the input buffer is checked by seeking in it, unless it does
+ * not support seeking. The files are then diffed by run-tests.sh.
  */
 
 #include "buffer-internal.h"
@@ -9,23 +25,753 @@
 #include "cbor.h"
 #include "common.h"
 #include "memory.h"
+#include "util.h"
 
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 
 #define BUFSIZE	117	/* make sure buffer isn't boundary-aligned with buf's internal buffer */
+#define REF_SIZE	4000	/* size of chunks written by reference */
+#define SOCK_PENDING	10000	/* wait for the socket when more bytes are pending */
+#define SPILL_MAX	20000	/* the tee's queue for the memory buffer */
+#define SPSC_SIZE	4096	/* make the ring wrap around and fill up often */
+
+static int in_sock = -1;	/* input socket buffer's socket */
+static int out_sock = -1;	/* output socket buffer's socket */
+static struct nb_buffer *out_sock_buf;	/* output socket buffer */
+static nb_byte_t *out_fixed;		/* memory of the fixed output buffer */
+static struct nb_buffer *out_sinks[2];	/* sinks of the output tee */
+static pthread_t spsc_threads[2];	/* copiers of the rings */
+static size_t num_spsc_threads;
+static bool in_span;		/* read in place, see nb_buffer_peek_span */
+static bool out_reserve;	/* write in place, see nb_buffer_reserve */
+static struct nb_buffer *in_lower;	/* buffer below the input filter */
+static nb_byte_t *in_memory;		/* memory of the input view */
+
+
+/*
+ * Read the whole file into memory to test nb_buffer_new_memory_view.
+ */
+static struct nb_buffer *new_view_buffer(int fd)
+{
+	struct stat st;
+	ssize_t ret;
+	size_t len = 0;
+
+	ret = fstat(fd, &st);
+	assert(ret == 0);
+	in_memory = nb_malloc(st.st_size + 1);
+
+	while ((ret = read(fd, in_memory + len, st.st_size - len)) > 0)
+		len += ret;
+
+	assert(len == st.st_size);
+	return nb_buffer_new_memory_view(in_memory, len);
+}
+
+
+/*
+ * Write the data in place, in pieces of varying size. Memory buffers cannot
+ * always reserve the space, the piece is written the usual way then.
+ */
+static void write_reserved(struct nb_buffer *out, nb_byte_t *buf, size_t len)
+{
+	nb_byte_t *bytes;
+	size_t count;
+	size_t i;
+
+	for (i = 0; i < len; i += count) {
+		count = MIN(1 + i % 13, len - i);
+		if (!(bytes = nb_buffer_reserve(out, count))) {
+			nb_buffer_write(out, buf + i, count);
+			continue;
+		}
+		memcpy(bytes, buf + i, count);
+		nb_buffer_commit(out, count);
+	}
+}
+
+
+/*
+ * Copy the file into a memory buffer and read it back either in place
+ * (nb_buffer_rewind) or through a view of the stolen memory.
+ */
+static struct nb_buffer *new_memory_buffer(int fd, bool steal)
+{
+	struct nb_buffer *file;
+	struct nb_buffer *mem;
+	nb_byte_t chunk[BUFSIZE];
+	size_t len;
+
+	file = nb_buffer_new_file(fd);
+	mem = nb_buffer_new_memory();
+
+	while ((len = nb_buffer_read(file, chunk, BUFSIZE)) > 0)
+		write_reserved(mem, chunk, len);
+	nb_buffer_delete(file);
+
+	if (!steal) {
+		nb_buffer_rewind(mem);
+		return mem;
+	}
+
+	in_memory = nb_buffer_steal(mem, &len);
+	nb_buffer_delete(mem);
+	return nb_buffer_new_memory_view(in_memory, len);
+}
+
+
+/*
+ * Pass the file through a filter into a memory buffer, using odd-sized
+ * windows, and read it back through the filter (see nb_buffer_new_lz).
+ */
+static struct nb_buffer *new_filter_buffer(int fd,
+	struct nb_buffer *(*new_filter)(struct nb_buffer *lower, const struct nb_buffer_opts *opts))
+{
+	struct nb_buffer_opts opts = { .size = 5000 };
+	struct nb_buffer *file;
+	struct nb_buffer *filter;
+	nb_byte_t chunk[BUFSIZE];
+	size_t len;
+
+	file = nb_buffer_new_file(fd);
+	in_lower = nb_buffer_new_memory();
+	filter = new_filter(in_lower, &opts);
+
+	while ((len = nb_buffer_read(file, chunk, BUFSIZE)) > 0)
+		nb_buffer_write(filter, chunk, len);
+	nb_buffer_delete(file);
+	nb_buffer_delete(filter);
+
+	nb_buffer_rewind(in_lower);
+	return new_filter(in_lower, NULL);
+}
+
+
+struct spsc_copy
+{
+	struct nb_buffer *from;
+	struct nb_buffer *to;
+};
+
+
+static void *copy_thread(void *arg)
+{
+	struct spsc_copy *copy = arg;
+	nb_byte_t chunk[BUFSIZE];
+	size_t len;
+
+	while ((len = nb_buffer_read(copy->from, chunk, BUFSIZE)) > 0)
+		nb_buffer_write(copy->to, chunk, len);
+
+	nb_buffer_delete(copy->from);
+	nb_buffer_delete(copy->to);
+	xfree(copy);
+	return NULL;
+}
+
+
+/*
+ * Check that the reader of a ring reads a chunk while the writer writes the
+ * next one. Both are used by this thread, which blocks (until the alarm goes
+ * off) if either window covers the whole ring.
+ */
+static void check_spsc_overlap(void)
+{
+	struct nb_buffer *writer = nb_buffer_new_spsc(SPSC_SIZE);
+	struct nb_buffer *reader = nb_buffer_spsc_reader(writer);
+	nb_byte_t chunk[SPSC_SIZE / 4];
+	nb_byte_t got[SPSC_SIZE / 4];
+	size_t len;
+	size_t i;
+
+	alarm(10);
+
+	for (i = 0; i < 4 * 4; i++) {
+		/* writing this chunk publishes the previous one */
+		memset(chunk, (int)i, sizeof(chunk));
+		len = nb_buffer_write(writer, chunk, sizeof(chunk));
+		assert(len == sizeof(chunk));
+		if (i == 0)
+			continue;
+
+		len = nb_buffer_read(reader, got, sizeof(got));
+		assert(len == sizeof(got));
+		memset(chunk, (int)i - 1, sizeof(chunk));
+		assert(memcmp(got, chunk, sizeof(got)) == 0);
+	}
+
+	alarm(0);
+
+	nb_buffer_delete(writer);
+	nb_buffer_delete(reader);
+}
+
+
+/*
+ * Return the end of the ring used by this thread, a thread copies between
+ * the other end and the file.
+ */
+static struct nb_buffer *new_spsc_buffer(int fd, bool in)
+{
+	struct spsc_copy *copy = nb_malloc(sizeof(*copy));
+	struct nb_buffer *writer = nb_buffer_new_spsc(SPSC_SIZE);
+	struct nb_buffer *reader = nb_buffer_spsc_reader(writer);
+	int ret;
+
+	check_spsc_overlap();
+
+	copy->from = in ? nb_buffer_new_file(fd) : reader;
+	copy->to = in ? writer : nb_buffer_new_file(fd);
+
+	ret = pthread_create(&spsc_threads[num_spsc_threads++], NULL, copy_thread, copy);
+	assert(ret == 0);
+
+	return in ? reader : writer;
+}
+
+
+/*
+ * Return the end of a ring in a memfd, a child process copies between the
+ * other end and the file.
+ */
+static struct nb_buffer *new_shm_buffer(int fd, bool in)
+{
+	struct spsc_copy *copy;
+	struct nb_buffer *buf;
+	int memfd;
+
+	if ((memfd = nb_buffer_shm_create(SPSC_SIZE)) == -1) {
+		perror("nb_buffer_shm_create");
+		exit(EXIT_FAILURE);
+	}
+
+	if (fork() == 0) {
+		buf = nb_buffer_new_shm(memfd, in);
+		assert(buf != NULL);
+		copy = nb_malloc(sizeof(*copy));
+		copy->from = in ? nb_buffer_new_file(fd) : buf;
+		copy->to = in ? buf : nb_buffer_new_file(fd);
+		copy_thread(copy);
+		exit(EXIT_SUCCESS);
+	}
+
+	buf = nb_buffer_new_shm(memfd, !in);
+	assert(buf != NULL);
+	close(memfd);
+
+	return buf;
+}
+
+
+/*
+ * Start with a tiny unaligned window to exercise its growth.
+ */
+static struct nb_buffer *new_adaptive_buffer(int fd)
+{
+	struct nb_buffer_opts opts = {
+		.size = 1000,
+		.align = 64,
+		.adaptive = true,
+		.max_size = 100000,
+	};
+
+	return nb_buffer_new_file_opts(fd, &opts);
+}
+
+
+/*
+ * Both sizes are rounded up to whole blocks.
+ */
+static struct nb_buffer *new_direct_buffer(int fd)
+{
+	struct nb_buffer_opts opts = {
+		.size = 5000,
+		.adaptive = true,
+		.max_size = 50000,
+		.direct = true,
+	};
+
+	return nb_buffer_new_file_opts(fd, &opts);
+}
+
+
+/*
+ * Copy data from fd_from to fd_to in a child process.
+ */
+static void spawn_copier(int fd_from, int fd_to)
+{
+	nb_byte_t buf[BUFSIZE];
+	ssize_t len;
+
+	if (fork() != 0)
+		return;
+
+	while ((len = read(fd_from, buf, sizeof(buf))) > 0)
+		if (write(fd_to, buf, len) != len)
+			exit(EXIT_FAILURE);
+
+	exit(EXIT_SUCCESS);
+}
+
+
+static struct nb_buffer *new_socket_buffer(int fd, bool in)
+{
+	struct nb_buffer_opts opts = { .size = 1000 };
+	int sv[2];
+	int sndbuf = 4096;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	if (in)
+		spawn_copier(fd, sv[1]);
+	else
+		spawn_copier(sv[1], fd);
+	close(sv[1]);
+
+	if (in) {
+		in_sock = sv[0];
+		return nb_buffer_new_socket(sv[0], &opts);
+	}
+
+	out_sock = sv[0];
+	return out_sock_buf = nb_buffer_new_socket(sv[0], &opts);
+}
+
+
+/*
+ * Return a socket buffer with the given policy, sending over a TCP
+ * connection to a child process copying the data to the file.
+ */
+static struct nb_buffer *new_tcp_buffer(int fd, const struct nb_socket_policy *policy)
+{
+	struct nb_buffer_opts opts = { .size = 4096 };
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t addr_len = sizeof(addr);
+	int sndbuf = 4096;
+	int listener;
+	int peer;
+	nb_err_t err;
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	out_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == -1 || out_sock == -1
+		|| bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(listener, 1) == -1
+		|| getsockname(listener, (struct sockaddr *)&addr, &addr_len) == -1
+		|| connect(out_sock, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| (peer = accept(listener, NULL, NULL)) == -1) {
+		perror("TCP connection");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(out_sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	spawn_copier(peer, fd);
+	close(peer);
+	close(listener);
+
+	out_sock_buf = nb_buffer_new_socket(out_sock, &opts);
+	err = nb_buffer_socket_policy(out_sock_buf, policy);
+	assert(err == NB_ERR_OK);
+	return out_sock_buf;
+}
+
+
+/*
+ * Return a TCP socket buffer holding small flushes back, and sending full
+ * windows with MSG_MORE.
+ */
+static struct nb_buffer *new_batched_buffer(int fd)
+{
+	struct nb_socket_policy policy = {
+		.flush = NB_SOCKET_FLUSH_DEADLINE,
+		.threshold = 3000,
+		.deadline_ms = 5,
+		.cork = true,
+	};
+
+	return new_tcp_buffer(fd, &policy);
+}
+
+
+/*
+ * Return a TCP socket buffer sending big windows with MSG_ZEROCOPY.
+ */
+static struct nb_buffer *new_zerocopy_buffer(int fd)
+{
+	struct nb_socket_policy policy = {
+		.flush = NB_SOCKET_FLUSH_IMMEDIATE,
+		.zerocopy_min = 2048,
+	};
+
+	return new_tcp_buffer(fd, &policy);
+}
+
+
+/*
+ * Return a fixed buffer with room for exactly the input file.
+ */
+static struct nb_buffer *new_fixed_buffer(int fd_in)
+{
+	struct stat st;
+	int ret;
+
+	ret = fstat(fd_in, &st);
+	assert(ret == 0);
+	out_fixed = nb_malloc(st.st_size + 1);
+
+	return nb_buffer_new_fixed(out_fixed, st.st_size);
+}
+
+
+/*
+ * Take the result of an encoder call, which must not be made in assert().
+ */
+static void check_overflow(nb_err_t err)
+{
+	assert(err == NB_ERR_OVERFLOW);
+}
+
+
+/*
+ * Check that the encoder reports a full fixed buffer as such for integers
+ * of every width, both the short (single-byte) and the long encodings.
+ */
+static void check_encode_overflow(struct nb_buffer *out)
+{
+	struct cbor_stream cs;
+
+	cbor_stream_init(&cs, out);
+
+	check_overflow(cbor_encode_uint8(&cs, 1));
+	check_overflow(cbor_encode_uint8(&cs, UINT8_MAX));
+	check_overflow(cbor_encode_uint16(&cs, 1));
+	check_overflow(cbor_encode_uint16(&cs, UINT16_MAX));
+	check_overflow(cbor_encode_uint32(&cs, 1));
+	check_overflow(cbor_encode_uint32(&cs, UINT32_MAX));
+	check_overflow(cbor_encode_uint64(&cs, 1));
+	check_overflow(cbor_encode_uint64(&cs, UINT64_MAX));
+
+	check_overflow(cbor_encode_int8(&cs, -1));
+	check_overflow(cbor_encode_int8(&cs, INT8_MIN));
+	check_overflow(cbor_encode_int16(&cs, -1));
+	check_overflow(cbor_encode_int16(&cs, INT16_MIN));
+	check_overflow(cbor_encode_int32(&cs, -1));
+	check_overflow(cbor_encode_int32(&cs, INT32_MIN));
+	check_overflow(cbor_encode_int64(&cs, -1));
+	check_overflow(cbor_encode_int64(&cs, INT64_MIN));
+
+	cbor_stream_free(&cs);
+}
+
+
+/*
+ * Check that the fixed buffer is full, then write its memory to the file.
+ */
+static void finish_fixed(struct nb_buffer *out, int fd)
+{
+	size_t len = nb_buffer_get_written_total(out);
+	nb_byte_t byte = 0;
+	ssize_t written;
+	size_t count;
+
+	count = nb_buffer_write(out, &byte, 1);
+	assert(count == 0);
+	assert(nb_buffer_get_error(out) == NB_ERR_OVERFLOW);
+	assert(nb_buffer_get_written_total(out) == len);
+
+	check_encode_overflow(out);
+	assert(nb_buffer_get_written_total(out) == len);
+
+	written = write(fd, out_fixed, len);
+	assert(written == (ssize_t)len);
+
+	/* it's usable again after a reset */
+	nb_buffer_fixed_reset(out, out_fixed, 1);
+	count = nb_buffer_write(out, &byte, 1);
+	assert(count == 1);
+	assert(nb_buffer_get_error(out) == NB_ERR_OK);
+	count = nb_buffer_write(out, &byte, 1);
+	assert(count == 0);
+	assert(nb_buffer_get_error(out) == NB_ERR_OVERFLOW);
+	xfree(out_fixed);
+}
+
+
+static struct nb_buffer *new_tee_buffer(int fd)
+{
+	struct nb_buffer *tee;
+
+	out_sinks[0] = new_socket_buffer(fd, false);
+	out_sinks[1] = nb_buffer_new_memory();
+
+	tee = nb_buffer_new_tee(out_sinks[0], out_sinks[1], NULL);
+	nb_buffer_tee_spill(tee, out_sinks[1], SPILL_MAX);
+	return tee;
+}
+
+
+/*
+ * Check that the memory buffer has got the same data as the socket.
+ */
+static void check_tee(int fd)
+{
+	nb_byte_t expected[BUFSIZE];
+	nb_byte_t got[BUFSIZE];
+	size_t offset = 0;
+	ssize_t len;
+	size_t count;
+
+	nb_buffer_rewind(out_sinks[1]);
+	do {
+		len = pread(fd, expected, BUFSIZE, offset);
+		count = nb_buffer_read(out_sinks[1], got, BUFSIZE);
+		assert(count == len);
+		assert(memcmp(got, expected, len) == 0);
+		offset += len;
+	} while (len > 0);
+
+	nb_buffer_delete(out_sinks[0]);
+	nb_buffer_delete(out_sinks[1]);
+}
+
+
+static void wait_for(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	poll(&pfd, 1, -1);
+}
+
+
+/*
+ * Read a chunk of data right from the window, or the usual way if the chunk
+ * continues in the next window.
+ */
+static size_t read_span(struct nb_buffer *in, nb_byte_t *buf)
+{
+	nb_byte_t *bytes;
+	size_t avail;
+
+	bytes = nb_buffer_peek_span(in, BUFSIZE, &avail);
+	if (avail < BUFSIZE)
+		return nb_buffer_read(in, buf, BUFSIZE);
+
+	memcpy(buf, bytes, BUFSIZE);
+	nb_buffer_consume(in, BUFSIZE);
+	return BUFSIZE;
+}
+
+
+/*
+ * Read a chunk of data, restart reading when the socket would block.
+ */
+static size_t read_chunk(struct nb_buffer *in, nb_byte_t *buf)
+{
+	size_t len;
+
+	if (in_span)
+		return read_span(in, buf);
+	if (in_sock == -1)
+		return nb_buffer_read(in, buf, BUFSIZE);
+
+	for (;;) {
+		nb_buffer_socket_mark(in);
+		len = nb_buffer_read(in, buf, BUFSIZE);
+		if (len == BUFSIZE || nb_buffer_get_error(in) != NB_ERR_AGAIN)
+			return len;
+
+		nb_buffer_socket_reset(in);
+		wait_for(in_sock, POLLIN);
+	}
+}
+
+
+/*
+ * Write a chunk of data, wait for the socket when too much data are pending.
+ */
+static void write_chunk(struct nb_buffer *out, nb_byte_t *buf, size_t len)
+{
+	size_t spilled = out_sinks[1] ? nb_buffer_get_written_total(out_sinks[1]) : 0;
+
+	if (out_reserve)
+		write_reserved(out, buf, len);
+	else
+		nb_buffer_write_slow(out, buf, len);
+
+	/* the tee's flushes only queue the data, drain them in small steps */
+	if (out_sinks[1]) {
+		assert(nb_buffer_get_written_total(out_sinks[1]) == spilled);
+		if (nb_buffer_tee_pending(out, out_sinks[1]) > SPILL_MAX)
+			assert(nb_buffer_get_error(out) == NB_ERR_AGAIN);
+		while (nb_buffer_tee_pending(out, out_sinks[1]) > SPILL_MAX)
+			nb_buffer_tee_drain(out, SPILL_MAX / 4);
+	}
+
+	if (out_sock == -1)
+		return;
+
+	while (nb_buffer_socket_pending(out_sock_buf) > SOCK_PENDING) {
+		wait_for(out_sock, POLLOUT);
+		nb_buffer_socket_send(out_sock_buf);
+	}
+}
+
+
+static void finish_socket(struct nb_buffer *out)
+{
+	if (out_sinks[1]) {
+		nb_buffer_tee_drain(out, SIZE_MAX);
+		assert(nb_buffer_tee_pending(out, out_sinks[1]) == 0);
+	}
+
+	while (nb_buffer_socket_send(out_sock_buf) == NB_ERR_AGAIN)
+		wait_for(out_sock, POLLOUT);
+	assert(nb_buffer_socket_pending(out_sock_buf) == 0);
+	assert(nb_buffer_socket_timeout(out_sock_buf) == -1);
+	shutdown(out_sock, SHUT_WR);
+}
+
+
+static struct nb_buffer *new_in_buffer(char *type, int fd)
+{
+	if (strcmp(type, "file") == 0)
+		return nb_buffer_new_file(fd);
+	if (strcmp(type, "mmap") == 0)
+		return nb_buffer_new_mmap(fd);
+	if (strcmp(type, "view") == 0)
+		return new_view_buffer(fd);
+	if (strcmp(type, "memory") == 0)
+		return new_memory_buffer(fd, false);
+	if (strcmp(type, "steal") == 0)
+		return new_memory_buffer(fd, true);
+	if (strcmp(type, "uring") == 0)
+		return nb_buffer_new_file_uring(fd);
+	if (strcmp(type, "prefetch") == 0)
+		return nb_buffer_new_file_prefetch(fd, 3);
+	if (strcmp(type, "adaptive") == 0)
+		return new_adaptive_buffer(fd);
+	if (strcmp(type, "socket") == 0)
+		return new_socket_buffer(fd, true);
+	if ((in_span = strcmp(type, "span") == 0))
+		return new_adaptive_buffer(fd);
+	if (strcmp(type, "lz") == 0)
+		return new_filter_buffer(fd, nb_buffer_new_lz);
+	if (strcmp(type, "crc") == 0)
+		return new_filter_buffer(fd, nb_buffer_new_crc);
+	if (strcmp(type, "direct") == 0)
+		return new_direct_buffer(fd);
+	if (strcmp(type, "spsc") == 0)
+		return new_spsc_buffer(fd, true);
+	if (strcmp(type, "shm") == 0)
+		return new_shm_buffer(fd, true);
+
+	fprintf(stderr, "Unknown buffer type: %s\n", type);
+	exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Write the data alternately by copying them and by reference.
+ */
+static size_t echo_writev(struct nb_buffer *in, struct nb_buffer *out)
+{
+	nb_byte_t chunk[BUFSIZE];
+	nb_byte_t *data = NULL;
+	size_t size = 0;
+	size_t len = 0;
+	size_t count;
+	size_t i;
+
+	while ((count = read_chunk(in, chunk)) > 0) {
+		if (len + count > size) {
+			size = 2 * size + REF_SIZE;
+			data = nb_realloc(data, size);
+		}
+		memcpy(data + len, chunk, count);
+		len += count;
+	}
+
+	for (i = 0; i < len; i += count) {
+		if ((i / BUFSIZE) % 2 == 0) {
+			count = MIN(BUFSIZE, len - i);
+			nb_buffer_write(out, data + i, count);
+		}
+		else {
+			count = MIN(REF_SIZE, len - i);
+			nb_buffer_write_ref(out, data + i, count);
+		}
+	}
+
+	nb_buffer_flush(out);
+	xfree(data);
+	return len;
+}
+
+
+/*
+ * Seek to a few offsets and compare what's read there with the file.
+ */
+static void check_seek(struct nb_buffer *in, int fd)
+{
+	nb_byte_t expected[BUFSIZE];
+	nb_byte_t got[BUFSIZE];
+	struct stat st;
+	size_t offsets[5];
+	ssize_t len;
+	size_t count;
+	size_t i;
+	int ret;
+
+	ret = fstat(fd, &st);
+	assert(ret == 0);
+	assert(nb_buffer_tell(in) == st.st_size);
+
+	offsets[0] = st.st_size / 3;
+	offsets[1] = 0;
+	offsets[2] = st.st_size;
+	offsets[3] = st.st_size / 2 + 1;
+	offsets[4] = st.st_size / 2;
+
+	for (i = 0; i < ARRAY_SIZE(offsets); i++) {
+		if (offsets[i] > st.st_size)
+			continue;
+		if (nb_buffer_seek(in, offsets[i]) == NB_ERR_UNSUP)
+			return;
+		assert(nb_buffer_tell(in) == offsets[i]);
+
+		len = pread(fd, expected, BUFSIZE, offsets[i]);
+		count = nb_buffer_read(in, got, BUFSIZE);
+		assert(count == len);
+		assert(memcmp(got, expected, len) == 0);
+		assert(nb_buffer_tell(in) == offsets[i] + len);
+	}
+}
 
 
 int main(int argc, char *argv[])
 {
 	char *fn_in;
 	char *fn_out;
+	char *in_type = "file";
+	char *out_type = "file";
 	int fd_in;
+	int fd_check;	/* not shared with the buffer, which may set O_DIRECT */
 	int fd_out;
 	struct nb_buffer *in;
 	struct nb_buffer *out;
@@ -34,30 +780,89 @@ int main(int argc, char *argv[])
 	size_t written_total = 0;
 	int fd_out_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
 
-	assert(argc == 3);
+	assert(argc >= 3 && argc <= 5);
 
 	fn_in = argv[1];
 	fn_out = argv[2];
+	if (argc >= 4)
+		in_type = argv[3];
+	if (argc >= 5)
+		out_type = argv[4];
 
 	fd_in = open(fn_in, O_RDONLY, 0);
+	fd_check = open(fn_in, O_RDONLY, 0);
 	fd_out = open(fn_out, O_RDWR | O_CREAT | O_TRUNC, fd_out_mode);
 
 	assert(fd_in != -1);
+	assert(fd_check != -1);
 	assert(fd_out != -1);
 
 	buf = nb_malloc(BUFSIZE);
-	in = nb_buffer_new_file(fd_in);
-	out = nb_buffer_new_file(fd_out);
+	in = new_in_buffer(in_type, fd_in);
 
-	while ((len = nb_buffer_read(in, buf, BUFSIZE)) > 0) {
-		nb_buffer_write_slow(out, buf, len);
-		written_total += len;
+	if (strcmp(out_type, "writev") == 0) {
+		out = nb_buffer_new_file_writev(fd_out);
+		written_total = echo_writev(in, out);
+	}
+	else {
+		if (strcmp(out_type, "uring") == 0)
+			out = nb_buffer_new_file_uring(fd_out);
+		else if (strcmp(out_type, "adaptive") == 0)
+			out = new_adaptive_buffer(fd_out);
+		else if (strcmp(out_type, "socket") == 0)
+			out = new_socket_buffer(fd_out, false);
+		else if ((out_reserve = strcmp(out_type, "reserve") == 0))
+			out = new_adaptive_buffer(fd_out);
+		else if (strcmp(out_type, "tee") == 0)
+			out = new_tee_buffer(fd_out);
+		else if (strcmp(out_type, "direct") == 0)
+			out = new_direct_buffer(fd_out);
+		else if (strcmp(out_type, "spsc") == 0)
+			out = new_spsc_buffer(fd_out, false);
+		else if (strcmp(out_type, "shm") == 0)
+			out = new_shm_buffer(fd_out, false);
+		else if (strcmp(out_type, "batched") == 0)
+			out = new_batched_buffer(fd_out);
+		else if (strcmp(out_type, "zerocopy") == 0)
+			out = new_zerocopy_buffer(fd_out);
+		else if (strcmp(out_type, "fixed") == 0)
+			out = new_fixed_buffer(fd_check);
+		else
+			out = nb_buffer_new_file(fd_out);
+
+		while ((len = read_chunk(in, buf)) > 0) {
+			write_chunk(out, buf, len);
+			written_total += len;
+		}
+
+		if (out_sock != -1)
+			finish_socket(out);
 	}
 
 	assert(written_total == nb_buffer_get_written_total(out));
+	assert(nb_buffer_tell(out) == written_total);
+	check_seek(in, fd_check);
+	if (out_fixed)
+		finish_fixed(out, fd_out);
 
 	nb_buffer_delete(in);
 	nb_buffer_delete(out);
+	if (in_memory)
+		xfree(in_memory);
+	xfree(buf);
+	if (in_lower)
+		nb_buffer_delete(in_lower);
+	if (out_sinks[0])
+		check_tee(fd_check);
+	while (num_spsc_threads > 0)
+		pthread_join(spsc_threads[--num_spsc_threads], NULL);
+
+	/* wait for the copiers */
+	if (in_sock != -1)
+		close(in_sock);
+	if (out_sock != -1)
+		close(out_sock);
+	while (wait(NULL) != -1);
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,214 @@
+/*
+ * Encode typed arrays (RFC 8746) of every element size and decode them back,
+ * by reference from a memory view and by copying from a file, which does not
+ * support references. The elements are also sent in the other byte order,
+ * split into chunks, with the clamped uint8 tag, and in a byte string whose
+ * length is not a multiple of the element size.
+ */
+
+#include "buffer.h"
+#include "cbor.h"
+#include "cbor-internal.h"
+#include "common.h"
+#include "diag.h"
+#include "memory.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_ITEMS	1000
+#define MAX_SIZE	8
+
+static const enum cbor_ta_type types[] = {
+	CBOR_TA_UINT8,
+	CBOR_TA_INT16,
+	CBOR_TA_UINT32,
+	CBOR_TA_FLOAT32,
+	CBOR_TA_UINT64,
+	CBOR_TA_FLOAT64,
+};
+
+static nb_byte_t data[NUM_ITEMS * MAX_SIZE];	/* the elements, in host order */
+static nb_byte_t swapped[NUM_ITEMS * MAX_SIZE];	/* the same in the other order */
+static struct diag diag;
+
+
+static void init_data(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 7 + i / 256;
+}
+
+
+static void swap_data(size_t size)
+{
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < NUM_ITEMS * size; i += size)
+		for (j = 0; j < size; j++)
+			swapped[i + j] = data[i + size - 1 - j];
+}
+
+
+/*
+ * The encoder calls stay out of assert, which may be compiled out.
+ */
+static void check_ok(nb_err_t err)
+{
+	assert(err == NB_ERR_OK);
+}
+
+
+static void encode(struct nb_buffer *buf)
+{
+	struct cbor_stream cs;
+	size_t half;
+	size_t size;
+	size_t i;
+
+	cbor_stream_init(&cs, buf);
+	cbor_stream_set_diag(&cs, &diag);
+
+	/* misalign the stream, the encoder shall pad the headers */
+	check_ok(cbor_encode_uint8(&cs, 1));
+
+	for (i = 0; i < ARRAY_SIZE(types); i++)
+		check_ok(cbor_encode_typed_array(&cs, types[i], data, NUM_ITEMS));
+
+	for (i = 0; i < ARRAY_SIZE(types); i++) {
+		size = ta_size(types[i]);
+		half = NUM_ITEMS / 2 * size + 1;
+		swap_data(size);
+
+		check_ok(cbor_encode_tag(&cs, ta_tag(types[i], !CBOR_TA_HOST_LE)));
+		check_ok(cbor_encode_bytes(&cs, swapped, NUM_ITEMS * size));
+
+		check_ok(cbor_encode_tag(&cs, ta_tag(types[i], !CBOR_TA_HOST_LE)));
+		check_ok(cbor_encode_bytes_begin_indef(&cs));
+		check_ok(cbor_encode_bytes(&cs, swapped, half));
+		check_ok(cbor_encode_bytes(&cs, swapped + half, NUM_ITEMS * size - half));
+		check_ok(cbor_encode_bytes_end(&cs));
+	}
+
+	check_ok(cbor_encode_tag(&cs, CBOR_TAG_TA_UINT8_CLAMPED));
+	check_ok(cbor_encode_bytes(&cs, data, NUM_ITEMS));
+
+	check_ok(cbor_encode_tag(&cs, ta_tag(CBOR_TA_UINT32, CBOR_TA_HOST_LE)));
+	check_ok(cbor_encode_bytes(&cs, data, 6));
+
+	nb_buffer_flush(buf);
+	cbor_stream_free(&cs);
+}
+
+
+static void save_error(struct cbor_stream *cs, nb_err_t err, void *arg)
+{
+	(void) cs;
+	*(nb_err_t *)arg = err;
+}
+
+
+/*
+ * Decode an array of type, expect the elements of data and check whether
+ * they were referenced in the memory of the view, if there is one.
+ */
+static void check_array(struct cbor_stream *cs, enum cbor_ta_type type,
+	const nb_byte_t *view, size_t view_len, bool ref)
+{
+	size_t size = ta_size(type);
+	const void *vals;
+	size_t nitems;
+
+	cbor_decode_typed_array(cs, type, &vals, &nitems);
+	assert(nitems == NUM_ITEMS);
+	assert((uintptr_t)vals % size == 0);
+	assert(memcmp(vals, data, NUM_ITEMS * size) == 0);
+
+	if (view)
+		assert(((const nb_byte_t *)vals >= view
+			&& (const nb_byte_t *)vals < view + view_len) == ref);
+}
+
+
+static void decode(struct nb_buffer *buf, const nb_byte_t *view, size_t view_len)
+{
+	struct cbor_stream cs;
+	nb_err_t err = NB_ERR_OK;
+	const void *vals;
+	size_t nitems;
+	uint8_t u8;
+	size_t i;
+
+	cbor_stream_init(&cs, buf);
+	cbor_stream_set_diag(&cs, &diag);
+	cbor_stream_set_error_handler(&cs, save_error, &err);
+
+	cbor_decode_uint8(&cs, &u8);
+	assert(u8 == 1);
+
+	for (i = 0; i < ARRAY_SIZE(types); i++)
+		check_array(&cs, types[i], view, view_len, true);
+
+	for (i = 0; i < ARRAY_SIZE(types); i++) {
+		check_array(&cs, types[i], view, view_len, ta_size(types[i]) == 1);
+		check_array(&cs, types[i], view, view_len, false);
+	}
+
+	check_array(&cs, CBOR_TA_UINT8, view, view_len, true);
+	assert(err == NB_ERR_OK);
+
+	cbor_decode_typed_array(&cs, CBOR_TA_UINT32, &vals, &nitems);
+	assert(err == NB_ERR_PARSE);
+	assert(vals == NULL && nitems == 0);
+
+	cbor_stream_free(&cs);
+}
+
+
+int main(void)
+{
+	struct nb_buffer *buf;
+	nb_byte_t *memory;
+	FILE *file;
+	size_t len;
+	size_t ret;
+	int err;
+
+	diag_init(&diag, stdout);
+	diag.enabled = false;
+	init_data();
+
+	buf = nb_buffer_new_memory();
+	encode(buf);
+	memory = nb_buffer_steal(buf, &len);
+	nb_buffer_delete(buf);
+
+	buf = nb_buffer_new_memory_view(memory, len);
+	decode(buf, memory, len);
+	nb_buffer_delete(buf);
+
+	file = tmpfile();
+	assert(file != NULL);
+	ret = fwrite(memory, 1, len, file);
+	assert(ret == len);
+	err = fflush(file);
+	assert(err == 0);
+	rewind(file);
+
+	buf = nb_buffer_new_file(fileno(file));
+	decode(buf, NULL, 0);
+	nb_buffer_delete(buf);
+
+	fclose(file);
+	xfree(memory);
+	diag_free(&diag);
+	return EXIT_SUCCESS;
+}
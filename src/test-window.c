@@ -0,0 +1,226 @@
+/*
+ * Check which flushes count as full windows: adaptive windows shall grow
+ * while a long stream of integers is encoded, or while data are written
+ * using nb_buffer_reserve, which flushes windows a few bytes short of full,
+ * but not when short windows are flushed explicitly. Direct file buffers
+ * shall stay in O_DIRECT mode until they are deleted.
+ */
+
+#define _GNU_SOURCE	/* O_DIRECT */
+
+#include "buffer.h"
+#include "cbor.h"
+#include "diag.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_INTS	(1024 * 1024)
+#define WINDOW_SIZE	4096
+#define RESERVE_LEN	100
+
+static struct diag diag;
+
+
+/*
+ * Mixed widths, so that the headers do not divide the window evenly.
+ */
+static uint32_t int_at(size_t i)
+{
+	return (i * 2654435761U) >> (i % 32);
+}
+
+
+static void save_error(struct cbor_stream *cs, nb_err_t err, void *arg)
+{
+	(void) cs;
+	*(nb_err_t *)arg = err;
+}
+
+
+static void check_ints(int fd)
+{
+	nb_err_t err = NB_ERR_OK;
+	struct cbor_stream cs;
+	struct nb_buffer *buf;
+	uint32_t val;
+	size_t i;
+
+	lseek(fd, 0, SEEK_SET);
+	buf = nb_buffer_new_file(fd);
+	cbor_stream_init(&cs, buf);
+	cbor_stream_set_diag(&cs, &diag);
+	cbor_stream_set_error_handler(&cs, save_error, &err);
+
+	for (i = 0; i < NUM_INTS; i++) {
+		cbor_decode_uint32(&cs, &val);
+		assert(val == int_at(i));
+	}
+	assert(err == NB_ERR_OK);
+
+	cbor_stream_free(&cs);
+	nb_buffer_delete(buf);
+}
+
+
+static void check_encoder_growth(void)
+{
+	struct nb_buffer_opts opts = { .size = WINDOW_SIZE, .adaptive = true };
+	struct cbor_stream cs;
+	struct nb_buffer *buf;
+	nb_err_t err;
+	FILE *file;
+	size_t i;
+
+	file = tmpfile();
+	buf = nb_buffer_new_file_opts(fileno(file), &opts);
+	cbor_stream_init(&cs, buf);
+	cbor_stream_set_diag(&cs, &diag);
+
+	for (i = 0; i < NUM_INTS; i++) {
+		err = cbor_encode_uint32(&cs, int_at(i));
+		assert(err == NB_ERR_OK);
+	}
+
+	assert(nb_buffer_get_size(buf) > WINDOW_SIZE);
+
+	cbor_stream_free(&cs);
+	nb_buffer_delete(buf);
+
+	check_ints(fileno(file));
+	fclose(file);
+}
+
+
+static void check_reserve_growth(void)
+{
+	struct nb_buffer_opts opts = { .size = WINDOW_SIZE, .adaptive = true };
+	struct nb_buffer *buf;
+	nb_byte_t *bytes;
+	FILE *file;
+	size_t i;
+
+	file = tmpfile();
+	buf = nb_buffer_new_file_opts(fileno(file), &opts);
+
+	/* WINDOW_SIZE is not a multiple of RESERVE_LEN */
+	for (i = 0; i < 100 * WINDOW_SIZE / RESERVE_LEN; i++) {
+		bytes = nb_buffer_reserve(buf, RESERVE_LEN);
+		assert(bytes != NULL);
+		memset(bytes, i, RESERVE_LEN);
+		nb_buffer_commit(buf, RESERVE_LEN);
+	}
+
+	assert(nb_buffer_get_size(buf) > WINDOW_SIZE);
+
+	nb_buffer_delete(buf);
+	fclose(file);
+}
+
+
+static void check_explicit_flushes(void)
+{
+	struct nb_buffer_opts opts = { .size = WINDOW_SIZE, .adaptive = true };
+	struct nb_buffer *buf;
+	nb_byte_t bytes[WINDOW_SIZE - 1] = { 0 };
+	ssize_t written;
+	FILE *file;
+	size_t i;
+
+	file = tmpfile();
+	buf = nb_buffer_new_file_opts(fileno(file), &opts);
+
+	for (i = 0; i < 100; i++) {
+		written = nb_buffer_write(buf, bytes, sizeof(bytes));
+		assert(written == sizeof(bytes));
+		nb_buffer_flush(buf);
+	}
+
+	assert(nb_buffer_get_size(buf) == WINDOW_SIZE);
+
+	nb_buffer_delete(buf);
+	fclose(file);
+}
+
+
+static bool is_direct(int fd)
+{
+	return fcntl(fd, F_GETFL) & O_DIRECT;
+}
+
+
+/*
+ * The file is created in the working directory, tmpfs (where tmpfile()
+ * files may end up) need not support O_DIRECT.
+ */
+static void check_direct(void)
+{
+	struct nb_buffer_opts opts = { .size = WINDOW_SIZE, .direct = true };
+	char filename[] = "test-window.XXXXXX";
+	struct cbor_stream cs;
+	struct nb_buffer *buf;
+	size_t total;
+	nb_err_t err;
+	size_t i;
+	int fd;
+
+	fd = mkstemp(filename);
+	assert(fd != -1);
+	unlink(filename);
+
+	buf = nb_buffer_new_file_opts(fd, &opts);
+	if (!is_direct(fd)) {
+		printf("O_DIRECT not supported here, skipping direct mode check\n");
+		nb_buffer_delete(buf);
+		close(fd);
+		return;
+	}
+
+	cbor_stream_init(&cs, buf);
+	cbor_stream_set_diag(&cs, &diag);
+
+	for (i = 0; i < NUM_INTS; i++) {
+		err = cbor_encode_uint32(&cs, int_at(i));
+		assert(err == NB_ERR_OK);
+
+		/* the window is most likely not block-aligned now */
+		if (i == NUM_INTS / 2) {
+			nb_buffer_flush(buf);
+			assert(nb_buffer_get_error(buf) == NB_ERR_OK);
+			assert(is_direct(fd));
+		}
+	}
+
+	assert(nb_buffer_get_flushes(buf) > 1);
+	assert(is_direct(fd));
+
+	total = nb_buffer_get_written_total(buf);
+	cbor_stream_free(&cs);
+	nb_buffer_delete(buf);
+
+	/* the padding of the last block has been cut off */
+	assert(lseek(fd, 0, SEEK_END) == (off_t)total);
+
+	check_ints(fd);
+	close(fd);
+}
+
+
+int main(void)
+{
+	diag_init(&diag, stdout);
+	diag.enabled = false;
+
+	check_encoder_growth();
+	check_reserve_growth();
+	check_explicit_flushes();
+	check_direct();
+
+	diag_free(&diag);
+	return EXIT_SUCCESS;
+}
@@ -16,6 +16,9 @@ NBDIAG=../build/nbdiag
 
 IO_DIR=io
 IO_RAND_FILES="1 5117 1k 8k 1M 16M"
+IO_TEXT_FILES="5117 1M"
+IO_BUF_TYPES="file mmap view memory steal uring prefetch adaptive socket span lz crc direct spsc shm"
+IO_OUT_BUF_TYPES="file writev uring adaptive socket reserve tee direct spsc shm batched zerocopy fixed"
 
 setup_test_files() {
 	if ! command -v jq >/dev/null; then
@@ -39,6 +42,12 @@ setup_test_files() {
 		dd if=/dev/urandom of=$testfile bs=$size count=1
 	done
 
+	# compressible data for the lz filter
+	for size in $IO_TEXT_FILES; do
+		testfile=$IO_DIR/$size.text
+		seq -f "route 10.%g.0.0/16 via 192.0.2.1 dev eth0" 1 100000 | head -c $size > $testfile
+	done
+
 	if [ ! -d $CBOR_RANDFILES_DIR ]; then
 		mkdir $CBOR_RANDFILES_DIR
 		for i in $(seq 1 $CBOR_NUM_RANDFILES); do
@@ -141,6 +150,17 @@ cbordump_vg() {
 	fi
 }
 
+cbordump_mirror() {
+	mirrored=$(xxd -p -r $1 | $NBDIAG -m 2>/dev/null | xxd -p)
+
+	if [ "$mirrored" != "$(xxd -p -r $1 | xxd -p)" ]; then
+		diff_error "$test (mirror)"
+		return 1
+	else
+		pass $test
+	fi
+}
+
 print_results() {
 	echo "$num_ok tests OK, $num_errs ERRORS, $num_skipped suites SKIPPED"
 }
@@ -165,6 +185,7 @@ run_cbor_positive_tests() {
 			pass $test
 
 			cbordump_vg $in
+			cbordump_mirror $in
 
 			if [ -f $out ]; then
 				if ! diff -q --ignore-all-space $out $out_test >/dev/null; then
@@ -207,18 +228,40 @@ run_cbor_negative_tests() {
 }
 
 
-run_io_buf_echo_tests() {
-	for test in $IO_DIR/*; do
-		out=$test.out
-		../build/test-stream $test $out
-
-		if ! diff -q $test $out >/dev/null; then
-			diff_error $test
+run_unit_tests() {
+	for test in test-array test-crc test-lz test-pool test-typed test-window; do
+		if ! ../build/$test >/dev/null; then
+			runtime_error $test
 		else
 			pass $test
 		fi
+	done
 
-		rm $out
+	# the software CRC-32C is only used where the CPU has no CRC instructions
+	if ! NB_CRC32C_SW=1 ../build/test-crc >/dev/null; then
+		runtime_error "test-crc (software)"
+	else
+		pass "test-crc (software)"
+	fi
+}
+
+
+run_io_buf_echo_tests() {
+	for test in $IO_DIR/*; do
+		for type in $IO_BUF_TYPES; do
+			for out_type in $IO_OUT_BUF_TYPES; do
+				out=$test.out
+				../build/test-stream $test $out $type $out_type
+
+				if ! diff -q $test $out >/dev/null; then
+					diff_error "$test ($type, $out_type)"
+				else
+					pass "$test ($type, $out_type)"
+				fi
+
+				rm $out
+			done
+		done
 	done
 }
 
@@ -230,6 +273,7 @@ num_ok=0
 make --directory=../build all
 
 setup_test_files
+run_unit_tests
 run_cbor_positive_tests
 run_cbor_negative_tests
 run_io_buf_echo_tests